@@ -0,0 +1,143 @@
+/**
+ * @file aesd-buffer-pool.c
+ * @brief Size class caches for the command buffers of the aesdchar driver
+ *
+ * Buffers up to the largest size class come from a dedicated kmem_cache
+ * per class, bigger ones from kmalloc.
+ * A buffer always belongs to the smallest class that fits its size,
+ * so the class (and its capacity) can be derived from the size stored in
+ * the corresponding struct aesd_buffer_entry.
+ * Freed buffers go to the per cpu freelist of their cache, so the buffer
+ * of an evicted entry is handed out again by the next allocation of the same class.
+ */
+
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "aesd-buffer-pool.h"
+
+struct aesd_size_class
+{
+	const char* name;
+	size_t size;
+	struct kmem_cache* cache;
+};
+
+static struct aesd_size_class size_classes[] = {
+	{ .name = "aesdchar-32", .size = 32 },
+	{ .name = "aesdchar-64", .size = 64 },
+	{ .name = "aesdchar-96", .size = 96 },
+	{ .name = "aesdchar-128", .size = 128 },
+	{ .name = "aesdchar-192", .size = 192 },
+	{ .name = "aesdchar-256", .size = 256 },
+	{ .name = "aesdchar-384", .size = 384 },
+	{ .name = "aesdchar-512", .size = 512 },
+	{ .name = "aesdchar-768", .size = 768 },
+	{ .name = "aesdchar-1024", .size = 1024 },
+	{ .name = "aesdchar-1536", .size = 1536 },
+	{ .name = "aesdchar-2048", .size = 2048 },
+	{ .name = "aesdchar-3072", .size = 3072 },
+	{ .name = "aesdchar-4096", .size = 4096 },
+};
+
+/**
+ * @return the smallest size class with at least @param size bytes, or NULL if the buffer must come from kmalloc
+ */
+static struct aesd_size_class* aesd_buffer_pool_class_for(size_t size)
+{
+	for( unsigned int i=0; i<ARRAY_SIZE(size_classes); i++ ) {
+		if( size <= size_classes[i].size ) {
+			return &size_classes[i];
+		}
+	}
+	return NULL;
+}
+
+int aesd_buffer_pool_init(void)
+{
+	for( unsigned int i=0; i<ARRAY_SIZE(size_classes); i++ ) {
+		// the whole object is copied to/from user space:
+		size_classes[i].cache = kmem_cache_create_usercopy(
+				size_classes[i].name,
+				size_classes[i].size,
+				0, 0,
+				0, size_classes[i].size,
+				NULL
+		);
+		if( size_classes[i].cache == NULL ) {
+			aesd_buffer_pool_exit();
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+void aesd_buffer_pool_exit(void)
+{
+	for( unsigned int i=0; i<ARRAY_SIZE(size_classes); i++ ) {
+		// (kmem_cache_destroy ignores NULL)
+		kmem_cache_destroy( size_classes[i].cache );
+		size_classes[i].cache = NULL;
+	}
+}
+
+/**
+ * @return a buffer for at least @param size bytes, or NULL
+ */
+char* aesd_buffer_pool_alloc(
+		size_t size
+)
+{
+	struct aesd_size_class* size_class = aesd_buffer_pool_class_for( size );
+	if( size_class == NULL ) {
+		return kmalloc( size, GFP_KERNEL );
+	}
+	return kmem_cache_alloc( size_class->cache, GFP_KERNEL );
+}
+
+/**
+ * Make room for @param new_size bytes in a buffer currently holding @param size bytes.
+ * @param buffptr the buffer, may be NULL if size is 0
+ * @return @param buffptr if the new size still fits its size class.
+ * Otherwise a new buffer with the first @param size bytes copied from @param buffptr,
+ * which is left untouched and has to be freed by the caller.
+ * NULL if no memory is available.
+ */
+char* aesd_buffer_pool_reserve(
+		const char* buffptr,
+		size_t size,
+		size_t new_size
+)
+{
+	if( buffptr != NULL ) {
+		struct aesd_size_class* size_class = aesd_buffer_pool_class_for( size );
+		if( size_class != NULL && new_size <= size_class->size ) {
+			return (char* )buffptr;
+		}
+	}
+	char* new_buffptr = aesd_buffer_pool_alloc( new_size );
+	if( new_buffptr != NULL && buffptr != NULL ) {
+		memcpy( new_buffptr, buffptr, size );
+	}
+	return new_buffptr;
+}
+
+/**
+ * Free a buffer returned by aesd_buffer_pool_alloc or aesd_buffer_pool_reserve.
+ * @param size the number of bytes currently stored in @param buffptr
+ */
+void aesd_buffer_pool_free(
+		const char* buffptr,
+		size_t size
+)
+{
+	if( buffptr == NULL ) {
+		return;
+	}
+	struct aesd_size_class* size_class = aesd_buffer_pool_class_for( size );
+	if( size_class == NULL ) {
+		kfree( buffptr );
+		return;
+	}
+	kmem_cache_free( size_class->cache, (void* )buffptr );
+}
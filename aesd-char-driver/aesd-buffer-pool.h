@@ -0,0 +1,31 @@
+/*
+ * aesd-buffer-pool.h
+ *
+ * Size class caches for the command buffers of the aesdchar driver
+ */
+
+#ifndef AESD_BUFFER_POOL_H
+#define AESD_BUFFER_POOL_H
+
+#include <linux/types.h>
+
+extern int aesd_buffer_pool_init(void);
+
+extern void aesd_buffer_pool_exit(void);
+
+extern char* aesd_buffer_pool_alloc(
+		size_t size
+);
+
+extern char* aesd_buffer_pool_reserve(
+		const char* buffptr,
+		size_t size,
+		size_t new_size
+);
+
+extern void aesd_buffer_pool_free(
+		const char* buffptr,
+		size_t size
+);
+
+#endif /* AESD_BUFFER_POOL_H */
@@ -32,19 +32,30 @@ struct aesd_buffer_entry* aesd_circular_buffer_find_entry_offset_for_fpos(
 		size_t* entry_offset_byte_rtn
 )
 {
-	size_t pos_bytes = 0;
-	unsigned int index = buffer->out_offs;
-	do
-	{
-		if( char_offset < pos_bytes + buffer->entry[index].size ) {
-			(*entry_offset_byte_rtn) = char_offset - pos_bytes;
-			return &buffer->entry[index];
+	if( char_offset >= buffer->size ) {
+		return NULL;
+	}
+	const uint64_t base_offset = buffer->entry[buffer->out_offs].start_offset;
+	// binary search for the last entry starting at or before char_offset:
+	unsigned int low = 0;
+	unsigned int high = aesd_circular_buffer_get_count( buffer );
+	while( high - low > 1 ) {
+		unsigned int mid = low + (high - low) / 2;
+		struct aesd_buffer_entry* entry = aesd_circular_buffer_get_entry( buffer, mid );
+		if( entry->start_offset - base_offset <= char_offset ) {
+			low = mid;
+		}
+		else {
+			high = mid;
 		}
-		pos_bytes += buffer->entry[index].size;
-		index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
 	}
-	while( index != buffer->out_offs );
-	return NULL;
+	struct aesd_buffer_entry* entry = aesd_circular_buffer_get_entry( buffer, low );
+	const size_t entry_pos = (size_t )(entry->start_offset - base_offset);
+	if( char_offset >= entry_pos + entry->size ) {
+		return NULL;
+	}
+	(*entry_offset_byte_rtn) = char_offset - entry_pos;
+	return entry;
 }
 
 int aesd_circular_buffer_fpos_for_entry(
@@ -54,22 +65,24 @@ int aesd_circular_buffer_fpos_for_entry(
 		size_t* fpos
 )
 {
-	size_t pos_bytes = 0;
-	unsigned int index = buffer->out_offs;
-	do
-	{
-		if( &buffer->entry[index] == entry ) {
-			if( entry_offset >= entry->size ) {
-				return 1;
-			}
-			(*fpos) = pos_bytes+entry_offset;
-			return 0;
-		}
-		pos_bytes += buffer->entry[index].size;
-		index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+	if(
+			entry < &buffer->entry[0]
+			|| entry >= &buffer->entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED]
+	) {
+		return 1;
+	}
+	unsigned int index = entry - buffer->entry;
+	unsigned int cmd_index =
+		(index + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - buffer->out_offs)
+		% AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+	if( cmd_index >= aesd_circular_buffer_get_count( buffer ) ) {
+		return 1;
+	}
+	if( entry_offset >= entry->size ) {
+		return 1;
 	}
-	while( index != buffer->out_offs );
-	return 1;
+	(*fpos) = (size_t )(entry->start_offset - buffer->entry[buffer->out_offs].start_offset) + entry_offset;
+	return 0;
 }
 
 unsigned int aesd_circular_buffer_get_count(
@@ -92,19 +105,136 @@ unsigned int aesd_circular_buffer_get_count(
 	return entry_count;
 }
 
+/**
+ * @param index the zero referenced write command, counting from the oldest entry in the buffer
+ * @return the corresponding entry, or NULL if index is not available in the buffer
+ */
+struct aesd_buffer_entry* aesd_circular_buffer_get_entry(
+		struct aesd_circular_buffer *buffer,
+		unsigned int index
+)
+{
+	if( index >= aesd_circular_buffer_get_count( buffer ) ) {
+		return NULL;
+	}
+	return &buffer->entry[
+		(buffer->out_offs + index) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+	];
+}
+
 size_t aesd_circular_buffer_get_size(
 		struct aesd_circular_buffer *buffer
 )
 {
-	size_t size = 0;
-	unsigned int index = buffer->out_offs;
-	do
-	{
-		size += buffer->entry[index].size;
-		index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-	}
-	while( index != buffer->out_offs );
-	return size;
+	return buffer->size;
+}
+
+/**
+ * @return the position of the oldest byte in the buffer if all entries ever added were concatenated end to end.
+ * Equal to buffer->end_offset if the buffer is empty
+ */
+uint64_t aesd_circular_buffer_get_start_offset(
+		struct aesd_circular_buffer *buffer
+)
+{
+	return buffer->end_offset - buffer->size;
+}
+
+/**
+ * @return the seq of the oldest entry in the buffer.
+ * Equal to buffer->next_seq if the buffer is empty
+ */
+uint64_t aesd_circular_buffer_get_first_seq(
+		struct aesd_circular_buffer *buffer
+)
+{
+	return buffer->next_seq - aesd_circular_buffer_get_count( buffer );
+}
+
+/**
+ * Describe up to @param count bytes starting at @param char_offset as a list of memory ranges, in ring order.
+ * Any necessary locking must be performed by caller, the ranges point into the entries
+ * and are only valid until the buffer is modified.
+ * @param char_offset the zero referenced position of the first byte, as for aesd_circular_buffer_find_entry_offset_for_fpos
+ * @param iov array of @param iov_count elements to fill.
+ * At most AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED elements are needed to describe the whole buffer.
+ * @param bytes_rtn is set to the total number of bytes described, which is less than @param count
+ * if the end of the buffer or of @param iov is reached first
+ * @return the number of elements of @param iov filled
+ */
+unsigned int aesd_circular_buffer_iovec_for_range(
+		struct aesd_circular_buffer *buffer,
+		size_t char_offset,
+		size_t count,
+		aesd_iovec_t* iov,
+		unsigned int iov_count,
+		size_t* bytes_rtn
+)
+{
+	unsigned int iov_used = 0;
+	size_t bytes = 0;
+	size_t offset = 0;
+	struct aesd_buffer_entry* entry = aesd_circular_buffer_find_entry_offset_for_fpos(
+			buffer,
+			char_offset,
+			&offset
+	);
+	if( entry != NULL ) {
+		unsigned int index = (entry - buffer->entry + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - buffer->out_offs)
+			% AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+		for( ; iov_used < iov_count && bytes < count; index++ ) {
+			entry = aesd_circular_buffer_get_entry( buffer, index );
+			if( entry == NULL ) {
+				break;
+			}
+			size_t len = entry->size - offset;
+			if( len > count - bytes ) {
+				len = count - bytes;
+			}
+			iov[iov_used].iov_base = (void* )&entry->buffptr[offset];
+			iov[iov_used].iov_len = len;
+			iov_used++;
+			bytes += len;
+			offset = 0;
+		}
+	}
+	(*bytes_rtn) = bytes;
+	return iov_used;
+}
+
+/**
+ * Describe @param entry_count entries starting at @param index as a list of memory ranges,
+ * one per entry, in ring order.
+ * Any necessary locking must be performed by caller, the ranges point into the entries
+ * and are only valid until the buffer is modified.
+ * @param index the zero referenced write command, counting from the oldest entry in the buffer
+ * @param iov array of @param iov_count elements to fill
+ * @param bytes_rtn is set to the total number of bytes described
+ * @return the number of elements of @param iov filled, less than @param entry_count
+ * if the buffer holds fewer entries or @param iov is too short
+ */
+unsigned int aesd_circular_buffer_iovec_for_entries(
+		struct aesd_circular_buffer *buffer,
+		unsigned int index,
+		unsigned int entry_count,
+		aesd_iovec_t* iov,
+		unsigned int iov_count,
+		size_t* bytes_rtn
+)
+{
+	unsigned int iov_used = 0;
+	size_t bytes = 0;
+	for( ; iov_used < entry_count && iov_used < iov_count; iov_used++ ) {
+		struct aesd_buffer_entry* entry = aesd_circular_buffer_get_entry( buffer, index + iov_used );
+		if( entry == NULL ) {
+			break;
+		}
+		iov[iov_used].iov_base = (void* )entry->buffptr;
+		iov[iov_used].iov_len = entry->size;
+		bytes += entry->size;
+	}
+	(*bytes_rtn) = bytes;
+	return iov_used;
 }
 
 /**
@@ -113,6 +243,8 @@ size_t aesd_circular_buffer_get_size(
 * new start location.
 * Any necessary locking must be handled by the caller
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
+* The start_offset and seq members of @param add_entry are ignored,
+* the stored entry gets the current end of the buffer and the next sequence number.
 */
 void aesd_circular_buffer_add_entry(
 		struct aesd_circular_buffer* buffer,
@@ -124,6 +256,10 @@ void aesd_circular_buffer_add_entry(
 	DEBUG_LOG( "count: %d\n", entry_count );
 	// 2. add element:
 	buffer->entry[buffer->in_offs] = (*add_entry);
+	buffer->entry[buffer->in_offs].start_offset = buffer->end_offset;
+	buffer->entry[buffer->in_offs].seq = buffer->next_seq;
+	buffer->end_offset += add_entry->size;
+	buffer->next_seq++;
 	buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
 	// 3. handle corner cases:
 	if( entry_count < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED ) {
@@ -134,6 +270,37 @@ void aesd_circular_buffer_add_entry(
 	else {
 		buffer->out_offs = buffer->in_offs;
 	}
+	// 4. update size (independent of the size of an overwritten entry):
+	buffer->size = (size_t )(buffer->end_offset - buffer->entry[buffer->out_offs].start_offset);
+}
+
+/**
+* Removes the oldest entry from @param buffer and stores it in @param removed_entry.
+* The file positions of the remaining entries move down by the size of the removed entry.
+* Any necessary locking must be handled by the caller
+* Freeing the memory referenced by the removed entry is up to the caller.
+* @return 0 on success, 1 if the buffer is empty
+*/
+int aesd_circular_buffer_remove_oldest(
+		struct aesd_circular_buffer *buffer,
+		struct aesd_buffer_entry *removed_entry
+)
+{
+	if( aesd_circular_buffer_get_count( buffer ) == 0 ) {
+		return 1;
+	}
+	(*removed_entry) = buffer->entry[buffer->out_offs];
+	buffer->entry[buffer->out_offs].buffptr = NULL;
+	buffer->entry[buffer->out_offs].size = 0;
+	buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+	buffer->full = false;
+	if( buffer->out_offs == buffer->in_offs ) {
+		buffer->size = 0;
+	}
+	else {
+		buffer->size = (size_t )(buffer->end_offset - buffer->entry[buffer->out_offs].start_offset);
+	}
+	return 0;
 }
 
 /**
@@ -10,20 +10,36 @@
 
 #ifdef __KERNEL__
 #include <linux/types.h>
+#include <linux/uio.h> // kvec
 #else
 #include <stddef.h> // size_t
 #include <stdint.h> // uintx_t
 #include <stdbool.h>
+#include <sys/uio.h> // iovec
 #endif
 
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
 
+// Scatter/gather element filled by the aesd_circular_buffer_iovec_* functions,
+// passed to iov_iter_kvec in the kernel and to writev in user space:
+#ifdef __KERNEL__
+typedef struct kvec aesd_iovec_t;
+#else
+typedef struct iovec aesd_iovec_t;
+#endif
+
 struct aesd_buffer_entry
 {
 	// A location where the buffer contents in buffptr are stored:
 	const char *buffptr;
 	// Number of bytes stored in buffptr:
 	size_t size;
+	// Position of buffptr[0] if all entries ever added were concatenated end to end.
+	// Set by aesd_circular_buffer_add_entry:
+	uint64_t start_offset;
+	// Number of entries added before this one.
+	// Set by aesd_circular_buffer_add_entry:
+	uint64_t seq;
 };
 
 struct aesd_circular_buffer
@@ -36,16 +52,35 @@ struct aesd_circular_buffer
 	uint8_t out_offs;
 	// set to true when the buffer entry structure is full:
 	bool full;
+	// Number of bytes of all entries ever added (= start_offset of the next entry):
+	uint64_t end_offset;
+	// Number of entries ever added (= seq of the next entry):
+	uint64_t next_seq;
+	// Number of bytes currently stored in the buffer:
+	size_t size;
 };
 
 extern unsigned int aesd_circular_buffer_get_count(
 		struct aesd_circular_buffer *buffer
 );
 
+extern struct aesd_buffer_entry* aesd_circular_buffer_get_entry(
+		struct aesd_circular_buffer *buffer,
+		unsigned int index
+);
+
 extern size_t aesd_circular_buffer_get_size(
 		struct aesd_circular_buffer *buffer
 );
 
+extern uint64_t aesd_circular_buffer_get_start_offset(
+		struct aesd_circular_buffer *buffer
+);
+
+extern uint64_t aesd_circular_buffer_get_first_seq(
+		struct aesd_circular_buffer *buffer
+);
+
 extern struct aesd_buffer_entry* aesd_circular_buffer_find_entry_offset_for_fpos(
 		struct aesd_circular_buffer *buffer,
   	size_t char_offset,
@@ -59,11 +94,34 @@ extern int aesd_circular_buffer_fpos_for_entry(
 		size_t* fpos
 );
 
+extern unsigned int aesd_circular_buffer_iovec_for_range(
+		struct aesd_circular_buffer *buffer,
+		size_t char_offset,
+		size_t count,
+		aesd_iovec_t* iov,
+		unsigned int iov_count,
+		size_t* bytes_rtn
+);
+
+extern unsigned int aesd_circular_buffer_iovec_for_entries(
+		struct aesd_circular_buffer *buffer,
+		unsigned int index,
+		unsigned int entry_count,
+		aesd_iovec_t* iov,
+		unsigned int iov_count,
+		size_t* bytes_rtn
+);
+
 extern void aesd_circular_buffer_add_entry(
 		struct aesd_circular_buffer *buffer,
 		const struct aesd_buffer_entry *add_entry
 );
 
+extern int aesd_circular_buffer_remove_oldest(
+		struct aesd_circular_buffer *buffer,
+		struct aesd_buffer_entry *removed_entry
+);
+
 extern void aesd_circular_buffer_init(
 		struct aesd_circular_buffer *buffer
 );
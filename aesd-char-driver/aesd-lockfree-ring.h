@@ -0,0 +1,172 @@
+/*
+ * aesd-lockfree-ring.h
+ *
+ * Lock free ring buffers for passing elements between user space threads,
+ * built on C11 atomics:
+ *
+ * AESD_SPSC_RING_DECLARE: one producer thread, one consumer thread
+ * AESD_MPSC_RING_DECLARE: any number of producer threads, one consumer thread
+ *
+ * Capacity is a power of two, head and tail live on separate cache lines.
+ * See aesd-ring.h for the single threaded variant.
+ */
+
+#ifndef AESD_LOCKFREE_RING_H
+#define AESD_LOCKFREE_RING_H
+
+#ifdef __KERNEL__
+#error "aesd-lockfree-ring.h is user space only"
+#endif
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uintx_t
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#ifndef AESD_CACHE_LINE_SIZE
+#define AESD_CACHE_LINE_SIZE 64
+#endif
+
+/**
+ * Declare struct @param name holding up to 2^@param capacity_log2 elements of @param type
+ * for exactly one producer and one consumer thread, with functions
+ * name_init, name_count, name_push, name_pop.
+ * name_push must only be called by the producer, name_pop only by the consumer.
+ */
+#define AESD_SPSC_RING_DECLARE(name, type, capacity_log2) \
+\
+struct name \
+{ \
+	/* number of elements pushed so far, written by the producer: */ \
+	_Alignas(AESD_CACHE_LINE_SIZE) _Atomic uint32_t head; \
+	/* number of elements popped so far, written by the consumer: */ \
+	_Alignas(AESD_CACHE_LINE_SIZE) _Atomic uint32_t tail; \
+	_Alignas(AESD_CACHE_LINE_SIZE) type entry[1u << (capacity_log2)]; \
+}; \
+\
+static inline void name##_init(struct name* ring) \
+{ \
+	atomic_init( &ring->head, 0 ); \
+	atomic_init( &ring->tail, 0 ); \
+} \
+\
+/* only a snapshot if called concurrently to push/pop */ \
+static inline uint32_t name##_count(struct name* ring) \
+{ \
+	return atomic_load_explicit( &ring->head, memory_order_acquire ) \
+		- atomic_load_explicit( &ring->tail, memory_order_acquire ); \
+} \
+\
+/* @return false if the ring is full */ \
+static inline bool name##_push(struct name* ring, const type* element) \
+{ \
+	const uint32_t capacity = 1u << (capacity_log2); \
+	uint32_t head = atomic_load_explicit( &ring->head, memory_order_relaxed ); \
+	uint32_t tail = atomic_load_explicit( &ring->tail, memory_order_acquire ); \
+	if( head - tail == capacity ) { \
+		return false; \
+	} \
+	ring->entry[head & (capacity - 1)] = (*element); \
+	atomic_store_explicit( &ring->head, head + 1, memory_order_release ); \
+	return true; \
+} \
+\
+/* @return false if the ring is empty */ \
+static inline bool name##_pop(struct name* ring, type* element) \
+{ \
+	const uint32_t capacity = 1u << (capacity_log2); \
+	uint32_t tail = atomic_load_explicit( &ring->tail, memory_order_relaxed ); \
+	uint32_t head = atomic_load_explicit( &ring->head, memory_order_acquire ); \
+	if( head == tail ) { \
+		return false; \
+	} \
+	(*element) = ring->entry[tail & (capacity - 1)]; \
+	atomic_store_explicit( &ring->tail, tail + 1, memory_order_release ); \
+	return true; \
+}
+
+/**
+ * Declare struct @param name holding up to 2^@param capacity_log2 elements of @param type
+ * for any number of producer threads and one consumer thread, with functions
+ * name_init, name_push, name_pop.
+ * name_pop must only be called by the consumer.
+ * Every slot carries a sequence number telling whether it is ready to be
+ * written (seq == position) or read (seq == position + 1), so producers only
+ * contend on a compare and swap of head.
+ */
+#define AESD_MPSC_RING_DECLARE(name, type, capacity_log2) \
+\
+struct name##_slot \
+{ \
+	_Atomic uint32_t seq; \
+	type value; \
+}; \
+\
+struct name \
+{ \
+	/* next position to write, claimed by producers: */ \
+	_Alignas(AESD_CACHE_LINE_SIZE) _Atomic uint32_t head; \
+	/* next position to read, only used by the consumer: */ \
+	_Alignas(AESD_CACHE_LINE_SIZE) uint32_t tail; \
+	_Alignas(AESD_CACHE_LINE_SIZE) struct name##_slot slot[1u << (capacity_log2)]; \
+}; \
+\
+static inline void name##_init(struct name* ring) \
+{ \
+	atomic_init( &ring->head, 0 ); \
+	ring->tail = 0; \
+	for( uint32_t i=0; i<(1u << (capacity_log2)); i++ ) { \
+		atomic_init( &ring->slot[i].seq, i ); \
+	} \
+} \
+\
+/* @return false if the ring is full */ \
+static inline bool name##_push(struct name* ring, const type* element) \
+{ \
+	const uint32_t capacity = 1u << (capacity_log2); \
+	uint32_t pos = atomic_load_explicit( &ring->head, memory_order_relaxed ); \
+	struct name##_slot* slot; \
+	while( true ) { \
+		slot = &ring->slot[pos & (capacity - 1)]; \
+		uint32_t seq = atomic_load_explicit( &slot->seq, memory_order_acquire ); \
+		int32_t diff = (int32_t )(seq - pos); \
+		if( diff == 0 ) { \
+			/* slot free, try to claim it (updates pos on failure): */ \
+			if( atomic_compare_exchange_weak_explicit( \
+					&ring->head, &pos, pos + 1, \
+					memory_order_relaxed, memory_order_relaxed \
+			) ) { \
+				break; \
+			} \
+		} \
+		else if( diff < 0 ) { \
+			/* slot still holds an element from the previous round: */ \
+			return false; \
+		} \
+		else { \
+			/* another producer claimed pos: */ \
+			pos = atomic_load_explicit( &ring->head, memory_order_relaxed ); \
+		} \
+	} \
+	slot->value = (*element); \
+	atomic_store_explicit( &slot->seq, pos + 1, memory_order_release ); \
+	return true; \
+} \
+\
+/* @return false if the ring is empty, or the oldest claimed slot is not written yet */ \
+static inline bool name##_pop(struct name* ring, type* element) \
+{ \
+	const uint32_t capacity = 1u << (capacity_log2); \
+	struct name##_slot* slot = &ring->slot[ring->tail & (capacity - 1)]; \
+	uint32_t seq = atomic_load_explicit( &slot->seq, memory_order_acquire ); \
+	if( seq != ring->tail + 1 ) { \
+		return false; \
+	} \
+	(*element) = slot->value; \
+	/* free the slot for the next round: */ \
+	atomic_store_explicit( &slot->seq, ring->tail + capacity, memory_order_release ); \
+	ring->tail++; \
+	return true; \
+}
+
+#endif /* AESD_LOCKFREE_RING_H */
@@ -0,0 +1,181 @@
+/*
+ * aesd-ring.h
+ *
+ * Type generic ring buffer with power of two capacity,
+ * usable in kernel and user space.
+ *
+ * Example usage:
+ * AESD_RING_DECLARE(int_ring, int, 4)  // struct int_ring holds up to 16 ints
+ * struct int_ring ring;
+ * int_ring_init( &ring );
+ * int_ring_push( &ring, &value );
+ *
+ * Like aesd-circular-buffer, any necessary locking must be performed by the caller.
+ */
+
+#ifndef AESD_RING_H
+#define AESD_RING_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/string.h>
+#else
+#include <stddef.h> // size_t
+#include <stdint.h> // uintx_t
+#include <stdbool.h>
+#include <string.h>
+#endif
+
+/**
+ * Number of elements a ring can hold
+ * @param ring is a pointer to a struct declared via AESD_RING_DECLARE
+ */
+#define AESD_RING_CAPACITY(ring) \
+	((uint32_t )(sizeof((ring)->entry) / sizeof((ring)->entry[0])))
+
+#define AESD_RING_MASK(ring) \
+	(AESD_RING_CAPACITY(ring) - 1)
+
+/**
+ * Declare struct @param name holding up to 2^@param capacity_log2 elements of @param type,
+ * and static inline functions name_init, name_count, name_push, ... operating on it.
+ * head and tail count all elements ever pushed/popped and wrap around,
+ * entry indices are computed by masking.
+ */
+#define AESD_RING_DECLARE(name, type, capacity_log2) \
+\
+struct name \
+{ \
+	type entry[1u << (capacity_log2)]; \
+	/* number of elements pushed so far: */ \
+	uint32_t head; \
+	/* number of elements popped so far: */ \
+	uint32_t tail; \
+}; \
+\
+static inline void name##_init(struct name* ring) \
+{ \
+	ring->head = 0; \
+	ring->tail = 0; \
+} \
+\
+static inline uint32_t name##_count(const struct name* ring) \
+{ \
+	return ring->head - ring->tail; \
+} \
+\
+static inline bool name##_empty(const struct name* ring) \
+{ \
+	return ring->head == ring->tail; \
+} \
+\
+static inline bool name##_full(const struct name* ring) \
+{ \
+	return name##_count( ring ) == AESD_RING_CAPACITY( ring ); \
+} \
+\
+/* @return the element @param index positions after the oldest one, or NULL */ \
+static inline type* name##_peek(struct name* ring, uint32_t index) \
+{ \
+	if( index >= name##_count( ring ) ) { \
+		return NULL; \
+	} \
+	return &ring->entry[(ring->tail + index) & AESD_RING_MASK( ring )]; \
+} \
+\
+/* @return false if the ring is full */ \
+static inline bool name##_push(struct name* ring, const type* element) \
+{ \
+	if( name##_full( ring ) ) { \
+		return false; \
+	} \
+	ring->entry[ring->head & AESD_RING_MASK( ring )] = (*element); \
+	ring->head++; \
+	return true; \
+} \
+\
+/* push, dropping the oldest element if the ring is full. \
+ * @return true if an element was dropped, it is stored in @param dropped (if not NULL) */ \
+static inline bool name##_push_overwrite(struct name* ring, const type* element, type* dropped) \
+{ \
+	bool full = name##_full( ring ); \
+	if( full ) { \
+		if( dropped != NULL ) { \
+			(*dropped) = ring->entry[ring->tail & AESD_RING_MASK( ring )]; \
+		} \
+		ring->tail++; \
+	} \
+	ring->entry[ring->head & AESD_RING_MASK( ring )] = (*element); \
+	ring->head++; \
+	return full; \
+} \
+\
+/* @return false if the ring is empty */ \
+static inline bool name##_pop(struct name* ring, type* element) \
+{ \
+	if( name##_empty( ring ) ) { \
+		return false; \
+	} \
+	(*element) = ring->entry[ring->tail & AESD_RING_MASK( ring )]; \
+	ring->tail++; \
+	return true; \
+} \
+\
+/* push up to @param count elements from @param elements. \
+ * @return the number of elements pushed */ \
+static inline uint32_t name##_push_bulk(struct name* ring, const type* elements, uint32_t count) \
+{ \
+	uint32_t space = AESD_RING_CAPACITY( ring ) - name##_count( ring ); \
+	if( count > space ) { \
+		count = space; \
+	} \
+	uint32_t start = ring->head & AESD_RING_MASK( ring ); \
+	uint32_t first_part = AESD_RING_CAPACITY( ring ) - start; \
+	if( first_part > count ) { \
+		first_part = count; \
+	} \
+	memcpy( &ring->entry[start], elements, first_part * sizeof(type) ); \
+	memcpy( &ring->entry[0], &elements[first_part], (count - first_part) * sizeof(type) ); \
+	ring->head += count; \
+	return count; \
+} \
+\
+/* pop up to @param count elements into @param elements. \
+ * @return the number of elements popped */ \
+static inline uint32_t name##_pop_bulk(struct name* ring, type* elements, uint32_t count) \
+{ \
+	if( count > name##_count( ring ) ) { \
+		count = name##_count( ring ); \
+	} \
+	uint32_t start = ring->tail & AESD_RING_MASK( ring ); \
+	uint32_t first_part = AESD_RING_CAPACITY( ring ) - start; \
+	if( first_part > count ) { \
+		first_part = count; \
+	} \
+	memcpy( elements, &ring->entry[start], first_part * sizeof(type) ); \
+	memcpy( &elements[first_part], &ring->entry[0], (count - first_part) * sizeof(type) ); \
+	ring->tail += count; \
+	return count; \
+}
+
+/**
+ * Create a for loop to iterate over the elements of a ring, oldest first.
+ * @param entryptr is a pointer to the element type, set to the current element
+ * @param ring is a pointer to a struct declared via AESD_RING_DECLARE
+ * @param index is a uint32_t stack allocated value used by this macro for an index
+ * Example usage:
+ * uint32_t index;
+ * int* value;
+ * AESD_RING_FOREACH(value,&ring,index) {
+ *      printf( "%d\n", *value );
+ * }
+ */
+#define AESD_RING_FOREACH(entryptr,ring,index) \
+	for( \
+			index=(ring)->tail; \
+			index!=(ring)->head \
+				&& ((entryptr)=&((ring)->entry[index & AESD_RING_MASK(ring)]), true); \
+			index++ \
+	)
+
+#endif /* AESD_RING_H */
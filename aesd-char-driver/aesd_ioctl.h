@@ -33,14 +33,178 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * Describes one command stored in the aesdchar device
+ */
+struct aesd_index_entry {
+    /**
+     * Number of commands written to the device before this one
+     */
+    uint64_t seq;
+    /**
+     * File position of the first byte of the command
+     * (an absolute byte offset in stream mode)
+     */
+    uint64_t offset;
+    /**
+     * Number of bytes of the command
+     */
+    uint32_t size;
+    uint32_t reserved;
+};
+
+/**
+ * Returned by AESDCHAR_IOCGRANGE: the commands and bytes currently stored in the device,
+ * counted since the device was loaded
+ */
+struct aesd_range {
+    /**
+     * seq of the oldest stored command
+     */
+    uint64_t first_seq;
+    /**
+     * seq the next complete command will get
+     */
+    uint64_t next_seq;
+    /**
+     * Absolute byte offset of the oldest stored byte
+     */
+    uint64_t start_offset;
+    /**
+     * Absolute byte offset of the end of the stored data
+     */
+    uint64_t end_offset;
+};
+
+/**
+ * Passed to AESDCHAR_IOCGINDEX to retrieve the table of all commands in one call
+ */
+struct aesd_index {
+    /**
+     * in: number of elements in the array pointed to by entries
+     */
+    uint32_t capacity;
+    /**
+     * out: number of commands stored in the device.
+     * Only the first min(count, capacity) elements of entries are filled
+     */
+    uint32_t count;
+    /**
+     * in: user pointer to an array of struct aesd_index_entry
+     */
+    uint64_t entries;
+};
+
+/**
+ * Passed to AESDCHAR_IOCREADCMD to copy a range of commands to a user buffer
+ */
+struct aesd_read_cmd {
+    /**
+     * in: the zero referenced write command to start with
+     */
+    uint32_t write_cmd;
+    /**
+     * in: number of commands to copy
+     * out: number of commands copied. Only complete commands are copied
+     */
+    uint32_t cmd_count;
+    /**
+     * in: user pointer to the destination buffer
+     */
+    uint64_t buf;
+    /**
+     * in: size of buf
+     * out: number of bytes copied
+     */
+    uint64_t buf_size;
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+/**
+ * Enable (non zero) or disable (0) follow mode for this open file, similar to `tail -f`:
+ * read blocks at the end of the history until a new command is written,
+ * instead of returning 0. With O_NONBLOCK, read fails with EAGAIN instead
+ */
+#define AESDCHAR_IOCFOLLOW _IOW(AESD_IOC_MAGIC, 2, uint32_t)
+/**
+ * Get sequence number, file position and size of every command, see struct aesd_index
+ */
+#define AESDCHAR_IOCGINDEX _IOWR(AESD_IOC_MAGIC, 3, struct aesd_index)
+/**
+ * Copy a range of commands to a user buffer, see struct aesd_read_cmd.
+ * Fails with EINVAL if write_cmd is not available, with ENOSPC if not even
+ * the first command fits into the buffer. The file position is not changed
+ */
+#define AESDCHAR_IOCREADCMD _IOWR(AESD_IOC_MAGIC, 4, struct aesd_read_cmd)
+/**
+ * Enable (non zero) or disable (0) stream mode for this open file:
+ * the file position is an absolute byte offset that stays valid when old
+ * commands are dropped, see struct aesd_range.
+ * read fails with EOVERFLOW if the data at the file position has already been
+ * dropped; seek to start_offset to resynchronize
+ */
+#define AESDCHAR_IOCSTREAM _IOW(AESD_IOC_MAGIC, 5, uint32_t)
+/**
+ * Get the range of sequence numbers and absolute offsets stored in the device
+ */
+#define AESDCHAR_IOCGRANGE _IOR(AESD_IOC_MAGIC, 6, struct aesd_range)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 6
+
+/**
+ * Layout of the read-only mapping returned by mmap on the aesdchar device:
+ * the first AESDCHAR_MMAP_HEADER_SIZE bytes hold a struct aesd_mmap_header,
+ * followed by the data area with the newest commands.
+ * The data area is used as a ring: every command is stored contiguously at
+ * its offset, but a command may be stored before older ones.
+ */
+#define AESDCHAR_MMAP_HEADER_SIZE 4096
+#define AESDCHAR_MMAP_DATA_SIZE (64 * 1024)
+#define AESDCHAR_MMAP_SIZE (AESDCHAR_MMAP_HEADER_SIZE + AESDCHAR_MMAP_DATA_SIZE)
+
+/**
+ * The maximum number of commands described by the mmap header
+ */
+#define AESDCHAR_MMAP_MAX_ENTRIES 10
+
+struct aesd_mmap_entry {
+    /**
+     * Offset of the command relative to the start of the data area
+     */
+    uint32_t offset;
+    /**
+     * Number of bytes of the command
+     */
+    uint32_t size;
+};
+
+struct aesd_mmap_header {
+    /**
+     * Incremented before and after every update.
+     * An odd value means an update is in progress. Readers should copy what
+     * they need and retry if the value changed in the meantime
+     */
+    uint32_t generation;
+    /**
+     * Number of valid elements in entry
+     */
+    uint32_t entry_count;
+    /**
+     * The zero referenced write command of entry[0].
+     * Non zero if the oldest commands did not fit into the data area
+     */
+    uint32_t first_cmd;
+    /**
+     * Sum of the sizes of the commands described by entry
+     */
+    uint32_t data_size;
+    struct aesd_mmap_entry entry[AESDCHAR_MMAP_MAX_ENTRIES];
+};
 
 #endif /* AESD_IOCTL_H */
@@ -0,0 +1,148 @@
+/*
+ * aesdchar-trace.h
+ *
+ * Tracepoints of the aesdchar driver, see
+ * /sys/kernel/debug/tracing/events/aesdchar/
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(aesd_read,
+	TP_PROTO(unsigned int minor, size_t count, loff_t pos, ssize_t ret, u64 lock_wait_ns),
+	TP_ARGS(minor, count, pos, ret, lock_wait_ns),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(size_t, count)
+		__field(loff_t, pos)
+		__field(ssize_t, ret)
+		__field(u64, lock_wait_ns)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->count = count;
+		__entry->pos = pos;
+		__entry->ret = ret;
+		__entry->lock_wait_ns = lock_wait_ns;
+	),
+	TP_printk("minor=%u count=%zu pos=%lld ret=%zd lock_wait_ns=%llu",
+		__entry->minor, __entry->count, __entry->pos, __entry->ret, __entry->lock_wait_ns)
+);
+
+TRACE_EVENT(aesd_write,
+	TP_PROTO(unsigned int minor, size_t count, size_t pending, ssize_t ret, u64 lock_wait_ns),
+	TP_ARGS(minor, count, pending, ret, lock_wait_ns),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(size_t, count)
+		__field(size_t, pending)
+		__field(ssize_t, ret)
+		__field(u64, lock_wait_ns)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->count = count;
+		__entry->pending = pending;
+		__entry->ret = ret;
+		__entry->lock_wait_ns = lock_wait_ns;
+	),
+	TP_printk("minor=%u count=%zu pending=%zu ret=%zd lock_wait_ns=%llu",
+		__entry->minor, __entry->count, __entry->pending, __entry->ret, __entry->lock_wait_ns)
+);
+
+/* a complete command was added to the ring at slot index */
+TRACE_EVENT(aesd_publish,
+	TP_PROTO(unsigned int minor, unsigned int index, size_t size, size_t ring_size),
+	TP_ARGS(minor, index, size, ring_size),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(unsigned int, index)
+		__field(size_t, size)
+		__field(size_t, ring_size)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->index = index;
+		__entry->size = size;
+		__entry->ring_size = ring_size;
+	),
+	TP_printk("minor=%u index=%u size=%zu ring_size=%zu",
+		__entry->minor, __entry->index, __entry->size, __entry->ring_size)
+);
+
+/* the oldest command at slot index was dropped from the full ring */
+TRACE_EVENT(aesd_evict,
+	TP_PROTO(unsigned int minor, unsigned int index, size_t size),
+	TP_ARGS(minor, index, size),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(unsigned int, index)
+		__field(size_t, size)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->index = index;
+		__entry->size = size;
+	),
+	TP_printk("minor=%u index=%u size=%zu",
+		__entry->minor, __entry->index, __entry->size)
+);
+
+TRACE_EVENT(aesd_llseek,
+	TP_PROTO(unsigned int minor, loff_t offset, int whence, loff_t size, loff_t ret),
+	TP_ARGS(minor, offset, whence, size, ret),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(loff_t, offset)
+		__field(int, whence)
+		__field(loff_t, size)
+		__field(loff_t, ret)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->offset = offset;
+		__entry->whence = whence;
+		__entry->size = size;
+		__entry->ret = ret;
+	),
+	TP_printk("minor=%u offset=%lld whence=%d size=%lld ret=%lld",
+		__entry->minor, __entry->offset, __entry->whence, __entry->size, __entry->ret)
+);
+
+TRACE_EVENT(aesd_adjust_file_offset,
+	TP_PROTO(unsigned int minor, u32 write_cmd, u32 write_cmd_offset, loff_t pos, long ret, u64 lock_wait_ns),
+	TP_ARGS(minor, write_cmd, write_cmd_offset, pos, ret, lock_wait_ns),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(u32, write_cmd)
+		__field(u32, write_cmd_offset)
+		__field(loff_t, pos)
+		__field(long, ret)
+		__field(u64, lock_wait_ns)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->write_cmd = write_cmd;
+		__entry->write_cmd_offset = write_cmd_offset;
+		__entry->pos = pos;
+		__entry->ret = ret;
+		__entry->lock_wait_ns = lock_wait_ns;
+	),
+	TP_printk("minor=%u write_cmd=%u write_cmd_offset=%u pos=%lld ret=%ld lock_wait_ns=%llu",
+		__entry->minor, __entry->write_cmd, __entry->write_cmd_offset,
+		__entry->pos, __entry->ret, __entry->lock_wait_ns)
+);
+
+#endif /* AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_ */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesdchar-trace
+#include <trace/define_trace.h>
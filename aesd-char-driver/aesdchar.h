@@ -12,11 +12,20 @@
 
 #define AESD_DEBUG 1  //Remove comment on this line to enable debug
 
+#ifndef AESD_NR_DEVS
+#define AESD_NR_DEVS 1    /* aesdchar0 through aesdchar<n-1> */
+#endif
+
+/* the shrinker never releases the newest commands of a device */
+#define AESD_SHRINK_KEEP_ENTRIES 1
+
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
 #  ifdef __KERNEL__
-     /* This one if debugging is on, and kernel space */
-#    define PDEBUG(fmt, args...) printk( KERN_DEBUG "aesdchar: " fmt, ## args)
+     /* This one if debugging is on, and kernel space.
+      * With CONFIG_DYNAMIC_DEBUG the messages are off until enabled at runtime:
+      * echo 'module aesdchar +p' > /sys/kernel/debug/dynamic_debug/control */
+#    define PDEBUG(fmt, args...) pr_debug( "aesdchar: " fmt, ## args)
 #  else
      /* This one for user space */
 #    define PDEBUG(fmt, args...) fprintf(stderr, fmt, ## args)
@@ -25,6 +34,27 @@
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+/**
+ * counters of a device, only modified with the device lock held.
+ * Exported as /sys/kernel/debug/aesdchar/aesdchar<n>
+ */
+struct aesd_stats
+{
+	u64 reads;
+	u64 writes;
+	u64 bytes_read;
+	u64 bytes_written;
+	// entries dropped from the full ring:
+	u64 evictions;
+	// number of times the lock was held by someone else:
+	u64 lock_contended;
+	// total time spent waiting for the lock:
+	u64 lock_wait_ns;
+	// entries released by the shrinker under memory pressure:
+	u64 shrunk_entries;
+	u64 shrunk_bytes;
+};
+
 struct aesd_dev
 {
 	/**
@@ -33,9 +63,27 @@ struct aesd_dev
 	struct aesd_circular_buffer buffer;
 	struct aesd_buffer_entry current_entry;
 	struct mutex lock;
+	// read-only snapshot of the ring exposed via mmap (see struct aesd_mmap_header):
+	void* mmap_area;
+	// woken up whenever a command is added to the ring:
+	wait_queue_head_t wait_queue;
+	// number of commands added to the ring so far:
+	unsigned long write_count;
+	struct aesd_stats stats;
 
 	struct cdev cdev;     /* Char device structure      */
 };
 
+/**
+ * per open file state, stored in filp->private_data
+ */
+struct aesd_file
+{
+	struct aesd_dev* dev;
+	// block in read at the end of the history (see AESDCHAR_IOCFOLLOW):
+	bool follow;
+	// f_pos is an absolute byte offset (see AESDCHAR_IOCSTREAM):
+	bool stream;
+};
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
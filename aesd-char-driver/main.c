@@ -17,232 +17,735 @@
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
+#include <linux/uio.h> // iov_iter
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/shrinker.h>
+#include <linux/version.h>
 
 #include "aesdchar.h"
+#include "aesd-buffer-pool.h"
 #include "aesd_ioctl.h"
 
+#define CREATE_TRACE_POINTS
+#include "aesdchar-trace.h"
+
 
 MODULE_AUTHOR("Samuel Gfrörer");
 MODULE_LICENSE("Dual BSD/GPL");
 
 int aesd_open(struct inode *inode, struct file *filp);
 int aesd_release(struct inode *inode, struct file *filp);
-ssize_t aesd_read(
-	struct file *filp,
-	char __user *buf,
-	size_t count,
-	loff_t *f_pos
+ssize_t aesd_read_iter(
+	struct kiocb* iocb,
+	struct iov_iter* to
 );
-ssize_t aesd_write(
-		struct file *filp,
-		const char __user *buf,
-		size_t count,
-		loff_t *f_pos
+ssize_t aesd_write_iter(
+		struct kiocb* iocb,
+		struct iov_iter* from
 );
 loff_t llseek(struct file* file, loff_t offset, int whence);
+__poll_t aesd_poll(struct file* filp, poll_table* wait);
+int aesd_mmap(struct file* filp, struct vm_area_struct* vma);
+static void aesd_mmap_keep_newest(struct aesd_mmap_header* header, unsigned int keep);
+static void aesd_mmap_publish(struct aesd_dev* dev, const struct aesd_buffer_entry* entry);
+static void aesd_mmap_trim(struct aesd_dev* dev);
 long aesd_adjust_file_offset(
 		struct file* file,
 		uint32_t write_cmd,
 		uint32_t write_cmd_offset
 );
+long aesd_get_index(
+		struct file* file,
+		struct aesd_index* index
+);
+long aesd_read_commands(
+		struct file* file,
+		struct aesd_read_cmd* read_cmd
+);
 
 long unlocked_ioctl(struct file* file, unsigned int cmd, unsigned long arg);
 // long compat_ioctl(struct file* file, unsigned int cmd, unsigned long arg);
 
-static int aesd_setup_cdev(struct aesd_dev *dev);
+static u64 aesd_lock(struct aesd_dev* dev);
+static int aesd_ring_pos(struct aesd_dev* dev, struct aesd_file* file_state, loff_t f_pos, size_t* ring_pos);
+static loff_t aesd_file_pos(struct aesd_dev* dev, struct aesd_file* file_state, size_t ring_pos);
+static int aesd_stats_show(struct seq_file* s, void* unused);
+static size_t aesd_reclaimable_bytes(struct aesd_dev* dev);
+static unsigned long aesd_shrink_device(struct aesd_dev* dev, unsigned long nr_to_scan);
+static unsigned long aesd_shrink_count(struct shrinker* shrinker, struct shrink_control* sc);
+static unsigned long aesd_shrink_scan(struct shrinker* shrinker, struct shrink_control* sc);
+
+static int aesd_setup_cdev(struct aesd_dev *dev, int index);
+static int aesd_init_device(struct aesd_dev *dev, int index);
+static void aesd_cleanup_device(struct aesd_dev *dev);
 int aesd_init_module(void);
 void aesd_cleanup_module(void);
 
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
+int aesd_nr_devs = AESD_NR_DEVS; // number of /dev/aesdchar<n> devices
+
+module_param(aesd_nr_devs, int, S_IRUGO);
+MODULE_PARM_DESC(aesd_nr_devs, "number of aesdchar devices, each with its own ring and lock");
+
+struct aesd_dev* aesd_devices; // allocated in aesd_init_module
+struct dentry* aesd_debugfs_root;
+
+DEFINE_SHOW_ATTRIBUTE(aesd_stats);
 
-struct aesd_dev aesd_device;
+// releases the oldest commands of all devices under memory pressure:
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+// (allocated by the kernel since 6.7)
+static struct shrinker* aesd_shrinker;
+#else
+static struct shrinker aesd_shrinker = {
+	.count_objects = aesd_shrink_count,
+	.scan_objects = aesd_shrink_scan,
+	.seeks = DEFAULT_SEEKS,
+};
+#endif
 
 struct file_operations aesd_fops = {
 	.owner =    THIS_MODULE,
-	.read =     aesd_read,
-	.write =    aesd_write,
+	.read_iter =  aesd_read_iter,
+	.write_iter = aesd_write_iter,
+	// zero copy from/to pipes (sendfile, splice):
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+	.splice_read =  copy_splice_read,
+#else
+	.splice_read =  generic_file_splice_read,
+#endif
+	.splice_write = iter_file_splice_write,
 	.open =     aesd_open,
 	.release =  aesd_release,
 	.llseek =  llseek,
+	.mmap =     aesd_mmap,
+	.poll =     aesd_poll,
 	.unlocked_ioctl = unlocked_ioctl,
 	// .compat_ioctl = compat_ioctl,
 };
 
+/**
+ * Take the device lock, counting contention in dev->stats
+ * @return the time spent waiting for the lock
+ */
+static u64 aesd_lock(struct aesd_dev* dev)
+{
+	if( mutex_trylock( &dev->lock ) ) {
+		return 0;
+	}
+	u64 start = ktime_get_ns();
+	mutex_lock( &dev->lock );
+	u64 wait_ns = ktime_get_ns() - start;
+	dev->stats.lock_contended++;
+	dev->stats.lock_wait_ns += wait_ns;
+	return wait_ns;
+}
+
+/**
+ * Translate a file position into a position relative to the oldest byte in the ring.
+ * Must be called with dev->lock held.
+ * @return 0, or -EOVERFLOW in stream mode if the data at @param f_pos has already been dropped
+ */
+static int aesd_ring_pos(struct aesd_dev* dev, struct aesd_file* file_state, loff_t f_pos, size_t* ring_pos)
+{
+	if( !file_state->stream ) {
+		(*ring_pos) = f_pos;
+		return 0;
+	}
+	uint64_t start_offset = aesd_circular_buffer_get_start_offset( &dev->buffer );
+	if( (uint64_t )f_pos < start_offset ) {
+		return -EOVERFLOW;
+	}
+	(*ring_pos) = (size_t )(f_pos - start_offset);
+	return 0;
+}
+
+/**
+ * Inverse of aesd_ring_pos.
+ * Must be called with dev->lock held.
+ */
+static loff_t aesd_file_pos(struct aesd_dev* dev, struct aesd_file* file_state, size_t ring_pos)
+{
+	if( !file_state->stream ) {
+		return ring_pos;
+	}
+	return aesd_circular_buffer_get_start_offset( &dev->buffer ) + ring_pos;
+}
+
+static int aesd_stats_show(struct seq_file* s, void* unused)
+{
+	struct aesd_dev* dev = s->private;
+	mutex_lock( &dev->lock );
+	struct aesd_stats stats = dev->stats;
+	size_t pending = dev->current_entry.size;
+	unsigned int count = aesd_circular_buffer_get_count( &dev->buffer );
+	size_t size = aesd_circular_buffer_get_size( &dev->buffer );
+	size_t reclaimable = aesd_reclaimable_bytes( dev );
+	mutex_unlock( &dev->lock );
+	seq_printf( s, "reads: %llu\n", stats.reads );
+	seq_printf( s, "writes: %llu\n", stats.writes );
+	seq_printf( s, "bytes_read: %llu\n", stats.bytes_read );
+	seq_printf( s, "bytes_written: %llu\n", stats.bytes_written );
+	seq_printf( s, "evictions: %llu\n", stats.evictions );
+	seq_printf( s, "pending_bytes: %zu\n", pending );
+	seq_printf( s, "entries: %u\n", count );
+	seq_printf( s, "size: %zu\n", size );
+	seq_printf( s, "reclaimable_bytes: %zu\n", reclaimable );
+	seq_printf( s, "shrunk_entries: %llu\n", stats.shrunk_entries );
+	seq_printf( s, "shrunk_bytes: %llu\n", stats.shrunk_bytes );
+	seq_printf( s, "lock_contended: %llu\n", stats.lock_contended );
+	seq_printf( s, "lock_wait_ns: %llu\n", stats.lock_wait_ns );
+	return 0;
+}
+
+/**
+ * @return number of bytes the shrinker may release from the ring of @param dev.
+ * Must be called with dev->lock held.
+ */
+static size_t aesd_reclaimable_bytes(struct aesd_dev* dev)
+{
+	size_t size = 0;
+	unsigned int count = aesd_circular_buffer_get_count( &dev->buffer );
+	for( unsigned int i=0; i + AESD_SHRINK_KEEP_ENTRIES < count; i++ ) {
+		size += aesd_circular_buffer_get_entry( &dev->buffer, i )->size;
+	}
+	return size;
+}
+
+/**
+ * Release up to @param nr_to_scan of the oldest commands of @param dev,
+ * always keeping the newest AESD_SHRINK_KEEP_ENTRIES.
+ * Must be called with dev->lock held.
+ * @return the number of commands released
+ */
+static unsigned long aesd_shrink_device(struct aesd_dev* dev, unsigned long nr_to_scan)
+{
+	unsigned long freed = 0;
+	while(
+			freed < nr_to_scan
+			&& aesd_circular_buffer_get_count( &dev->buffer ) > AESD_SHRINK_KEEP_ENTRIES
+	) {
+		struct aesd_buffer_entry entry;
+		unsigned int index = dev->buffer.out_offs;
+		aesd_circular_buffer_remove_oldest( &dev->buffer, &entry );
+		trace_aesd_evict( MINOR(dev->cdev.dev), index, entry.size );
+		aesd_buffer_pool_free( entry.buffptr, entry.size );
+		dev->stats.shrunk_entries++;
+		dev->stats.shrunk_bytes += entry.size;
+		freed++;
+	}
+	if( freed > 0 ) {
+		aesd_mmap_trim( dev );
+	}
+	return freed;
+}
+
+static unsigned long aesd_shrink_count(struct shrinker* shrinker, struct shrink_control* sc)
+{
+	unsigned long count = 0;
+	// (an estimate is good enough, no locking)
+	for( int i=0; i<aesd_nr_devs; i++ ) {
+		unsigned int dev_count = aesd_circular_buffer_get_count( &aesd_devices[i].buffer );
+		if( dev_count > AESD_SHRINK_KEEP_ENTRIES ) {
+			count += dev_count - AESD_SHRINK_KEEP_ENTRIES;
+		}
+	}
+	return count ? count : SHRINK_EMPTY;
+}
+
+static unsigned long aesd_shrink_scan(struct shrinker* shrinker, struct shrink_control* sc)
+{
+	unsigned long freed = 0;
+	for( int i=0; i<aesd_nr_devs && freed < sc->nr_to_scan; i++ ) {
+		struct aesd_dev* dev = &aesd_devices[i];
+		// never sleep on the lock here: aesd_write allocates memory while holding it
+		if( !mutex_trylock( &dev->lock ) ) {
+			continue;
+		}
+		freed += aesd_shrink_device( dev, sc->nr_to_scan - freed );
+		mutex_unlock( &dev->lock );
+	}
+	return freed ? freed : SHRINK_STOP;
+}
+
 int aesd_open(struct inode *inode, struct file *filp)
 {
-	PDEBUG("open\n");
-	/**
-	 * TODO: handle open
-	 */
+	PDEBUG("open %d\n", iminor(inode));
+	struct aesd_file* file_state = kzalloc( sizeof(struct aesd_file), GFP_KERNEL );
+	if( file_state == NULL ) {
+		return -ENOMEM;
+	}
+	file_state->dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+	filp->private_data = file_state;
 	return 0;
 }
 
 int aesd_release(struct inode *inode, struct file *filp)
 {
 	PDEBUG("release\n");
-	/**
-	 * TODO: handle release
-	 */
+	kfree( filp->private_data );
+	filp->private_data = NULL;
 	return 0;
 }
 
-ssize_t aesd_read(
-	struct file* filp,
-	char __user* buf,
-	size_t count,
-	loff_t* f_pos
+/**
+ * Copies as many bytes starting at iocb->ki_pos as fit into @param to,
+ * possibly spanning several commands.
+ */
+ssize_t aesd_read_iter(
+	struct kiocb* iocb,
+	struct iov_iter* to
 )
 {
 	ssize_t ret = 0;
+	struct file* filp = iocb->ki_filp;
+	loff_t* f_pos = &iocb->ki_pos;
+	size_t count = iov_iter_count( to );
+	struct aesd_file* file_state = filp->private_data;
+	struct aesd_dev* dev = file_state->dev;
+	const loff_t start_pos = *f_pos;
 	PDEBUG("read %zu bytes with offset %lld\n",count,*f_pos);
-	mutex_lock( &aesd_device.lock );
+	u64 lock_wait_ns = aesd_lock( dev );
+	size_t ring_pos = 0;
 	size_t offset = 0;
-	struct aesd_buffer_entry* entry = aesd_circular_buffer_find_entry_offset_for_fpos(
-			&aesd_device.buffer,
-			*f_pos,
-			&offset
-	);
-	if( !entry ) {
-		ret = 0;
-		goto end;
-	}
-	if( count == 0 ) {
-		ret = 0;
-		goto end;
-	}
-	size_t bytes_to_copy = count;
-	if( entry->size - offset < bytes_to_copy ) {
-		bytes_to_copy = entry->size - offset;
+	struct aesd_buffer_entry* entry = NULL;
+	while( true ) {
+		// reader was overrun (stream mode):
+		ret = aesd_ring_pos( dev, file_state, *f_pos, &ring_pos );
+		if( ret ) {
+			goto end;
+		}
+		entry = aesd_circular_buffer_find_entry_offset_for_fpos(
+				&dev->buffer,
+				ring_pos,
+				&offset
+		);
+		if( entry != NULL ) {
+			break;
+		}
+		// end of history:
+		if( !file_state->follow || count == 0 ) {
+			ret = 0;
+			goto end;
+		}
+		if( (filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT) ) {
+			ret = -EAGAIN;
+			goto end;
+		}
+		unsigned long write_count = dev->write_count;
+		mutex_unlock( &dev->lock );
+		PDEBUG("read waiting for new commands...\n");
+		if( wait_event_interruptible(
+				dev->wait_queue,
+				READ_ONCE(dev->write_count) != write_count
+		) ) {
+			return -ERESTARTSYS;
+		}
+		lock_wait_ns += aesd_lock( dev );
 	}
-	if( copy_to_user(
-			buf,
-			&entry->buffptr[offset],
-			bytes_to_copy
-	) ) {
-		ret = -EFAULT;
-		goto end;
+	// copy everything available in one pass over the entries:
+	aesd_iovec_t iov[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+	size_t bytes_available = 0;
+	unsigned int iov_count = aesd_circular_buffer_iovec_for_range(
+			&dev->buffer,
+			ring_pos,
+			iov_iter_count( to ),
+			iov,
+			ARRAY_SIZE(iov),
+			&bytes_available
+	);
+	for( unsigned int i=0; i<iov_count; i++ ) {
+		size_t copied = copy_to_iter(
+				iov[i].iov_base,
+				iov[i].iov_len,
+				to
+		);
+		(*f_pos) += copied;
+		ret += copied;
+		if( copied != iov[i].iov_len ) {
+			if( ret == 0 ) {
+				ret = -EFAULT;
+			}
+			goto end;
+		}
 	}
-	(*f_pos) += bytes_to_copy;
-	ret = bytes_to_copy;
 	goto end;
 
 end:
 	PDEBUG("read returns: %ld\n", ret );
-	mutex_unlock( &aesd_device.lock );
+	dev->stats.reads++;
+	if( ret > 0 ) {
+		dev->stats.bytes_read += ret;
+	}
+	trace_aesd_read( MINOR(dev->cdev.dev), count, start_pos, ret, lock_wait_ns );
+	mutex_unlock( &dev->lock );
 	return ret;
 }
 
-ssize_t aesd_write(
-		struct file *filp,
-		const char __user *buf,
-		size_t count,
-		loff_t *f_pos
+ssize_t aesd_write_iter(
+		struct kiocb* iocb,
+		struct iov_iter* from
 )
 {
-	PDEBUG("write %zu bytes with offset %lld\n",count,*f_pos);
-	mutex_lock( &aesd_device.lock );
+	struct aesd_dev* dev = ((struct aesd_file* )iocb->ki_filp->private_data)->dev;
+	size_t count = iov_iter_count( from );
+	ssize_t ret = count;
+	PDEBUG("write %zu bytes with offset %lld\n",count,iocb->ki_pos);
+	u64 lock_wait_ns = aesd_lock( dev );
 	if( count == 0 ) {
-		mutex_unlock( &aesd_device.lock );
-		return 0;
+		goto end;
 	}
 	// allocate/reallocate buffer entry:
-	size_t insert_pos = 0;
-	if( aesd_device.current_entry.buffptr == NULL ) {
-
-		aesd_device.current_entry.buffptr = kmalloc(count, GFP_KERNEL );
-		aesd_device.current_entry.size = count;
-	}
-	else {
-		insert_pos = aesd_device.current_entry.size;
-		aesd_device.current_entry.buffptr = krealloc(
-				aesd_device.current_entry.buffptr,
-				aesd_device.current_entry.size + count,
-				GFP_KERNEL
-		);
-		aesd_device.current_entry.size += count;
-	}
-	if( aesd_device.current_entry.buffptr == NULL ) {
-		mutex_unlock( &aesd_device.lock );
-		return -ENOMEM;
+	size_t insert_pos = dev->current_entry.size;
+	char* buffptr = aesd_buffer_pool_reserve(
+			dev->current_entry.buffptr,
+			insert_pos,
+			insert_pos + count
+	);
+	if( buffptr == NULL ) {
+		ret = -ENOMEM;
+		goto end;
 	}
 	PDEBUG("write copying to local...\n");
 	// copy to buffer entry:
-	if( copy_from_user(
-			&aesd_device.current_entry.buffptr[insert_pos],
-			buf,
-			count
+	if( !copy_from_iter_full(
+			&buffptr[insert_pos],
+			count,
+			from
 	) ) {
-		mutex_unlock( &aesd_device.lock );
-		return -EFAULT;
+		// keep the current entry as it was:
+		if( buffptr != dev->current_entry.buffptr ) {
+			aesd_buffer_pool_free( buffptr, insert_pos + count );
+		}
+		ret = -EFAULT;
+		goto end;
+	}
+	if( buffptr != dev->current_entry.buffptr ) {
+		aesd_buffer_pool_free( dev->current_entry.buffptr, insert_pos );
+		dev->current_entry.buffptr = buffptr;
 	}
+	dev->current_entry.size += count;
 	// copy entry to ringbuffer:
-	if( aesd_device.current_entry.buffptr[insert_pos + count - 1] == '\n' ) {
+	if( dev->current_entry.buffptr[insert_pos + count - 1] == '\n' ) {
 		PDEBUG("write to ringbuffer...\n");
 		if(
-				aesd_circular_buffer_get_count( &aesd_device.buffer ) == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+				aesd_circular_buffer_get_count( &dev->buffer ) == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
 		) {
-			struct aesd_buffer_entry* last_entry = &aesd_device.buffer.entry[ aesd_device.buffer.in_offs];
-			kfree( last_entry->buffptr );
+			struct aesd_buffer_entry* last_entry = &dev->buffer.entry[ dev->buffer.in_offs];
+			trace_aesd_evict( MINOR(dev->cdev.dev), dev->buffer.in_offs, last_entry->size );
+			aesd_buffer_pool_free( last_entry->buffptr, last_entry->size );
 			last_entry->buffptr = NULL;
 			last_entry->size = 0;
+			dev->stats.evictions++;
 		}
+		trace_aesd_publish(
+				MINOR(dev->cdev.dev),
+				dev->buffer.in_offs,
+				dev->current_entry.size,
+				aesd_circular_buffer_get_size( &dev->buffer ) + dev->current_entry.size
+		);
 		aesd_circular_buffer_add_entry(
-				&aesd_device.buffer,
-				&aesd_device.current_entry
+				&dev->buffer,
+				&dev->current_entry
 		);
-		aesd_device.current_entry = (struct aesd_buffer_entry){
+		aesd_mmap_publish( dev, &dev->current_entry );
+		dev->current_entry = (struct aesd_buffer_entry){
 			.buffptr = NULL,
 			.size = 0,
 		};
+		WRITE_ONCE( dev->write_count, dev->write_count + 1 );
+		wake_up_interruptible( &dev->wait_queue );
 		/*
 		PDEBUG("write update pos...\n");
-		(*f_pos) += count;
-		PDEBUG( "write: f_pos=%lld\n", *f_pos );
+		iocb->ki_pos += count;
+		PDEBUG( "write: f_pos=%lld\n", iocb->ki_pos );
 		*/
 	}
-	mutex_unlock( &aesd_device.lock );
-	return count;
+	dev->stats.writes++;
+	dev->stats.bytes_written += count;
+	goto end;
+
+end:
+	trace_aesd_write( MINOR(dev->cdev.dev), count, dev->current_entry.size, ret, lock_wait_ns );
+	mutex_unlock( &dev->lock );
+	return ret;
 }
 
 loff_t llseek(struct file* file, loff_t offset, int whence)
 {
+	struct aesd_file* file_state = file->private_data;
+	struct aesd_dev* dev = file_state->dev;
 	PDEBUG( "llseek: %lld, %d\n", offset, whence );
-	loff_t full_size = aesd_circular_buffer_get_size( &aesd_device.buffer );
+	loff_t full_size = aesd_circular_buffer_get_size( &dev->buffer );
 	PDEBUG( "llseek fullsize: %lld\n", full_size );
-	loff_t ret = fixed_size_llseek( file, offset, whence, 
-			full_size
-	);
+	loff_t ret;
+	if( !file_state->stream ) {
+		ret = fixed_size_llseek( file, offset, whence, 
+				full_size
+		);
+	}
+	else {
+		// absolute positions, positions of dropped data are allowed (read fails with EOVERFLOW):
+		loff_t end_offset = READ_ONCE( dev->buffer.end_offset );
+		switch( whence ) {
+			case SEEK_SET: ret = offset; break;
+			case SEEK_CUR: ret = file->f_pos + offset; break;
+			case SEEK_END: ret = end_offset + offset; break;
+			default: ret = -EINVAL;
+		}
+		if( ret >= 0 ) {
+			ret = vfs_setpos( file, ret, end_offset );
+		}
+	}
 	PDEBUG( "llseek return: %lld\n", ret );
+	trace_aesd_llseek( MINOR(dev->cdev.dev), offset, whence, full_size, ret );
 	return ret;
 }
 
+__poll_t aesd_poll(struct file* filp, poll_table* wait)
+{
+	struct aesd_dev* dev = ((struct aesd_file* )filp->private_data)->dev;
+	// writes never block on the ring:
+	__poll_t mask = EPOLLOUT | EPOLLWRNORM;
+	poll_wait( filp, &dev->wait_queue, wait );
+	aesd_lock( dev );
+	size_t ring_pos = 0;
+	// (an overrun reader is readable, read reports the overrun)
+	if(
+			aesd_ring_pos( dev, filp->private_data, filp->f_pos, &ring_pos )
+			|| ring_pos < aesd_circular_buffer_get_size( &dev->buffer )
+	) {
+		mask |= EPOLLIN | EPOLLRDNORM;
+	}
+	mutex_unlock( &dev->lock );
+	return mask;
+}
+
+int aesd_mmap(struct file* filp, struct vm_area_struct* vma)
+{
+	struct aesd_dev* dev = ((struct aesd_file* )filp->private_data)->dev;
+	PDEBUG( "mmap: %lu bytes, pgoff %lu\n", vma->vm_end - vma->vm_start, vma->vm_pgoff );
+	// the mapping is a snapshot, writes would never reach the ring:
+	if( vma->vm_flags & VM_WRITE ) {
+		return -EPERM;
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	// (vm_flags is read-only since 6.3)
+	vm_flags_clear( vma, VM_MAYWRITE );
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+	return remap_vmalloc_range( vma, dev->mmap_area, vma->vm_pgoff );
+}
+
+/**
+ * Describe only the newest @param keep commands in the mmap header.
+ * Must be called with dev->lock held, during an update (odd generation).
+ */
+static void aesd_mmap_keep_newest(struct aesd_mmap_header* header, unsigned int keep)
+{
+	if( header->entry_count <= keep ) {
+		return;
+	}
+	unsigned int dropped = header->entry_count - keep;
+	for( unsigned int i=0; i<dropped; i++ ) {
+		header->data_size -= header->entry[i].size;
+	}
+	memmove( &header->entry[0], &header->entry[dropped], keep * sizeof(struct aesd_mmap_entry) );
+	header->entry_count = keep;
+}
+
+/**
+ * Add the command just added to the ring to the mmap area.
+ * Only the new command is copied: it is stored after the newest command,
+ * or at the start of the data area if it does not fit there. The commands
+ * it overwrites are left out from then on, along with all older ones.
+ * Must be called with dev->lock held.
+ */
+static void aesd_mmap_publish(struct aesd_dev* dev, const struct aesd_buffer_entry* entry)
+{
+	struct aesd_mmap_header* header = dev->mmap_area;
+	char* data = (char* )dev->mmap_area + AESDCHAR_MMAP_HEADER_SIZE;
+	unsigned int count = aesd_circular_buffer_get_count( &dev->buffer );
+	// odd generation: update in progress
+	WRITE_ONCE( header->generation, header->generation + 1 );
+	smp_wmb();
+	// the command evicted from the full ring:
+	aesd_mmap_keep_newest( header, count - 1 );
+	if( entry->size > AESDCHAR_MMAP_DATA_SIZE ) {
+		// no room, and older commands must not be described without it:
+		aesd_mmap_keep_newest( header, 0 );
+	}
+	else {
+		size_t offset = 0;
+		if( header->entry_count > 0 ) {
+			struct aesd_mmap_entry* newest = &header->entry[header->entry_count - 1];
+			offset = newest->offset + newest->size;
+		}
+		if( offset + entry->size > AESDCHAR_MMAP_DATA_SIZE ) {
+			offset = 0;
+		}
+		for( unsigned int i=header->entry_count; i>0; i-- ) {
+			struct aesd_mmap_entry* old = &header->entry[i - 1];
+			if( old->offset < offset + entry->size && offset < old->offset + old->size ) {
+				aesd_mmap_keep_newest( header, header->entry_count - i );
+				break;
+			}
+		}
+		if( header->entry_count == AESDCHAR_MMAP_MAX_ENTRIES ) {
+			aesd_mmap_keep_newest( header, AESDCHAR_MMAP_MAX_ENTRIES - 1 );
+		}
+		memcpy( &data[offset], entry->buffptr, entry->size );
+		header->entry[header->entry_count] = (struct aesd_mmap_entry ){
+			.offset = offset,
+			.size = entry->size,
+		};
+		header->entry_count++;
+		header->data_size += entry->size;
+	}
+	header->first_cmd = count - header->entry_count;
+	smp_wmb();
+	WRITE_ONCE( header->generation, header->generation + 1 );
+}
+
+/**
+ * Leave the commands released by the shrinker out of the mmap area.
+ * Must be called with dev->lock held.
+ */
+static void aesd_mmap_trim(struct aesd_dev* dev)
+{
+	struct aesd_mmap_header* header = dev->mmap_area;
+	unsigned int count = aesd_circular_buffer_get_count( &dev->buffer );
+	WRITE_ONCE( header->generation, header->generation + 1 );
+	smp_wmb();
+	aesd_mmap_keep_newest( header, count );
+	header->first_cmd = count - header->entry_count;
+	smp_wmb();
+	WRITE_ONCE( header->generation, header->generation + 1 );
+}
+
 long aesd_adjust_file_offset(
 		struct file* file,
 		uint32_t write_cmd,
 		uint32_t write_cmd_offset
 )
 {
+	struct aesd_file* file_state = file->private_data;
+	struct aesd_dev* dev = file_state->dev;
+	long ret = 0;
+	size_t new_pos = 0;
 	PDEBUG("aesd_adjust_file_offset\n" );
-	if( write_cmd >= aesd_circular_buffer_get_count( &aesd_device.buffer ) ) {
-		return -EINVAL;
+	u64 lock_wait_ns = aesd_lock( dev );
+	struct aesd_buffer_entry* entry = aesd_circular_buffer_get_entry( &dev->buffer, write_cmd );
+	if( entry == NULL ) {
+		ret = -EINVAL;
+		goto end;
 	}
-	struct aesd_buffer_entry* entry = &aesd_device.buffer.entry[aesd_device.buffer.out_offs + write_cmd];
 	if( write_cmd_offset >= entry->size ) {
-		return -EINVAL;
+		ret = -EINVAL;
+		goto end;
 	}
-	size_t new_pos = 0;
 	if( 0 != aesd_circular_buffer_fpos_for_entry(
-			&aesd_device.buffer,
+			&dev->buffer,
 			entry,
 			write_cmd_offset,
 			&new_pos
 	) ) {
-		return -EINVAL;
+		ret = -EINVAL;
+		goto end;
 	}
-	file->f_pos = new_pos;
-	PDEBUG( "aesd_adjust_file_offset, apply %ld\n", new_pos );
-	return 0;
+	file->f_pos = aesd_file_pos( dev, file_state, new_pos );
+	PDEBUG( "aesd_adjust_file_offset, apply %lld\n", file->f_pos );
+end:
+	trace_aesd_adjust_file_offset( MINOR(dev->cdev.dev), write_cmd, write_cmd_offset, new_pos, ret, lock_wait_ns );
+	mutex_unlock( &dev->lock );
+	return ret;
+}
+
+long aesd_get_index(
+		struct file* file,
+		struct aesd_index* index
+)
+{
+	struct aesd_file* file_state = file->private_data;
+	struct aesd_dev* dev = file_state->dev;
+	struct aesd_index_entry __user* user_entries = (struct aesd_index_entry __user* )(uintptr_t )index->entries;
+	long ret = 0;
+	aesd_lock( dev );
+	index->count = aesd_circular_buffer_get_count( &dev->buffer );
+	const unsigned int entry_count = min( index->count, index->capacity );
+	for( unsigned int i=0; i<entry_count; i++ ) {
+		struct aesd_buffer_entry* entry = aesd_circular_buffer_get_entry( &dev->buffer, i );
+		size_t offset = 0;
+		// (entries are never empty)
+		aesd_circular_buffer_fpos_for_entry( &dev->buffer, entry, 0, &offset );
+		struct aesd_index_entry index_entry = {
+			.seq = entry->seq,
+			.offset = aesd_file_pos( dev, file_state, offset ),
+			.size = entry->size,
+		};
+		if( copy_to_user( &user_entries[i], &index_entry, sizeof(index_entry) ) ) {
+			ret = -EFAULT;
+			break;
+		}
+	}
+	mutex_unlock( &dev->lock );
+	return ret;
+}
+
+long aesd_read_commands(
+		struct file* file,
+		struct aesd_read_cmd* read_cmd
+)
+{
+	struct aesd_dev* dev = ((struct aesd_file* )file->private_data)->dev;
+	char __user* buf = (char __user* )(uintptr_t )read_cmd->buf;
+	long ret = 0;
+	uint32_t cmd_count = 0;
+	uint64_t bytes_copied = 0;
+	aesd_lock( dev );
+	if( aesd_circular_buffer_get_entry( &dev->buffer, read_cmd->write_cmd ) == NULL ) {
+		ret = -EINVAL;
+		goto end;
+	}
+	aesd_iovec_t iov[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+	size_t bytes_available = 0;
+	unsigned int iov_count = aesd_circular_buffer_iovec_for_entries(
+			&dev->buffer,
+			read_cmd->write_cmd,
+			read_cmd->cmd_count,
+			iov,
+			ARRAY_SIZE(iov),
+			&bytes_available
+	);
+	for( ; cmd_count < iov_count; cmd_count++ ) {
+		if( bytes_copied + iov[cmd_count].iov_len > read_cmd->buf_size ) {
+			break;
+		}
+		if( copy_to_user( &buf[bytes_copied], iov[cmd_count].iov_base, iov[cmd_count].iov_len ) ) {
+			ret = -EFAULT;
+			goto end;
+		}
+		bytes_copied += iov[cmd_count].iov_len;
+	}
+	if( cmd_count == 0 && read_cmd->cmd_count > 0 ) {
+		ret = -ENOSPC;
+		goto end;
+	}
+	read_cmd->cmd_count = cmd_count;
+	read_cmd->buf_size = bytes_copied;
+end:
+	mutex_unlock( &dev->lock );
+	return ret;
 }
 
 long unlocked_ioctl(struct file* file, unsigned int cmd, unsigned long arg)
@@ -272,6 +775,117 @@ long unlocked_ioctl(struct file* file, unsigned int cmd, unsigned long arg)
 			);
 		}
 		break;
+		case AESDCHAR_IOCFOLLOW:
+		{
+			uint32_t follow;
+			if( 0 != copy_from_user(
+					&follow,
+					(const void __user* )arg,
+					sizeof(follow)
+			) ) {
+				return -EFAULT;
+			}
+			struct aesd_file* file_state = file->private_data;
+			file_state->follow = (follow != 0);
+			PDEBUG("unlocked_ioctl follow %d\n", file_state->follow);
+			return 0;
+		}
+		break;
+		case AESDCHAR_IOCSTREAM:
+		{
+			uint32_t stream;
+			if( 0 != copy_from_user(
+					&stream,
+					(const void __user* )arg,
+					sizeof(stream)
+			) ) {
+				return -EFAULT;
+			}
+			struct aesd_file* file_state = file->private_data;
+			struct aesd_dev* dev = file_state->dev;
+			aesd_lock( dev );
+			// keep pointing at the same byte:
+			size_t ring_pos = 0;
+			if( aesd_ring_pos( dev, file_state, file->f_pos, &ring_pos ) ) {
+				ring_pos = 0;
+			}
+			file_state->stream = (stream != 0);
+			file->f_pos = aesd_file_pos( dev, file_state, ring_pos );
+			mutex_unlock( &dev->lock );
+			PDEBUG("unlocked_ioctl stream %d\n", file_state->stream);
+			return 0;
+		}
+		break;
+		case AESDCHAR_IOCGRANGE:
+		{
+			struct aesd_dev* dev = ((struct aesd_file* )file->private_data)->dev;
+			aesd_lock( dev );
+			struct aesd_range range = {
+				.first_seq = aesd_circular_buffer_get_first_seq( &dev->buffer ),
+				.next_seq = dev->buffer.next_seq,
+				.start_offset = aesd_circular_buffer_get_start_offset( &dev->buffer ),
+				.end_offset = dev->buffer.end_offset,
+			};
+			mutex_unlock( &dev->lock );
+			if( 0 != copy_to_user(
+					(void __user* )arg,
+					&range,
+					sizeof(range)
+			) ) {
+				return -EFAULT;
+			}
+			return 0;
+		}
+		break;
+		case AESDCHAR_IOCGINDEX:
+		{
+			struct aesd_index index;
+			if( 0 != copy_from_user(
+					&index,
+					(const void __user* )arg,
+					sizeof(index)
+			) ) {
+				return -EFAULT;
+			}
+			long ret = aesd_get_index( file, &index );
+			if( ret ) {
+				return ret;
+			}
+			if( 0 != copy_to_user(
+					(void __user* )arg,
+					&index,
+					sizeof(index)
+			) ) {
+				return -EFAULT;
+			}
+			return 0;
+		}
+		break;
+		case AESDCHAR_IOCREADCMD:
+		{
+			struct aesd_read_cmd read_cmd;
+			if( 0 != copy_from_user(
+					&read_cmd,
+					(const void __user* )arg,
+					sizeof(read_cmd)
+			) ) {
+				return -EFAULT;
+			}
+			PDEBUG("unlocked_ioctl read %u commands from %u\n", read_cmd.cmd_count, read_cmd.write_cmd);
+			long ret = aesd_read_commands( file, &read_cmd );
+			if( ret ) {
+				return ret;
+			}
+			if( 0 != copy_to_user(
+					(void __user* )arg,
+					&read_cmd,
+					sizeof(read_cmd)
+			) ) {
+				return -EFAULT;
+			}
+			return 0;
+		}
+		break;
 	  default:  // (redundant, as cmd was checked against MAXNR)
 			return -ENOTTY;
 	}
@@ -284,79 +898,166 @@ long compat_ioctl(struct file* file, unsigned int cmd, unsigned long arg);
 }
 */
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static int aesd_setup_cdev(struct aesd_dev *dev, int index)
 {
-	int err, devno = MKDEV(aesd_major, aesd_minor);
+	int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
 	cdev_init(&dev->cdev, &aesd_fops);
 		dev->cdev.owner = THIS_MODULE;
 		dev->cdev.ops = &aesd_fops;
 	err = cdev_add (&dev->cdev, devno, 1);
 	if (err) {
-		printk(KERN_ERR "Error %d adding aesd cdev", err);
+		printk(KERN_ERR "Error %d adding aesd%d cdev", err, index);
 	}
 	return err;
 }
 
-int aesd_init_module(void)
+static int aesd_init_device(struct aesd_dev *dev, int index)
 {
-	dev_t dev = 0;
 	int result;
-	result = alloc_chrdev_region(
-			&dev,
-			aesd_minor, 1,
-			"aesdchar"
-	);
-	aesd_major = MAJOR(dev);
-	if (result < 0) {
-		printk(KERN_WARNING "Can't get major %d\n", aesd_major);
-		return result;
+	memset(dev,0,sizeof(struct aesd_dev));
+
+	dev->mmap_area = vmalloc_user( AESDCHAR_MMAP_SIZE );
+	if( dev->mmap_area == NULL ) {
+		return -ENOMEM;
 	}
-	memset(&aesd_device,0,sizeof(struct aesd_dev));
 
-	mutex_init( &aesd_device.lock );
+	mutex_init( &dev->lock );
+	init_waitqueue_head( &dev->wait_queue );
 	/**
 	 * initialize the AESD specific portion of the device
 	 */
-	aesd_circular_buffer_init( &aesd_device.buffer );
-	aesd_device.current_entry = (struct aesd_buffer_entry ){
+	aesd_circular_buffer_init( &dev->buffer );
+	dev->current_entry = (struct aesd_buffer_entry ){
 		.buffptr = NULL,
 		.size = 0,
 	};
 
-	result = aesd_setup_cdev(&aesd_device);
+	result = aesd_setup_cdev(dev, index);
+	if( !result ) {
+		char name[16];
+		snprintf( name, sizeof(name), "aesdchar%d", index );
+		debugfs_create_file( name, S_IRUGO, aesd_debugfs_root, dev, &aesd_stats_fops );
+	}
 
 	if( result ) {
-		unregister_chrdev_region(dev, 1);
+		mutex_destroy( &dev->lock );
+		vfree( dev->mmap_area );
+		dev->mmap_area = NULL;
 	}
 	return result;
 }
 
-void aesd_cleanup_module(void)
+static void aesd_cleanup_device(struct aesd_dev *dev)
 {
-	dev_t devno = MKDEV(aesd_major, aesd_minor);
+	cdev_del(&dev->cdev);
 
 	PDEBUG("clean write buffer\n");
 	// cleanup write buffer:
-	if( aesd_device.current_entry.buffptr != NULL ) {
-		kfree( aesd_device.current_entry.buffptr );
-	}
+	aesd_buffer_pool_free( dev->current_entry.buffptr, dev->current_entry.size );
 	PDEBUG("clean ring buffer\n");
 	// cleanup ring buffer:
-	unsigned int ring_count = aesd_circular_buffer_get_count( &aesd_device.buffer );
-	for( uint8_t i=0; i<ring_count; i++ ) {
-		struct aesd_buffer_entry* entry = &aesd_device.buffer.entry[
-			(aesd_device.buffer.out_offs + i) % ring_count
-		];
-		kfree( entry->buffptr );
+	unsigned int ring_count = aesd_circular_buffer_get_count( &dev->buffer );
+	for( unsigned int i=0; i<ring_count; i++ ) {
+		struct aesd_buffer_entry* entry = aesd_circular_buffer_get_entry( &dev->buffer, i );
+		aesd_buffer_pool_free( entry->buffptr, entry->size );
 		entry->buffptr = NULL;
 		entry->size = 0;
 	}
 
-	cdev_del(&aesd_device.cdev);
+	vfree( dev->mmap_area );
+	mutex_destroy( &dev->lock );
+}
+
+int aesd_init_module(void)
+{
+	dev_t dev = 0;
+	int result;
+	if( aesd_nr_devs < 1 ) {
+		printk(KERN_WARNING "Invalid aesd_nr_devs %d\n", aesd_nr_devs);
+		return -EINVAL;
+	}
+	result = alloc_chrdev_region(
+			&dev,
+			aesd_minor, aesd_nr_devs,
+			"aesdchar"
+	);
+	aesd_major = MAJOR(dev);
+	if (result < 0) {
+		printk(KERN_WARNING "Can't get major %d\n", aesd_major);
+		return result;
+	}
+	BUILD_BUG_ON( sizeof(struct aesd_mmap_header) > AESDCHAR_MMAP_HEADER_SIZE );
+	aesd_devices = kcalloc( aesd_nr_devs, sizeof(struct aesd_dev), GFP_KERNEL );
+	if( aesd_devices == NULL ) {
+		unregister_chrdev_region(dev, aesd_nr_devs);
+		return -ENOMEM;
+	}
+	result = aesd_buffer_pool_init();
+	if( result ) {
+		kfree( aesd_devices );
+		unregister_chrdev_region(dev, aesd_nr_devs);
+		return result;
+	}
+	// (debugfs is optional, failures are ignored)
+	aesd_debugfs_root = debugfs_create_dir( "aesdchar", NULL );
+
+	int initialized = 0;
+	for( ; initialized<aesd_nr_devs; initialized++ ) {
+		result = aesd_init_device( &aesd_devices[initialized], initialized );
+		if( result ) {
+			goto fail;
+		}
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	aesd_shrinker = shrinker_alloc( 0, "aesdchar" );
+	if( aesd_shrinker == NULL ) {
+		result = -ENOMEM;
+		goto fail;
+	}
+	aesd_shrinker->count_objects = aesd_shrink_count;
+	aesd_shrinker->scan_objects = aesd_shrink_scan;
+	aesd_shrinker->seeks = DEFAULT_SEEKS;
+	shrinker_register( aesd_shrinker );
+	result = 0;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	result = register_shrinker( &aesd_shrinker, "aesdchar" );
+#else
+	result = register_shrinker( &aesd_shrinker );
+#endif
+	if( result ) {
+		goto fail;
+	}
+	return 0;
+
+fail:
+	debugfs_remove_recursive( aesd_debugfs_root );
+	while( initialized-- > 0 ) {
+		aesd_cleanup_device( &aesd_devices[initialized] );
+	}
+	aesd_buffer_pool_exit();
+	kfree( aesd_devices );
+	unregister_chrdev_region(dev, aesd_nr_devs);
+	return result;
+}
+
+void aesd_cleanup_module(void)
+{
+	dev_t devno = MKDEV(aesd_major, aesd_minor);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	shrinker_free( aesd_shrinker );
+#else
+	unregister_shrinker( &aesd_shrinker );
+#endif
+	debugfs_remove_recursive( aesd_debugfs_root );
+	for( int i=0; i<aesd_nr_devs; i++ ) {
+		aesd_cleanup_device( &aesd_devices[i] );
+	}
+	kfree( aesd_devices );
+	aesd_buffer_pool_exit();
 
-	unregister_chrdev_region(devno, 1);
-	mutex_destroy( &aesd_device.lock );
+	unregister_chrdev_region(devno, aesd_nr_devs);
 }
 
 
@@ -0,0 +1,167 @@
+/**
+ * @file lockfree-ring-bench.c
+ * @brief Throughput of the lock free rings from aesd-lockfree-ring.h
+ * compared to a mutex protected ring from aesd-ring.h
+ *
+ * Usage: lockfree-ring-bench [transfers [producers]]
+ * Every run moves the given number of elements from the producer thread(s)
+ * to one consumer thread and prints the transfers per second.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "aesd-ring.h"
+#include "aesd-lockfree-ring.h"
+
+#define RING_LOG2 10
+
+AESD_SPSC_RING_DECLARE(bench_spsc_ring, uint64_t, RING_LOG2)
+AESD_MPSC_RING_DECLARE(bench_mpsc_ring, uint64_t, RING_LOG2)
+AESD_RING_DECLARE(bench_locked_ring, uint64_t, RING_LOG2)
+
+enum bench_kind {
+	BENCH_SPSC,
+	BENCH_MPSC,
+	BENCH_LOCKED,
+};
+
+struct bench
+{
+	enum bench_kind kind;
+	uint64_t transfers_per_producer;
+	struct bench_spsc_ring spsc_ring;
+	struct bench_mpsc_ring mpsc_ring;
+	struct bench_locked_ring locked_ring;
+	pthread_mutex_t lock;
+	uint64_t checksum;
+};
+
+static bool bench_push(struct bench* bench, const uint64_t* value)
+{
+	bool ret = false;
+	switch( bench->kind ) {
+		case BENCH_SPSC:
+			return bench_spsc_ring_push( &bench->spsc_ring, value );
+		case BENCH_MPSC:
+			return bench_mpsc_ring_push( &bench->mpsc_ring, value );
+		case BENCH_LOCKED:
+			pthread_mutex_lock( &bench->lock );
+			ret = bench_locked_ring_push( &bench->locked_ring, value );
+			pthread_mutex_unlock( &bench->lock );
+			return ret;
+	}
+	return ret;
+}
+
+static bool bench_pop(struct bench* bench, uint64_t* value)
+{
+	bool ret = false;
+	switch( bench->kind ) {
+		case BENCH_SPSC:
+			return bench_spsc_ring_pop( &bench->spsc_ring, value );
+		case BENCH_MPSC:
+			return bench_mpsc_ring_pop( &bench->mpsc_ring, value );
+		case BENCH_LOCKED:
+			pthread_mutex_lock( &bench->lock );
+			ret = bench_locked_ring_pop( &bench->locked_ring, value );
+			pthread_mutex_unlock( &bench->lock );
+			return ret;
+	}
+	return ret;
+}
+
+static void* bench_producer(void* arg)
+{
+	struct bench* bench = arg;
+	uint64_t value = 1;
+	while( value <= bench->transfers_per_producer ) {
+		if( bench_push( bench, &value ) ) {
+			value++;
+		}
+		else {
+			sched_yield();
+		}
+	}
+	return NULL;
+}
+
+static double now_sec(void)
+{
+	struct timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+/**
+ * @return transfers per second moving @param transfers elements
+ * from @param producers threads to the calling thread
+ */
+static double bench_run(struct bench* bench, enum bench_kind kind, uint64_t transfers, unsigned int producers)
+{
+	pthread_t threads[producers];
+	bench->kind = kind;
+	bench->transfers_per_producer = transfers / producers;
+	bench->checksum = 0;
+	bench_spsc_ring_init( &bench->spsc_ring );
+	bench_mpsc_ring_init( &bench->mpsc_ring );
+	bench_locked_ring_init( &bench->locked_ring );
+
+	double start = now_sec();
+	for( unsigned int i=0; i<producers; i++ ) {
+		if( pthread_create( &threads[i], NULL, bench_producer, bench ) != 0 ) {
+			perror( "pthread_create" );
+			exit( EXIT_FAILURE );
+		}
+	}
+	uint64_t received = 0;
+	uint64_t value;
+	while( received < bench->transfers_per_producer * producers ) {
+		if( bench_pop( bench, &value ) ) {
+			bench->checksum += value;
+			received++;
+		}
+		else {
+			sched_yield();
+		}
+	}
+	for( unsigned int i=0; i<producers; i++ ) {
+		pthread_join( threads[i], NULL );
+	}
+	double elapsed = now_sec() - start;
+
+	uint64_t n = bench->transfers_per_producer;
+	if( bench->checksum != producers * (n * (n + 1) / 2) ) {
+		fprintf( stderr, "checksum mismatch\n" );
+		exit( EXIT_FAILURE );
+	}
+	return received / elapsed;
+}
+
+int main(int argc, char** argv)
+{
+	uint64_t transfers = argc > 1 ? strtoull( argv[1], NULL, 10 ) : 10000000;
+	unsigned int producers = argc > 2 ? strtoul( argv[2], NULL, 10 ) : 4;
+	if( transfers == 0 || producers == 0 ) {
+		fprintf( stderr, "usage: %s [transfers [producers]]\n", argv[0] );
+		return EXIT_FAILURE;
+	}
+	struct bench* bench = aligned_alloc( AESD_CACHE_LINE_SIZE, sizeof(*bench) );
+	if( bench == NULL ) {
+		perror( "aligned_alloc" );
+		return EXIT_FAILURE;
+	}
+	pthread_mutex_init( &bench->lock, NULL );
+
+	printf( "spsc,   1 producer:  %12.0f transfers/s\n", bench_run( bench, BENCH_SPSC, transfers, 1 ) );
+	printf( "mutex,  1 producer:  %12.0f transfers/s\n", bench_run( bench, BENCH_LOCKED, transfers, 1 ) );
+	printf( "mpsc,  %2u producers: %12.0f transfers/s\n", producers, bench_run( bench, BENCH_MPSC, transfers, producers ) );
+	printf( "mutex, %2u producers: %12.0f transfers/s\n", producers, bench_run( bench, BENCH_LOCKED, transfers, producers ) );
+
+	pthread_mutex_destroy( &bench->lock );
+	free( bench );
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+#include "affinity.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/socket.h>
+
+/***********************
+ * Constants
+ ***********************/
+
+static const char* node_dirname = "/sys/devices/system/node";
+
+/***********************
+ * Types
+ ***********************/
+
+struct affinity {
+	placement_t placement;
+	// cpus client threads are placed on:
+	cpu_set_t cpus;
+	unsigned int cpu_count;
+	// NUMA node of every cpu (0 if unknown):
+	int node[CPU_SETSIZE];
+	// PLACEMENT_SPREAD, only used by the accept loop:
+	unsigned int next;
+};
+
+/***********************
+ * Function Declarations
+ ***********************/
+
+static ret_t affinity_parse_cpus(
+		const char* list,
+		cpu_set_t* cpus
+);
+static void affinity_read_nodes(int node[CPU_SETSIZE]);
+static int affinity_incoming_cpu(int socket_fd);
+static int affinity_nth_cpu(
+		const cpu_set_t* cpus,
+		unsigned int n
+);
+
+/***********************
+ * Function Definitions
+ ***********************/
+
+ret_t affinity_check_cpus(const char* list)
+{
+	cpu_set_t cpus;
+	return affinity_parse_cpus( list, &cpus );
+}
+
+affinity_t* affinity_create(const affinity_config_t* config)
+{
+	cpu_set_t allowed;
+	if( sched_getaffinity( 0, sizeof(cpu_set_t), &allowed ) ) {
+		perror( "sched_getaffinity" );
+		return NULL;
+	}
+	affinity_t* affinity = malloc( sizeof(affinity_t) );
+	if( affinity == NULL ) {
+		perror( "malloc" );
+		return NULL;
+	}
+	affinity->placement = config->placement;
+	affinity->next = 0;
+	if( config->cpus == NULL ) {
+		affinity->cpus = allowed;
+	}
+	else {
+		if( RET_OK != affinity_parse_cpus( config->cpus, &affinity->cpus ) ) {
+			OUTPUT_ERR( "ERROR: invalid cpu list '%s'\n", config->cpus );
+			goto error;
+		}
+		CPU_AND( &affinity->cpus, &affinity->cpus, &allowed );
+	}
+	affinity->cpu_count = CPU_COUNT( &affinity->cpus );
+	if( affinity->cpu_count == 0 ) {
+		OUTPUT_ERR( "ERROR: none of the cpus '%s' is available\n", config->cpus );
+		goto error;
+	}
+	affinity_read_nodes( affinity->node );
+	if( sched_setaffinity( 0, sizeof(cpu_set_t), &affinity->cpus ) ) {
+		perror( "sched_setaffinity" );
+		goto error;
+	}
+	return affinity;
+
+error:
+	FREE( affinity );
+	return NULL;
+}
+
+void affinity_destroy(affinity_t* affinity)
+{
+	FREE( affinity );
+}
+
+ret_t affinity_client_attr(
+		affinity_t* affinity,
+		int socket_fd,
+		pthread_attr_t* attr,
+		int* node
+)
+{
+	(*node) = -1;
+	cpu_set_t cpus;
+	CPU_ZERO( &cpus );
+	int incoming = -1;
+	if( affinity->placement != PLACEMENT_SPREAD ) {
+		incoming = affinity_incoming_cpu( socket_fd );
+	}
+	switch( affinity->placement ) {
+		case PLACEMENT_INCOMING:
+			if( incoming != -1 && CPU_ISSET( incoming, &affinity->cpus ) ) {
+				CPU_SET( incoming, &cpus );
+			}
+		break;
+		case PLACEMENT_NODE:
+			if( incoming != -1 ) {
+				for( int cpu=0; cpu<CPU_SETSIZE; cpu++ ) {
+					if(
+							CPU_ISSET( cpu, &affinity->cpus )
+							&& affinity->node[cpu] == affinity->node[incoming]
+					) {
+						CPU_SET( cpu, &cpus );
+					}
+				}
+			}
+		break;
+		default:
+		break;
+	}
+	// PLACEMENT_SPREAD, or the incoming cpu is unknown or not usable:
+	if( CPU_COUNT( &cpus ) == 0 ) {
+		int cpu = affinity_nth_cpu( &affinity->cpus, affinity->next % affinity->cpu_count );
+		affinity->next++;
+		CPU_SET( cpu, &cpus );
+	}
+	int ret = pthread_attr_setaffinity_np( attr, sizeof(cpu_set_t), &cpus );
+	if( ret != 0 ) {
+		OUTPUT_ERR( "pthread_attr_setaffinity_np: %d - %s\n", ret, strerror(ret) );
+		return RET_ERR;
+	}
+	// (all cpus chosen are on the same node)
+	for( int cpu=0; cpu<CPU_SETSIZE; cpu++ ) {
+		if( CPU_ISSET( cpu, &cpus ) ) {
+			(*node) = affinity->node[cpu];
+			break;
+		}
+	}
+	return RET_OK;
+}
+
+// parse a cpu list like "0-3,8" (sysfs format):
+static ret_t affinity_parse_cpus(
+		const char* list,
+		cpu_set_t* cpus
+)
+{
+	CPU_ZERO( cpus );
+	const char* pos = list;
+	while( true ) {
+		char* end = NULL;
+		if( !isdigit( (unsigned char )*pos ) ) {
+			return RET_ERR;
+		}
+		errno = 0;
+		unsigned long first = strtoul( pos, &end, 10 );
+		unsigned long last = first;
+		if( *end == '-' ) {
+			pos = end + 1;
+			if( !isdigit( (unsigned char )*pos ) ) {
+				return RET_ERR;
+			}
+			last = strtoul( pos, &end, 10 );
+		}
+		if( errno != 0 || last < first || last >= CPU_SETSIZE ) {
+			return RET_ERR;
+		}
+		for( unsigned long cpu=first; cpu<=last; cpu++ ) {
+			CPU_SET( cpu, cpus );
+		}
+		if( *end == '\0' ) {
+			return RET_OK;
+		}
+		if( *end != ',' ) {
+			return RET_ERR;
+		}
+		pos = end + 1;
+	}
+}
+
+// all cpus stay on node 0 if the kernel has no NUMA support:
+static void affinity_read_nodes(int node[CPU_SETSIZE])
+{
+	memset( node, 0, CPU_SETSIZE * sizeof(int) );
+	DIR* dir = opendir( node_dirname );
+	if( dir == NULL ) {
+		return;
+	}
+	struct dirent* entry;
+	while( (entry = readdir( dir )) != NULL ) {
+		int node_id;
+		if( 1 != sscanf( entry->d_name, "node%d", &node_id ) ) {
+			continue;
+		}
+		char filename[256];
+		snprintf( filename, sizeof(filename), "%s/node%d/cpulist", node_dirname, node_id );
+		FILE* file = fopen( filename, "r" );
+		if( file == NULL ) {
+			continue;
+		}
+		char list[1024];
+		if( fgets( list, sizeof(list), file ) != NULL ) {
+			list[strcspn( list, "\n" )] = '\0';
+			cpu_set_t cpus;
+			// (nodes without cpus have an empty list)
+			if( RET_OK == affinity_parse_cpus( list, &cpus ) ) {
+				for( int cpu=0; cpu<CPU_SETSIZE; cpu++ ) {
+					if( CPU_ISSET( cpu, &cpus ) ) {
+						node[cpu] = node_id;
+					}
+				}
+			}
+		}
+		fclose( file );
+	}
+	closedir( dir );
+}
+
+// the cpu which processed the packets of the connection (rx queue / RPS), -1 if unknown:
+static int affinity_incoming_cpu(int socket_fd)
+{
+#ifdef SO_INCOMING_CPU
+	int cpu = -1;
+	socklen_t size = sizeof(cpu);
+	if( getsockopt( socket_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &size ) ) {
+		return -1;
+	}
+	if( cpu < 0 || cpu >= CPU_SETSIZE ) {
+		return -1;
+	}
+	return cpu;
+#else
+	return -1;
+#endif
+}
+
+static int affinity_nth_cpu(
+		const cpu_set_t* cpus,
+		unsigned int n
+)
+{
+	for( int cpu=0; cpu<CPU_SETSIZE; cpu++ ) {
+		if( CPU_ISSET( cpu, cpus ) ) {
+			if( n == 0 ) {
+				return cpu;
+			}
+			n--;
+		}
+	}
+	return 0;
+}
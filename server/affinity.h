@@ -0,0 +1,32 @@
+#pragma once
+
+/*
+ * Placement of client threads on cpus (see placement_t).
+ *
+ * The thread calling affinity_create (the accept loop) is pinned to the
+ * chosen cpus, threads created afterwards (clock, cleanup, write ahead log)
+ * inherit that.
+ * Client threads are pinned before they start, so the buffers they allocate
+ * are first touched, and therefore placed, on their own NUMA node.
+ * The NUMA topology is read from sysfs, no libnuma is needed.
+ */
+
+#include "server_impl.h"
+
+typedef struct affinity affinity_t;
+
+// validate a cpu list like "0-3,8":
+ret_t affinity_check_cpus(const char* list);
+
+// pin the calling thread, NULL on error:
+affinity_t* affinity_create(const affinity_config_t* config);
+void affinity_destroy(affinity_t* affinity);
+
+// set the cpus for the thread handling the connection on socket_fd,
+// *node is set to their NUMA node, -1 on error:
+ret_t affinity_client_attr(
+		affinity_t* affinity,
+		int socket_fd,
+		pthread_attr_t* attr,
+		int* node
+);
@@ -0,0 +1,68 @@
+#include "alloc_stats.h"
+
+#include <stdlib.h>
+#include <stdatomic.h>
+
+/***********************
+ * Global Data
+ ***********************/
+
+static _Atomic unsigned long alloc_count = 0;
+static _Thread_local unsigned long thread_alloc_count = 0;
+
+/***********************
+ * Function Declarations
+ ***********************/
+
+// the real allocator (-Wl,--wrap):
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void* __real_aligned_alloc(size_t alignment, size_t size);
+
+void* __wrap_malloc(size_t size);
+void* __wrap_calloc(size_t count, size_t size);
+void* __wrap_realloc(void* ptr, size_t size);
+void* __wrap_aligned_alloc(size_t alignment, size_t size);
+
+/***********************
+ * Function Definitions
+ ***********************/
+
+unsigned long alloc_stats_count(void)
+{
+	return atomic_load_explicit( &alloc_count, memory_order_relaxed );
+}
+
+unsigned long alloc_stats_thread_count(void)
+{
+	return thread_alloc_count;
+}
+
+void* __wrap_malloc(size_t size)
+{
+	atomic_fetch_add_explicit( &alloc_count, 1, memory_order_relaxed );
+	thread_alloc_count++;
+	return __real_malloc( size );
+}
+
+void* __wrap_calloc(size_t count, size_t size)
+{
+	atomic_fetch_add_explicit( &alloc_count, 1, memory_order_relaxed );
+	thread_alloc_count++;
+	return __real_calloc( count, size );
+}
+
+void* __wrap_realloc(void* ptr, size_t size)
+{
+	atomic_fetch_add_explicit( &alloc_count, 1, memory_order_relaxed );
+	thread_alloc_count++;
+	return __real_realloc( ptr, size );
+}
+
+void* __wrap_aligned_alloc(size_t alignment, size_t size)
+{
+	atomic_fetch_add_explicit( &alloc_count, 1, memory_order_relaxed );
+	thread_alloc_count++;
+	return __real_aligned_alloc( alignment, size );
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+/*
+ * Allocation counter.
+ *
+ * The Makefile links aesdsocket with -Wl,--wrap for malloc, calloc,
+ * realloc and aligned_alloc, every call made by the server's own code
+ * is counted on its way to the real allocator.
+ * Allocations inside the C library itself are not counted.
+ * Each thread also counts its own allocations, the allocations made
+ * while serving a request are the difference of two reads.
+ */
+
+// allocations so far:
+unsigned long alloc_stats_count(void);
+// allocations made by the calling thread so far:
+unsigned long alloc_stats_thread_count(void);
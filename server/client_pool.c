@@ -0,0 +1,158 @@
+#include "client_pool.h"
+#include "socket_io.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/***********************
+ * Constants
+ ***********************/
+
+#define CLIENT_POOL_SLAB_SIZE 16
+// free lists: one per NUMA node, nodes beyond share the one of unpinned slots:
+#define CLIENT_POOL_MAX_NODES 64
+
+/***********************
+ * Types
+ ***********************/
+
+typedef struct client_slab {
+	struct client_slab* next;
+	thread_info_t slots[CLIENT_POOL_SLAB_SIZE];
+} client_slab_t;
+
+struct client_pool {
+	// protects everything below:
+	pthread_mutex_t mutex;
+	// free_lists[node+1], free_lists[0]: unpinned and new slots
+	thread_list_t free_lists[CLIENT_POOL_MAX_NODES + 1];
+	client_slab_t* slabs;
+};
+
+/***********************
+ * Function Declarations
+ ***********************/
+
+static ret_t client_pool_grow(client_pool_t* pool);
+static thread_list_t* client_pool_free_list(
+		client_pool_t* pool,
+		int node
+);
+
+/***********************
+ * Function Definitions
+ ***********************/
+
+client_pool_t* client_pool_create(void)
+{
+	client_pool_t* pool = malloc( sizeof(client_pool_t) );
+	if( pool == NULL ) {
+		perror( "malloc" );
+		return NULL;
+	}
+	pthread_mutex_init( &pool->mutex, NULL );
+	for( unsigned int i=0; i<=CLIENT_POOL_MAX_NODES; i++ ) {
+		TAILQ_INIT( &pool->free_lists[i] );
+	}
+	pool->slabs = NULL;
+	// the first slab is allocated up front:
+	if( RET_OK != client_pool_grow( pool ) ) {
+		client_pool_destroy( pool );
+		return NULL;
+	}
+	return pool;
+}
+
+void client_pool_destroy(client_pool_t* pool)
+{
+	while( pool->slabs != NULL ) {
+		client_slab_t* slab = pool->slabs;
+		pool->slabs = slab->next;
+		for( unsigned int i=0; i<CLIENT_POOL_SLAB_SIZE; i++ ) {
+			socket_input_free( &slab->slots[i].socket_input );
+			socket_output_free( &slab->slots[i].socket_output );
+		}
+		free( slab );
+	}
+	pthread_mutex_destroy( &pool->mutex );
+	FREE( pool );
+}
+
+thread_info_t* client_pool_get(
+		client_pool_t* pool,
+		int node
+)
+{
+	thread_info_t* thread_info = NULL;
+	pthread_mutex_lock( &pool->mutex );
+	// a slot of the node, a new or unpinned one, a slot of any other node:
+	thread_list_t* free_list = client_pool_free_list( pool, node );
+	if( TAILQ_EMPTY( free_list ) ) {
+		free_list = &pool->free_lists[0];
+	}
+	for( unsigned int i=1; i<=CLIENT_POOL_MAX_NODES && TAILQ_EMPTY( free_list ); i++ ) {
+		free_list = &pool->free_lists[i];
+	}
+	if( TAILQ_EMPTY( free_list ) ) {
+		if( RET_OK != client_pool_grow( pool ) ) {
+			goto end;
+		}
+		free_list = &pool->free_lists[0];
+	}
+	thread_info = TAILQ_FIRST( free_list );
+	TAILQ_REMOVE( free_list, thread_info, nodes );
+end:
+	pthread_mutex_unlock( &pool->mutex );
+	if( thread_info != NULL && thread_info->node != node ) {
+		// allocated again by the thread on node:
+		socket_input_free( &thread_info->socket_input );
+		socket_output_free( &thread_info->socket_output );
+		thread_info->node = node;
+	}
+	return thread_info;
+}
+
+void client_pool_put(
+		client_pool_t* pool,
+		thread_info_t* thread_info
+)
+{
+	pthread_mutex_lock( &pool->mutex );
+	// (the most recently used slot is still in the cache)
+	TAILQ_INSERT_HEAD( client_pool_free_list( pool, thread_info->node ), thread_info, nodes );
+	pthread_mutex_unlock( &pool->mutex );
+}
+
+// must be called with pool->mutex held, unless the pool is being created:
+static ret_t client_pool_grow(client_pool_t* pool)
+{
+	client_slab_t* slab = malloc( sizeof(client_slab_t) );
+	if( slab == NULL ) {
+		perror( "malloc" );
+		return RET_ERR;
+	}
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+	for( unsigned int i=0; i<CLIENT_POOL_SLAB_SIZE; i++ ) {
+		thread_info_t* thread_info = &slab->slots[i];
+		memset( thread_info, 0, sizeof(thread_info_t) );
+		thread_info->socket_fd = -1;
+		// no buffers yet:
+		thread_info->node = -1;
+		TAILQ_INSERT_TAIL( &pool->free_lists[0], thread_info, nodes );
+	}
+	OUTPUT_DEBUG( "client pool: new slab\n" );
+	return RET_OK;
+}
+
+// must be called with pool->mutex held:
+static thread_list_t* client_pool_free_list(
+		client_pool_t* pool,
+		int node
+)
+{
+	if( node < 0 || node >= CLIENT_POOL_MAX_NODES ) {
+		return &pool->free_lists[0];
+	}
+	return &pool->free_lists[node + 1];
+}
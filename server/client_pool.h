@@ -0,0 +1,31 @@
+#pragma once
+
+/*
+ * Preallocated per-connection state (thread_info_t) for the accept loop.
+ *
+ * Slots are allocated in slabs and only freed when the pool is destroyed.
+ * A slot keeps its socket buffers when it is put back, so accepting a
+ * connection does not allocate once the pool has grown to the number of
+ * concurrent connections.
+ * The buffers are allocated by the pinned client thread, so they are
+ * placed on its NUMA node. Free slots are kept per node, a slot taken for
+ * another node releases its buffers, the next thread allocates new ones.
+ */
+
+#include "server_impl.h"
+
+typedef struct client_pool client_pool_t;
+
+client_pool_t* client_pool_create(void);
+// all slots must have been put back:
+void client_pool_destroy(client_pool_t* pool);
+
+// a slot for a thread on NUMA node (-1: unpinned), NULL on error:
+thread_info_t* client_pool_get(
+		client_pool_t* pool,
+		int node
+);
+void client_pool_put(
+		client_pool_t* pool,
+		thread_info_t* thread_info
+);
@@ -0,0 +1,558 @@
+#include "device_io.h"
+#include "socket_io.h"
+#include "../aesd-char-driver/aesd_ioctl.h"
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+#include "../aesd-char-driver/aesd-ring.h"
+#include "../aesd-char-driver/aesd-lockfree-ring.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+/***********************
+ * Constants
+ ***********************/
+
+// pending requests: 2^DEVICE_IO_QUEUE_SIZE_LOG2
+#define DEVICE_IO_QUEUE_SIZE_LOG2 8
+// requests taken from the queue at once:
+#define DEVICE_IO_BATCH_SIZE 32
+// appends sharing one read of the device, the driver keeps this many commands,
+// so every append still finds its own packet in the replay:
+#define DEVICE_IO_APPENDS_PER_READ AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+// 2^DEVICE_IO_APPENDS_SIZE_LOG2 >= DEVICE_IO_APPENDS_PER_READ
+#define DEVICE_IO_APPENDS_SIZE_LOG2 4
+// initial size of the buffer reading the device:
+#define DEVICE_IO_READ_SIZE 4096
+// released replays kept for reuse:
+#define DEVICE_IO_REPLAY_SPARES 8
+// commands looked up for range queries (the driver keeps 10):
+#define DEVICE_IO_INDEX_SIZE 16
+
+/***********************
+ * Types
+ ***********************/
+
+struct device_replay {
+	_Atomic unsigned int refs;
+	// released to the spares of device_io:
+	struct device_io* device_io;
+	size_t capacity;
+	size_t size;
+	char data[];
+};
+
+typedef enum {
+	DEVICE_IO_APPEND,
+	DEVICE_IO_SEEK,
+	DEVICE_IO_RANGE,
+	DEVICE_IO_STOP,
+} device_io_type_t;
+
+// lives on the stack of the submitting thread:
+typedef struct {
+	device_io_type_t type;
+	// DEVICE_IO_APPEND:
+	const char* data;
+	size_t size;
+	// DEVICE_IO_SEEK:
+	struct aesd_seekto seek_to;
+	// DEVICE_IO_RANGE:
+	range_query_t query;
+	// result, valid once done is posted:
+	ret_t ret;
+	device_replay_t* replay;
+	sem_t done;
+} device_io_request_t;
+
+// (the ring macro needs a single token type to get "const" right)
+typedef device_io_request_t* device_io_request_ptr_t;
+
+AESD_MPSC_RING_DECLARE(device_io_queue, device_io_request_ptr_t, DEVICE_IO_QUEUE_SIZE_LOG2)
+AESD_RING_DECLARE(device_io_appends, device_io_request_ptr_t, DEVICE_IO_APPENDS_SIZE_LOG2)
+
+struct device_io {
+	struct device_io_queue queue;
+	// free slots in queue, so pushing never fails:
+	sem_t free_slots;
+	// requests in queue:
+	sem_t pending;
+	pthread_t thread_fd;
+	// everything below is only used by the I/O thread:
+	int fd;
+	// written, answered by the next read of the device:
+	struct device_io_appends appends;
+	// contents of the whole device, NULL if not read yet:
+	device_replay_t* cache;
+	// state of the device when cache was read:
+	struct aesd_range cache_range;
+	// released replays, reading the device does not allocate:
+	_Atomic(device_replay_t*) spares[DEVICE_IO_REPLAY_SPARES];
+};
+
+/***********************
+ * Function Declarations
+ ***********************/
+
+static ret_t device_io_submit(
+		device_io_t* device_io,
+		device_io_request_t* request
+);
+static void* device_io_thread(void* void_arg);
+static ret_t device_io_write(
+		device_io_t* device_io,
+		const char* data,
+		size_t size
+);
+static void device_io_answer_appends(device_io_t* device_io);
+static device_replay_t* device_io_replay(device_io_t* device_io);
+static device_replay_t* device_io_range_read(
+		device_io_t* device_io,
+		const range_query_t* query
+);
+static device_replay_t* device_io_read(
+		device_io_t* device_io,
+		size_t max_size
+);
+static device_replay_t* device_replay_alloc(device_io_t* device_io);
+
+/***********************
+ * Function Definitions
+ ***********************/
+
+device_io_t* device_io_start(const char* filename)
+{
+	device_io_t* device_io = aligned_alloc( AESD_CACHE_LINE_SIZE, sizeof(device_io_t) );
+	if( device_io == NULL ) {
+		perror( "aligned_alloc" );
+		return NULL;
+	}
+	device_io->fd = open( filename, O_RDWR );
+	if( device_io->fd == -1 ) {
+		perror( filename );
+		free( device_io );
+		return NULL;
+	}
+	device_io->cache = NULL;
+	device_io_appends_init( &device_io->appends );
+	for( unsigned int i=0; i<DEVICE_IO_REPLAY_SPARES; i++ ) {
+		atomic_init( &device_io->spares[i], NULL );
+	}
+	device_io_queue_init( &device_io->queue );
+	sem_init( &device_io->free_slots, 0, 1u << DEVICE_IO_QUEUE_SIZE_LOG2 );
+	sem_init( &device_io->pending, 0, 0 );
+	int ret = pthread_create(
+			&device_io->thread_fd,
+			0,
+			device_io_thread,
+			device_io
+	);
+	if( ret != 0 ) {
+		OUTPUT_ERR( "pthread_create: %d - %s\n", ret, strerror(ret) );
+		sem_destroy( &device_io->free_slots );
+		sem_destroy( &device_io->pending );
+		close( device_io->fd );
+		free( device_io );
+		return NULL;
+	}
+	return device_io;
+}
+
+ret_t device_io_stop(device_io_t* device_io)
+{
+	device_io_request_t request = {
+		.type = DEVICE_IO_STOP,
+	};
+	ret_t ret = device_io_submit( device_io, &request );
+	if( pthread_join( device_io->thread_fd, NULL ) ) {
+		perror( "pthread_join" );
+		ret = RET_ERR;
+	}
+	if( device_io->cache != NULL ) {
+		device_replay_put( device_io->cache );
+	}
+	for( unsigned int i=0; i<DEVICE_IO_REPLAY_SPARES; i++ ) {
+		free( atomic_load_explicit( &device_io->spares[i], memory_order_relaxed ) );
+	}
+	if( close( device_io->fd ) ) {
+		perror( "close" );
+		ret = RET_ERR;
+	}
+	sem_destroy( &device_io->free_slots );
+	sem_destroy( &device_io->pending );
+	free( device_io );
+	return ret;
+}
+
+ret_t device_io_append(
+		device_io_t* device_io,
+		const char* data,
+		size_t size,
+		device_replay_t** replay
+)
+{
+	device_io_request_t request = {
+		.type = DEVICE_IO_APPEND,
+		.data = data,
+		.size = size,
+	};
+	ret_t ret = device_io_submit( device_io, &request );
+	(*replay) = request.replay;
+	return ret;
+}
+
+ret_t device_io_range(
+		device_io_t* device_io,
+		const range_query_t* query,
+		device_replay_t** replay
+)
+{
+	device_io_request_t request = {
+		.type = DEVICE_IO_RANGE,
+		.query = (*query),
+	};
+	ret_t ret = device_io_submit( device_io, &request );
+	(*replay) = request.replay;
+	return ret;
+}
+
+ret_t device_io_seek(
+		device_io_t* device_io,
+		uint32_t write_cmd,
+		uint32_t write_cmd_offset,
+		device_replay_t** replay
+)
+{
+	device_io_request_t request = {
+		.type = DEVICE_IO_SEEK,
+		.seek_to = {
+			.write_cmd = write_cmd,
+			.write_cmd_offset = write_cmd_offset,
+		},
+	};
+	ret_t ret = device_io_submit( device_io, &request );
+	(*replay) = request.replay;
+	return ret;
+}
+
+void device_replay_put(device_replay_t* replay)
+{
+	if( 1 != atomic_fetch_sub_explicit( &replay->refs, 1, memory_order_acq_rel ) ) {
+		return;
+	}
+	for( unsigned int i=0; i<DEVICE_IO_REPLAY_SPARES; i++ ) {
+		device_replay_t* expected = NULL;
+		if( atomic_compare_exchange_strong_explicit(
+				&replay->device_io->spares[i], &expected, replay,
+				memory_order_release, memory_order_relaxed
+		) ) {
+			return;
+		}
+	}
+	free( replay );
+}
+
+ret_t device_replay_write(
+		device_replay_t* replay,
+		socket_output_t* output
+)
+{
+	return socket_output_write( output, replay->data, replay->size );
+}
+
+// queue request and wait until it has been served:
+static ret_t device_io_submit(
+		device_io_t* device_io,
+		device_io_request_t* request
+)
+{
+	request->ret = RET_ERR;
+	request->replay = NULL;
+	if( sem_init( &request->done, 0, 0 ) ) {
+		perror( "sem_init" );
+		return RET_ERR;
+	}
+	while( sem_wait( &device_io->free_slots ) ) {
+		if( errno != EINTR ) {
+			perror( "sem_wait" );
+			sem_destroy( &request->done );
+			return RET_ERR;
+		}
+	}
+	// (a slot is reserved, so this can't fail)
+	device_io_queue_push( &device_io->queue, &request );
+	sem_post( &device_io->pending );
+	// the request is queued, so wait until it has been served
+	// (sem_wait on a valid semaphore only fails with EINTR):
+	while( sem_wait( &request->done ) ) {
+		assert( errno == EINTR );
+	}
+	sem_destroy( &request->done );
+	return request->ret;
+}
+
+static void* device_io_thread(void* void_arg)
+{
+	device_io_t* device_io = (device_io_t* )void_arg;
+	device_io_request_t* batch[DEVICE_IO_BATCH_SIZE];
+	bool stop = false;
+	OUTPUT_DEBUG( "device_io_thread: START\n" );
+	while( !stop ) {
+		// wait for a request, then take whatever else is queued:
+		unsigned int count = 0;
+		if( sem_wait( &device_io->pending ) ) {
+			if( errno == EINTR ) {
+				continue;
+			}
+			perror( "sem_wait" );
+			break;
+		}
+		do {
+			// (the producer may still be filling its slot)
+			while( !device_io_queue_pop( &device_io->queue, &batch[count] ) ) {
+				sched_yield();
+			}
+			sem_post( &device_io->free_slots );
+			count++;
+		} while( count < DEVICE_IO_BATCH_SIZE && 0 == sem_trywait( &device_io->pending ) );
+		OUTPUT_DEBUG( "device_io_thread: %u requests\n", count );
+		// in queue order, up to DEVICE_IO_APPENDS_PER_READ consecutive appends share one read of the device:
+		for( unsigned int i=0; i<count; i++ ) {
+			device_io_request_t* request = batch[i];
+			switch( request->type ) {
+				case DEVICE_IO_APPEND:
+					request->ret = device_io_write( device_io, request->data, request->size );
+					device_io_appends_push( &device_io->appends, &request );
+					if(
+							i+1 == count || batch[i+1]->type != DEVICE_IO_APPEND
+							|| device_io_appends_count( &device_io->appends ) == DEVICE_IO_APPENDS_PER_READ
+					) {
+						device_io_answer_appends( device_io );
+					}
+				break;
+				case DEVICE_IO_SEEK:
+					if( -1 == ioctl(
+							device_io->fd,
+							AESDCHAR_IOCSEEKTO,
+							&request->seek_to
+					) ) {
+						OUTPUT_ERR( "ERROR: ioctl failed with: %d - '%s'\n", errno, strerror(errno) );
+					}
+					else {
+						request->replay = device_io_read( device_io, SIZE_MAX );
+						if( request->replay != NULL ) {
+							request->ret = RET_OK;
+						}
+					}
+					sem_post( &request->done );
+				break;
+				case DEVICE_IO_RANGE:
+					request->replay = device_io_range_read( device_io, &request->query );
+					if( request->replay != NULL ) {
+						request->ret = RET_OK;
+					}
+					sem_post( &request->done );
+				break;
+				case DEVICE_IO_STOP:
+					// (requests queued in the same batch are still served)
+					stop = true;
+					request->ret = RET_OK;
+					sem_post( &request->done );
+				break;
+			}
+		}
+	}
+	OUTPUT_DEBUG( "device_io_thread: STOP\n" );
+	return NULL;
+}
+
+static ret_t device_io_write(
+		device_io_t* device_io,
+		const char* data,
+		size_t size
+)
+{
+	// (a packet split into several writes is still one command for the driver)
+	while( size > 0 ) {
+		ssize_t ret = write( device_io->fd, data, size );
+		if( ret == -1 ) {
+			if( errno == EINTR ) {
+				continue;
+			}
+			OUTPUT_ERR( "ERROR: failed writing to output file: %d - %s\n", errno, strerror(errno) );
+			return RET_ERR;
+		}
+		data += ret;
+		size -= ret;
+	}
+	return RET_OK;
+}
+
+static void device_io_answer_appends(device_io_t* device_io)
+{
+	device_replay_t* replay = device_io_replay( device_io );
+	device_io_request_t* request;
+	while( device_io_appends_pop( &device_io->appends, &request ) ) {
+		if( replay == NULL ) {
+			request->ret = RET_ERR;
+		}
+		else if( request->ret == RET_OK ) {
+			atomic_fetch_add_explicit( &replay->refs, 1, memory_order_relaxed );
+			request->replay = replay;
+		}
+		sem_post( &request->done );
+	}
+	if( replay != NULL ) {
+		device_replay_put( replay );
+	}
+}
+
+// contents of the whole device, only read again if the device changed:
+static device_replay_t* device_io_replay(device_io_t* device_io)
+{
+	// (other processes may write to the device, too)
+	struct aesd_range range;
+	bool have_range = (0 == ioctl( device_io->fd, AESDCHAR_IOCGRANGE, &range ));
+	if( device_io->cache != NULL ) {
+		if( have_range && !memcmp( &range, &device_io->cache_range, sizeof(range) ) ) {
+			atomic_fetch_add_explicit( &device_io->cache->refs, 1, memory_order_relaxed );
+			return device_io->cache;
+		}
+		device_replay_put( device_io->cache );
+		device_io->cache = NULL;
+	}
+	if( -1 == lseek( device_io->fd, 0, SEEK_SET ) ) {
+		perror( "lseek" );
+		return NULL;
+	}
+	device_replay_t* replay = device_io_read( device_io, SIZE_MAX );
+	// without AESDCHAR_IOCGRANGE changes can't be detected, nothing is cached:
+	if( replay != NULL && have_range ) {
+		atomic_fetch_add_explicit( &replay->refs, 1, memory_order_relaxed );
+		device_io->cache = replay;
+		device_io->cache_range = range;
+	}
+	return replay;
+}
+
+// the part of the device selected by query:
+static device_replay_t* device_io_range_read(
+		device_io_t* device_io,
+		const range_query_t* query
+)
+{
+	uint64_t begin, end;
+	if( query->type == RANGE_BYTES ) {
+		struct aesd_range range;
+		if( -1 == ioctl( device_io->fd, AESDCHAR_IOCGRANGE, &range ) ) {
+			OUTPUT_ERR( "ERROR: ioctl failed with: %d - '%s'\n", errno, strerror(errno) );
+			return NULL;
+		}
+		range_query_clamp( query, range.end_offset - range.start_offset, &begin, &end );
+		if( -1 == lseek( device_io->fd, begin, SEEK_SET ) ) {
+			perror( "lseek" );
+			return NULL;
+		}
+	}
+	else {
+		struct aesd_index_entry entries[DEVICE_IO_INDEX_SIZE];
+		struct aesd_index index = {
+			.capacity = DEVICE_IO_INDEX_SIZE,
+			.entries = (uintptr_t )entries,
+		};
+		if( -1 == ioctl( device_io->fd, AESDCHAR_IOCGINDEX, &index ) ) {
+			OUTPUT_ERR( "ERROR: ioctl failed with: %d - '%s'\n", errno, strerror(errno) );
+			return NULL;
+		}
+		uint64_t count = index.count < DEVICE_IO_INDEX_SIZE ? index.count : DEVICE_IO_INDEX_SIZE;
+		uint64_t first_packet, end_packet;
+		range_query_clamp( query, count, &first_packet, &end_packet );
+		begin = end = 0;
+		if( first_packet < end_packet ) {
+			begin = entries[first_packet].offset;
+			end = entries[end_packet-1].offset + entries[end_packet-1].size;
+			struct aesd_seekto seek_to = {
+				.write_cmd = first_packet,
+				.write_cmd_offset = 0,
+			};
+			if( -1 == ioctl( device_io->fd, AESDCHAR_IOCSEEKTO, &seek_to ) ) {
+				OUTPUT_ERR( "ERROR: ioctl failed with: %d - '%s'\n", errno, strerror(errno) );
+				return NULL;
+			}
+		}
+	}
+	return device_io_read( device_io, end - begin );
+}
+
+// read from the current file position to the end of the device, at most max_size bytes:
+static device_replay_t* device_io_read(
+		device_io_t* device_io,
+		size_t max_size
+)
+{
+	device_replay_t* replay = device_replay_alloc( device_io );
+	if( replay == NULL ) {
+		return NULL;
+	}
+	atomic_init( &replay->refs, 1 );
+	replay->size = 0;
+	while( replay->size < max_size ) {
+		if( replay->size == replay->capacity ) {
+			size_t capacity = 2 * replay->capacity;
+			device_replay_t* larger = realloc( replay, sizeof(device_replay_t) + capacity );
+			if( larger == NULL ) {
+				perror( "realloc" );
+				free( replay );
+				return NULL;
+			}
+			replay = larger;
+			replay->capacity = capacity;
+		}
+		size_t length = replay->capacity - replay->size;
+		if( length > max_size - replay->size ) {
+			length = max_size - replay->size;
+		}
+		ssize_t ret = read( device_io->fd, &replay->data[replay->size], length );
+		if( ret == -1 ) {
+			if( errno == EINTR ) {
+				continue;
+			}
+			OUTPUT_ERR( "ERROR: failed reading output file: %d - %s\n", errno, strerror(errno) );
+			free( replay );
+			return NULL;
+		}
+		if( ret == 0 ) {
+			break;
+		}
+		replay->size += ret;
+	}
+	return replay;
+}
+
+// a released replay if there is one:
+static device_replay_t* device_replay_alloc(device_io_t* device_io)
+{
+	for( unsigned int i=0; i<DEVICE_IO_REPLAY_SPARES; i++ ) {
+		device_replay_t* replay = atomic_exchange_explicit(
+				&device_io->spares[i], NULL, memory_order_acquire
+		);
+		if( replay != NULL ) {
+			return replay;
+		}
+	}
+	device_replay_t* replay = malloc( sizeof(device_replay_t) + DEVICE_IO_READ_SIZE );
+	if( replay == NULL ) {
+		perror( "malloc" );
+		return NULL;
+	}
+	replay->device_io = device_io;
+	replay->capacity = DEVICE_IO_READ_SIZE;
+	return replay;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+/*
+ * Device I/O stage for the /dev/aesdchar backend.
+ *
+ * One thread owns the device file descriptor and serves the requests of
+ * all client threads in the order they were queued (lock free MPSC ring),
+ * so client threads never wait for the kernel driver's mutex.
+ * Packets queued together are written back to back and answered with
+ * a single read of the device, up to as many as the driver keeps. That read is cached until the device
+ * changes, so replays without new data don't touch the driver at all.
+ */
+
+#include "server_impl.h"
+
+#include <stdint.h>
+
+typedef struct device_io device_io_t;
+// refcounted, immutable contents of the device:
+typedef struct device_replay device_replay_t;
+
+// open the device and start the I/O thread:
+device_io_t* device_io_start(const char* filename);
+// serve the queued requests, stop the thread and close the device,
+// all replays must have been put:
+ret_t device_io_stop(device_io_t* device_io);
+
+// write a packet, replay holds the contents of the device afterwards:
+ret_t device_io_append(
+		device_io_t* device_io,
+		const char* data,
+		size_t size,
+		device_replay_t** replay
+);
+// range query, AESDCHAR_IOCSEEKTO to the first packet (lseek for bytes),
+// replay holds the selected part of the device:
+ret_t device_io_range(
+		device_io_t* device_io,
+		const range_query_t* query,
+		device_replay_t** replay
+);
+// AESDCHAR_IOCSEEKTO, replay holds the contents from there on:
+ret_t device_io_seek(
+		device_io_t* device_io,
+		uint32_t write_cmd,
+		uint32_t write_cmd_offset,
+		device_replay_t** replay
+);
+
+void device_replay_put(device_replay_t* replay);
+ret_t device_replay_write(
+		device_replay_t* replay,
+		socket_output_t* output
+);
@@ -0,0 +1,242 @@
+#include "handoff.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+/***********************
+ * Constants
+ ***********************/
+
+static const char* control_filename = "/var/tmp/aesdsocket.control";
+
+#define HANDOFF_MAGIC 0x61657364
+#define HANDOFF_VERSION 1
+#define HANDOFF_MAX_FDS 3
+// a connection which does not send a request in time is dropped:
+#define HANDOFF_REQUEST_TIMEOUT_S 1
+
+/***********************
+ * Types
+ ***********************/
+
+// new instance -> running server:
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+} handoff_request_t;
+
+// running server -> new instance, along with the fds:
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t has_output_fd;
+} handoff_reply_t;
+
+/***********************
+ * Function Declarations
+ ***********************/
+
+static void handoff_address(struct sockaddr_un* addr);
+
+/***********************
+ * Function Definitions
+ ***********************/
+
+int handoff_listen(void)
+{
+	int control_fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+	if( control_fd == -1 ) {
+		perror( "socket" );
+		return -1;
+	}
+	struct sockaddr_un addr;
+	handoff_address( &addr );
+	// left over by a server which crashed:
+	unlink( control_filename );
+	if( bind( control_fd, (struct sockaddr* )&addr, sizeof(addr) ) ) {
+		perror( control_filename );
+		close( control_fd );
+		return -1;
+	}
+	if( listen( control_fd, 1 ) ) {
+		perror( control_filename );
+		close( control_fd );
+		unlink( control_filename );
+		return -1;
+	}
+	return control_fd;
+}
+
+int handoff_accept(int control_fd)
+{
+	int connection_fd = accept( control_fd, NULL, NULL );
+	if( connection_fd == -1 ) {
+		perror( "accept" );
+		return -1;
+	}
+	// don't stall the accept loop:
+	struct timeval timeout = {
+		.tv_sec = HANDOFF_REQUEST_TIMEOUT_S,
+		.tv_usec = 0,
+	};
+	setsockopt( connection_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout) );
+	handoff_request_t request;
+	ssize_t size = recv( connection_fd, &request, sizeof(request), MSG_WAITALL );
+	if(
+			size != sizeof(request)
+			|| request.magic != HANDOFF_MAGIC
+			|| request.version != HANDOFF_VERSION
+	) {
+		OUTPUT_ERR( "ERROR: invalid takeover request\n" );
+		close( connection_fd );
+		return -1;
+	}
+	return connection_fd;
+}
+
+ret_t handoff_send(
+		int connection_fd,
+		const handoff_fds_t* fds
+)
+{
+	handoff_reply_t reply = {
+		.magic = HANDOFF_MAGIC,
+		.version = HANDOFF_VERSION,
+		.has_output_fd = (fds->output_fd != -1),
+	};
+	int fd_array[HANDOFF_MAX_FDS] = { fds->socket_fd, fds->control_fd, fds->output_fd };
+	unsigned int fd_count = reply.has_output_fd ? 3 : 2;
+	union {
+		char buffer[CMSG_SPACE( HANDOFF_MAX_FDS * sizeof(int) )];
+		struct cmsghdr align;
+	} control;
+	memset( &control, 0, sizeof(control) );
+	struct iovec iov = {
+		.iov_base = &reply,
+		.iov_len = sizeof(reply),
+	};
+	struct msghdr message = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buffer,
+		.msg_controllen = CMSG_SPACE( fd_count * sizeof(int) ),
+	};
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR( &message );
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN( fd_count * sizeof(int) );
+	memcpy( CMSG_DATA( cmsg ), fd_array, fd_count * sizeof(int) );
+	if( sendmsg( connection_fd, &message, MSG_NOSIGNAL ) != sizeof(reply) ) {
+		perror( "sendmsg" );
+		return RET_ERR;
+	}
+	return RET_OK;
+}
+
+ret_t handoff_receive(handoff_fds_t* fds)
+{
+	ret_t ret = RET_ERR;
+	int connection_fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+	if( connection_fd == -1 ) {
+		perror( "socket" );
+		return RET_ERR;
+	}
+	struct sockaddr_un addr;
+	handoff_address( &addr );
+	if( connect( connection_fd, (struct sockaddr* )&addr, sizeof(addr) ) ) {
+		perror( control_filename );
+		goto end;
+	}
+	handoff_request_t request = {
+		.magic = HANDOFF_MAGIC,
+		.version = HANDOFF_VERSION,
+	};
+	if( send( connection_fd, &request, sizeof(request), MSG_NOSIGNAL ) != sizeof(request) ) {
+		perror( "send" );
+		goto end;
+	}
+	// the running server answers once it stopped appending to the history:
+	handoff_reply_t reply;
+	union {
+		char buffer[CMSG_SPACE( HANDOFF_MAX_FDS * sizeof(int) )];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = {
+		.iov_base = &reply,
+		.iov_len = sizeof(reply),
+	};
+	struct msghdr message = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buffer,
+		.msg_controllen = sizeof(control.buffer),
+	};
+	ssize_t size;
+	do {
+		size = recvmsg( connection_fd, &message, 0 );
+	} while( size == -1 && errno == EINTR );
+	if( size == -1 ) {
+		perror( "recvmsg" );
+		goto end;
+	}
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR( &message );
+	if(
+			size != sizeof(reply)
+			|| reply.magic != HANDOFF_MAGIC
+			|| reply.version != HANDOFF_VERSION
+			|| cmsg == NULL
+			|| cmsg->cmsg_level != SOL_SOCKET
+			|| cmsg->cmsg_type != SCM_RIGHTS
+	) {
+		OUTPUT_ERR( "ERROR: invalid takeover reply\n" );
+		goto end;
+	}
+	unsigned int fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	if( fd_count > HANDOFF_MAX_FDS ) {
+		fd_count = HANDOFF_MAX_FDS;
+	}
+	int fd_array[HANDOFF_MAX_FDS] = { -1, -1, -1 };
+	memcpy( fd_array, CMSG_DATA( cmsg ), fd_count * sizeof(int) );
+	if( fd_count != (reply.has_output_fd ? 3 : 2) ) {
+		OUTPUT_ERR( "ERROR: invalid takeover reply\n" );
+		for( unsigned int i=0; i<fd_count; i++ ) {
+			close( fd_array[i] );
+		}
+		goto end;
+	}
+	fds->socket_fd = fd_array[0];
+	fds->control_fd = fd_array[1];
+	fds->output_fd = fd_array[2];
+	ret = RET_OK;
+end:
+	close( connection_fd );
+	return ret;
+}
+
+void handoff_close(
+		int control_fd,
+		bool handed_off
+)
+{
+	if( close( control_fd ) ) {
+		perror( control_filename );
+	}
+	if( !handed_off && unlink( control_filename ) ) {
+		perror( control_filename );
+	}
+}
+
+static void handoff_address(struct sockaddr_un* addr)
+{
+	memset( addr, 0, sizeof(struct sockaddr_un) );
+	addr->sun_family = AF_UNIX;
+	strncpy( addr->sun_path, control_filename, sizeof(addr->sun_path) - 1 );
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+/*
+ * Zero downtime restart.
+ *
+ * A running server listens on a unix control socket. A new instance
+ * started with --takeover connects to it, the running server then stops
+ * accepting and appending to the history and passes its listening socket,
+ * the control socket and the history file to the new instance (SCM_RIGHTS)
+ * right away. Its connections finish meanwhile, packets they receive from
+ * then on are forwarded to the new instance. It exits once they are done.
+ * The listening socket is never closed, connections arriving meanwhile
+ * wait in the listen backlog instead of being refused.
+ */
+
+#include "server_impl.h"
+
+typedef struct {
+	int socket_fd;
+	int control_fd;
+	// -1 if there is none:
+	int output_fd;
+} handoff_fds_t;
+
+// create the control socket, -1 on error:
+int handoff_listen(void);
+// accept a takeover request on control_fd, -1 if there is no valid request:
+int handoff_accept(int control_fd);
+// pass fds to the instance which sent the request on connection_fd:
+ret_t handoff_send(
+		int connection_fd,
+		const handoff_fds_t* fds
+);
+// connect to the running server, wait until it passes its fds:
+ret_t handoff_receive(handoff_fds_t* fds);
+// close the control socket, keep it in the filesystem if it has been handed off:
+void handoff_close(
+		int control_fd,
+		bool handed_off
+);
@@ -0,0 +1,217 @@
+#include "logger.h"
+#include "server_impl.h"
+#include "thread_rings.h"
+#include "../aesd-char-driver/aesd-lockfree-ring.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <syslog.h>
+#include <stdatomic.h>
+
+/***********************
+ * Constants
+ ***********************/
+
+// longer messages are truncated:
+#define LOGGER_MESSAGE_SIZE 248
+// pending messages per thread: 2^LOGGER_RING_SIZE_LOG2
+#define LOGGER_RING_SIZE_LOG2 6
+#define LOGGER_NS_PER_MESSAGE (1000000000ull / LOGGER_RATE)
+
+/***********************
+ * Types
+ ***********************/
+
+typedef struct {
+	int priority;
+	char message[LOGGER_MESSAGE_SIZE];
+} logger_message_t;
+
+AESD_SPSC_RING_DECLARE(logger_message_ring, logger_message_t, LOGGER_RING_SIZE_LOG2)
+
+typedef struct logger_ring {
+	// (first, the rings are handed out by ring_pool)
+	thread_ring_t thread_ring;
+	// producer: the owning thread, consumer: the flusher thread
+	struct logger_message_ring messages;
+	// rate limit, earliest time the next message would be allowed
+	// without using up the burst (only used by the owning thread):
+	uint64_t next_allowed_ns;
+	// messages dropped since the flusher reported last:
+	_Atomic unsigned long dropped;
+} logger_ring_t;
+
+/***********************
+ * Global Data
+ ***********************/
+
+static _Atomic bool running = false;
+
+static pthread_t flusher_thread_fd;
+static sem_t flusher_sem;
+// the flusher has been signaled and did not start draining yet:
+static _Atomic bool flusher_signaled = false;
+
+static thread_ring_pool_t ring_pool;
+
+/***********************
+ * Function Declarations
+ ***********************/
+
+static void logger_init_ring(thread_ring_t* thread_ring);
+static bool logger_rate_limit(logger_ring_t* ring);
+static void logger_signal_flusher(void);
+static void* logger_flusher_thread(void* void_arg);
+static void logger_flush(void);
+
+/***********************
+ * Function Definitions
+ ***********************/
+
+bool logger_start(void)
+{
+	if( sem_init( &flusher_sem, 0, 0 ) ) {
+		perror( "sem_init" );
+		return false;
+	}
+	if( !thread_ring_pool_init( &ring_pool, sizeof(logger_ring_t), logger_init_ring, NULL ) ) {
+		sem_destroy( &flusher_sem );
+		return false;
+	}
+	atomic_store( &running, true );
+	{
+		int ret = pthread_create(
+				&flusher_thread_fd,
+				0,
+				logger_flusher_thread,
+				NULL
+		);
+		if( ret != 0 ) {
+			atomic_store( &running, false );
+			OUTPUT_ERR( "pthread_create: %d - %s\n", ret, strerror(ret) );
+			thread_ring_pool_destroy( &ring_pool );
+			sem_destroy( &flusher_sem );
+			return false;
+		}
+	}
+	return true;
+}
+
+void logger_stop(void)
+{
+	if( !atomic_exchange( &running, false ) ) {
+		return;
+	}
+	sem_post( &flusher_sem );
+	if( pthread_join( flusher_thread_fd, NULL ) ) {
+		perror( "pthread_join" );
+	}
+	sem_destroy( &flusher_sem );
+}
+
+void logger_log(int priority, const char* fmt, ...)
+{
+	va_list args;
+	va_start( args, fmt );
+	if( !atomic_load_explicit( &running, memory_order_acquire ) ) {
+		vsyslog( priority, fmt, args );
+		goto end;
+	}
+	logger_ring_t* ring = (logger_ring_t* )thread_ring_get( &ring_pool );
+	if( ring == NULL ) {
+		vsyslog( priority, fmt, args );
+		goto end;
+	}
+	if( !logger_rate_limit( ring ) ) {
+		atomic_fetch_add_explicit( &ring->dropped, 1, memory_order_relaxed );
+		goto end;
+	}
+	logger_message_t message = { .priority = priority };
+	vsnprintf( message.message, LOGGER_MESSAGE_SIZE, fmt, args );
+	if( !logger_message_ring_push( &ring->messages, &message ) ) {
+		atomic_fetch_add_explicit( &ring->dropped, 1, memory_order_relaxed );
+		goto end;
+	}
+	logger_signal_flusher();
+end:
+	va_end( args );
+}
+
+// called for the first message of a thread, unless it inherits a ring:
+static void logger_init_ring(thread_ring_t* thread_ring)
+{
+	logger_ring_t* ring = (logger_ring_t* )thread_ring;
+	logger_message_ring_init( &ring->messages );
+	ring->next_allowed_ns = 0;
+	atomic_init( &ring->dropped, 0 );
+}
+
+// generic cell rate algorithm, false if the message has to be dropped:
+static bool logger_rate_limit(logger_ring_t* ring)
+{
+	struct timespec now_ts;
+	clock_gettime( CLOCK_MONOTONIC_COARSE, &now_ts );
+	uint64_t now = (uint64_t )now_ts.tv_sec * 1000000000ull + now_ts.tv_nsec;
+	if( ring->next_allowed_ns < now ) {
+		ring->next_allowed_ns = now;
+	}
+	if( ring->next_allowed_ns - now > (LOGGER_BURST - 1) * LOGGER_NS_PER_MESSAGE ) {
+		return false;
+	}
+	ring->next_allowed_ns += LOGGER_NS_PER_MESSAGE;
+	return true;
+}
+
+static void logger_signal_flusher(void)
+{
+	// at most one sem_post per drain of the flusher:
+	if( !atomic_exchange_explicit( &flusher_signaled, true, memory_order_acq_rel ) ) {
+		sem_post( &flusher_sem );
+	}
+}
+
+static void* logger_flusher_thread(void* void_arg)
+{
+	(void )void_arg;
+	while( true ) {
+		if( sem_wait( &flusher_sem ) ) {
+			if( errno == EINTR ) {
+				continue;
+			}
+			perror( "sem_wait" );
+			break;
+		}
+		bool stop = !atomic_load( &running );
+		// messages pushed from now on signal again:
+		atomic_exchange_explicit( &flusher_signaled, false, memory_order_acq_rel );
+		logger_flush();
+		if( stop ) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+static void logger_flush(void)
+{
+	for(
+			thread_ring_t* thread_ring = thread_ring_first( &ring_pool );
+			thread_ring != NULL;
+			thread_ring = thread_ring->next
+	) {
+		logger_ring_t* ring = (logger_ring_t* )thread_ring;
+		logger_message_t message;
+		while( logger_message_ring_pop( &ring->messages, &message ) ) {
+			syslog( message.priority, "%s", message.message );
+		}
+		unsigned long dropped = atomic_exchange_explicit( &ring->dropped, 0, memory_order_relaxed );
+		if( dropped != 0 ) {
+			syslog( LOG_WARNING, "%lu log messages dropped\n", dropped );
+		}
+	}
+}
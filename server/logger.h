@@ -0,0 +1,29 @@
+#pragma once
+
+/*
+ * Asynchronous logging for OUTPUT_ERR and OUTPUT_INFO.
+ *
+ * Every thread formats its messages into a ring buffer of its own
+ * (single producer, single consumer, no locks), a background thread
+ * drains all rings and passes the messages to syslog.
+ * Logging threads never wait for /dev/log: if a ring is full,
+ * or a thread logs faster than LOGGER_RATE messages per second,
+ * messages are dropped and the number of dropped messages is logged instead.
+ * Before logger_start and after logger_stop messages go to syslog directly.
+ */
+
+#include <stdbool.h>
+
+// messages per second and thread (sustained):
+#define LOGGER_RATE 200
+// messages in a row per thread, before the rate limit applies:
+#define LOGGER_BURST 64
+
+// start the flusher thread, false on error:
+bool logger_start(void);
+// flush all pending messages and stop the flusher thread:
+void logger_stop(void);
+
+// like syslog, never blocks while the logger is running:
+void logger_log(int priority, const char* fmt, ...)
+	__attribute__(( format( printf, 2, 3 ) ));
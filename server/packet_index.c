@@ -0,0 +1,185 @@
+#include "packet_index.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/***********************
+ * Constants
+ ***********************/
+
+#define PACKET_INDEX_INITIAL_CAPACITY 1024
+
+/***********************
+ * Types
+ ***********************/
+
+typedef struct {
+	// start offset, counted since the last reset:
+	uint64_t offset;
+	uint64_t position;
+} packet_index_entry_t;
+
+struct packet_index {
+	bool enabled;
+	// record number of packet 0:
+	uint64_t first_record;
+	// packet n is entries[head + n]:
+	packet_index_entry_t* entries;
+	size_t head;
+	size_t count;
+	size_t capacity;
+	// end of the last packet:
+	uint64_t end;
+};
+
+/***********************
+ * Function Definitions
+ ***********************/
+
+packet_index_t* packet_index_create(void)
+{
+	packet_index_t* index = malloc( sizeof(packet_index_t) );
+	if( index == NULL ) {
+		perror( "malloc" );
+		return NULL;
+	}
+	(*index) = (packet_index_t ){
+		// disabled until the first reset:
+		.enabled = false,
+	};
+	return index;
+}
+
+void packet_index_destroy(packet_index_t* index)
+{
+	FREE( index->entries );
+	FREE( index );
+}
+
+void packet_index_reset(
+		packet_index_t* index,
+		uint64_t record_number
+)
+{
+	index->enabled = true;
+	index->first_record = record_number;
+	index->head = 0;
+	index->count = 0;
+	index->end = 0;
+}
+
+void packet_index_append(
+		packet_index_t* index,
+		size_t size,
+		uint64_t position
+)
+{
+	if( !index->enabled ) {
+		return;
+	}
+	if( index->head + index->count == index->capacity ) {
+		if( index->head > 0 && index->head >= index->capacity / 2 ) {
+			// reuse the space of dropped packets:
+			memmove( index->entries, &index->entries[index->head], index->count * sizeof(packet_index_entry_t) );
+			index->head = 0;
+		}
+		else {
+			size_t capacity = index->capacity ? 2 * index->capacity : PACKET_INDEX_INITIAL_CAPACITY;
+			packet_index_entry_t* entries = realloc( index->entries, capacity * sizeof(packet_index_entry_t) );
+			if( entries == NULL ) {
+				perror( "realloc" );
+				OUTPUT_ERR( "ERROR: packet index disabled\n" );
+				index->enabled = false;
+				return;
+			}
+			index->entries = entries;
+			index->capacity = capacity;
+		}
+	}
+	index->entries[index->head + index->count] = (packet_index_entry_t ){
+		.offset = index->end,
+		.position = position,
+	};
+	index->count++;
+	index->end += size;
+}
+
+void packet_index_drop(
+		packet_index_t* index,
+		uint64_t record_number
+)
+{
+	if( record_number <= index->first_record ) {
+		return;
+	}
+	uint64_t dropped = record_number - index->first_record;
+	if( dropped > index->count ) {
+		dropped = index->count;
+	}
+	index->head += dropped;
+	index->count -= dropped;
+	index->first_record += dropped;
+}
+
+bool packet_index_enabled(packet_index_t* index)
+{
+	return index->enabled;
+}
+
+uint64_t packet_index_first_record(packet_index_t* index)
+{
+	return index->first_record;
+}
+
+uint64_t packet_index_count(packet_index_t* index)
+{
+	return index->count;
+}
+
+uint64_t packet_index_size(packet_index_t* index)
+{
+	return packet_index_offset( index, index->count );
+}
+
+uint64_t packet_index_offset(
+		packet_index_t* index,
+		uint64_t n
+)
+{
+	uint64_t start = index->count ? index->entries[index->head].offset : index->end;
+	if( n >= index->count ) {
+		return index->end - start;
+	}
+	return index->entries[index->head + n].offset - start;
+}
+
+uint64_t packet_index_position(
+		packet_index_t* index,
+		uint64_t n
+)
+{
+	return index->entries[index->head + n].position;
+}
+
+uint64_t packet_index_find(
+		packet_index_t* index,
+		uint64_t offset
+)
+{
+	if( offset >= packet_index_size( index ) ) {
+		return index->count;
+	}
+	// binary search for the last packet starting at or before offset:
+	uint64_t low = 0;
+	uint64_t high = index->count;
+	while( high - low > 1 ) {
+		uint64_t middle = low + (high - low) / 2;
+		if( packet_index_offset( index, middle ) <= offset ) {
+			low = middle;
+		}
+		else {
+			high = middle;
+		}
+	}
+	return low;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+/*
+ * Byte offsets of the packets in the history of the file backend.
+ *
+ * Packet n is the n-th packet still in the history, byte offsets count
+ * from the start of the history. Along with its byte offset, the index
+ * keeps where a packet is stored, so it is read without a scan. Packets dropped by the retention policy
+ * of the write ahead log are dropped from the index, too.
+ * Not thread safe, only used with output_file_mutex held.
+ */
+
+#include "server_impl.h"
+
+#include <stdint.h>
+
+typedef struct packet_index packet_index_t;
+
+packet_index_t* packet_index_create(void);
+void packet_index_destroy(packet_index_t* index);
+
+// start over with an empty history, record_number is the number of the next packet:
+void packet_index_reset(
+		packet_index_t* index,
+		uint64_t record_number
+);
+// the index disables itself if it can't grow, until the next reset,
+// position: the file offset of the log record (durable mode) or of the packet:
+void packet_index_append(
+		packet_index_t* index,
+		size_t size,
+		uint64_t position
+);
+// drop the packets before record_number:
+void packet_index_drop(
+		packet_index_t* index,
+		uint64_t record_number
+);
+bool packet_index_enabled(packet_index_t* index);
+// record number of packet 0:
+uint64_t packet_index_first_record(packet_index_t* index);
+// packets in the history:
+uint64_t packet_index_count(packet_index_t* index);
+// bytes in the history:
+uint64_t packet_index_size(packet_index_t* index);
+// byte offset of packet n, the size of the history for n == count:
+uint64_t packet_index_offset(
+		packet_index_t* index,
+		uint64_t n
+);
+// position passed to packet_index_append for packet n < count:
+uint64_t packet_index_position(
+		packet_index_t* index,
+		uint64_t n
+);
+// the packet holding byte offset, count if offset is not in the history:
+uint64_t packet_index_find(
+		packet_index_t* index,
+		uint64_t offset
+);
@@ -0,0 +1,425 @@
+#include "replay_cache.h"
+#include "socket_io.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+/***********************
+ * Constants
+ ***********************/
+
+#define REPLAY_SEGMENT_SIZE (64*1024)
+// released snapshots kept for reuse:
+#define REPLAY_SNAPSHOT_SPARES 8
+
+/***********************
+ * Types
+ ***********************/
+
+typedef struct {
+	// the cache and every snapshot referencing the segment hold a reference:
+	_Atomic unsigned int refs;
+	char data[REPLAY_SEGMENT_SIZE];
+} replay_segment_t;
+
+struct replay_snapshot {
+	_Atomic unsigned int refs;
+	// released to the spares of cache:
+	replay_cache_t* cache;
+	// offset of the history in the first segment:
+	size_t head;
+	size_t size;
+	unsigned int segment_count;
+	unsigned int segment_capacity;
+	// all segments but the first and the last one are full:
+	replay_segment_t* segments[];
+};
+
+struct replay_cache {
+	// protects everything below:
+	pthread_mutex_t mutex;
+	size_t max_size;
+	uint64_t origin;
+	// false if max_size was exceeded:
+	bool enabled;
+	// offset of the history in the first segment:
+	size_t head;
+	size_t size;
+	unsigned int segment_count;
+	unsigned int segment_capacity;
+	replay_segment_t** segments;
+	// the latest snapshot, NULL if data was appended since:
+	replay_snapshot_t* snapshot;
+	// released snapshots, a new snapshot per append does not allocate:
+	_Atomic(replay_snapshot_t*) spares[REPLAY_SNAPSHOT_SPARES];
+};
+
+/***********************
+ * Function Declarations
+ ***********************/
+
+static void replay_segment_put(replay_segment_t* segment);
+static void replay_cache_clear(replay_cache_t* cache);
+static void replay_cache_append_locked(
+		replay_cache_t* cache,
+		const char* data,
+		size_t size
+);
+static replay_snapshot_t* replay_snapshot_alloc(replay_cache_t* cache);
+
+/***********************
+ * Function Definitions
+ ***********************/
+
+replay_cache_t* replay_cache_create(size_t max_size)
+{
+	replay_cache_t* cache = malloc( sizeof(replay_cache_t) );
+	if( cache == NULL ) {
+		perror( "malloc" );
+		return NULL;
+	}
+	(*cache) = (replay_cache_t ){
+		.max_size = max_size,
+		// disabled until the first reset:
+		.origin = UINT64_MAX,
+		.enabled = false,
+	};
+	for( unsigned int i=0; i<REPLAY_SNAPSHOT_SPARES; i++ ) {
+		atomic_init( &cache->spares[i], NULL );
+	}
+	pthread_mutex_init( &cache->mutex, NULL );
+	return cache;
+}
+
+void replay_cache_destroy(replay_cache_t* cache)
+{
+	replay_cache_clear( cache );
+	for( unsigned int i=0; i<REPLAY_SNAPSHOT_SPARES; i++ ) {
+		free( atomic_load_explicit( &cache->spares[i], memory_order_relaxed ) );
+	}
+	pthread_mutex_destroy( &cache->mutex );
+	FREE( cache );
+}
+
+void replay_cache_reset(
+		replay_cache_t* cache,
+		uint64_t origin
+)
+{
+	pthread_mutex_lock( &cache->mutex );
+	replay_cache_clear( cache );
+	cache->origin = origin;
+	cache->enabled = true;
+	pthread_mutex_unlock( &cache->mutex );
+}
+
+void replay_cache_disable(replay_cache_t* cache)
+{
+	pthread_mutex_lock( &cache->mutex );
+	replay_cache_clear( cache );
+	cache->enabled = false;
+	pthread_mutex_unlock( &cache->mutex );
+}
+
+void replay_cache_drop(
+		replay_cache_t* cache,
+		uint64_t origin,
+		size_t size
+)
+{
+	pthread_mutex_lock( &cache->mutex );
+	if( !cache->enabled ) {
+		goto end;
+	}
+	if( size > cache->size ) {
+		size = cache->size;
+	}
+	// the current snapshot stays valid for its holders, but is outdated:
+	if( cache->snapshot != NULL ) {
+		replay_snapshot_put( cache->snapshot );
+		cache->snapshot = NULL;
+	}
+	cache->origin = origin;
+	cache->head += size;
+	cache->size -= size;
+	// release the segments holding dropped bytes only:
+	unsigned int dropped = cache->head / REPLAY_SEGMENT_SIZE;
+	for( unsigned int i=0; i<dropped; i++ ) {
+		replay_segment_put( cache->segments[i] );
+	}
+	memmove( cache->segments, &cache->segments[dropped], (cache->segment_count - dropped) * sizeof(replay_segment_t*) );
+	cache->segment_count -= dropped;
+	cache->head -= (size_t )dropped * REPLAY_SEGMENT_SIZE;
+end:
+	pthread_mutex_unlock( &cache->mutex );
+}
+
+bool replay_cache_enabled(replay_cache_t* cache)
+{
+	pthread_mutex_lock( &cache->mutex );
+	bool enabled = cache->enabled;
+	pthread_mutex_unlock( &cache->mutex );
+	return enabled;
+}
+
+uint64_t replay_cache_origin(replay_cache_t* cache)
+{
+	pthread_mutex_lock( &cache->mutex );
+	uint64_t origin = cache->origin;
+	pthread_mutex_unlock( &cache->mutex );
+	return origin;
+}
+
+void replay_cache_append(
+		replay_cache_t* cache,
+		const char* data,
+		size_t size
+)
+{
+	pthread_mutex_lock( &cache->mutex );
+	replay_cache_append_locked( cache, data, size );
+	pthread_mutex_unlock( &cache->mutex );
+}
+
+void replay_cache_prepend(
+		replay_cache_t* cache,
+		replay_cache_t* prefix,
+		uint64_t origin
+)
+{
+	pthread_mutex_lock( &cache->mutex );
+	pthread_mutex_lock( &prefix->mutex );
+	if( !cache->enabled || !prefix->enabled ) {
+		goto end;
+	}
+	// the cached history follows the prefix:
+	for( size_t offset=cache->head; offset<cache->head + cache->size; ) {
+		size_t segment_offset = offset % REPLAY_SEGMENT_SIZE;
+		size_t length = REPLAY_SEGMENT_SIZE - segment_offset;
+		if( length > cache->head + cache->size - offset ) {
+			length = cache->head + cache->size - offset;
+		}
+		replay_cache_append_locked( prefix, &cache->segments[offset / REPLAY_SEGMENT_SIZE]->data[segment_offset], length );
+		offset += length;
+	}
+	if( !prefix->enabled ) {
+		goto end;
+	}
+	// take over the segments of prefix:
+	replay_cache_clear( cache );
+	cache->origin = origin;
+	cache->head = prefix->head;
+	cache->size = prefix->size;
+	cache->segment_count = prefix->segment_count;
+	cache->segment_capacity = prefix->segment_capacity;
+	cache->segments = prefix->segments;
+	prefix->head = 0;
+	prefix->size = 0;
+	prefix->segment_count = 0;
+	prefix->segment_capacity = 0;
+	prefix->segments = NULL;
+end:
+	pthread_mutex_unlock( &prefix->mutex );
+	pthread_mutex_unlock( &cache->mutex );
+}
+
+replay_snapshot_t* replay_cache_snapshot(replay_cache_t* cache)
+{
+	replay_snapshot_t* snapshot = NULL;
+	pthread_mutex_lock( &cache->mutex );
+	if( !cache->enabled ) {
+		goto end;
+	}
+	if( cache->snapshot == NULL ) {
+		replay_snapshot_t* new_snapshot = replay_snapshot_alloc( cache );
+		if( new_snapshot == NULL ) {
+			goto end;
+		}
+		// one reference held by the cache:
+		atomic_init( &new_snapshot->refs, 1 );
+		new_snapshot->head = cache->head;
+		new_snapshot->size = cache->size;
+		new_snapshot->segment_count = cache->segment_count;
+		for( unsigned int i=0; i<cache->segment_count; i++ ) {
+			atomic_fetch_add_explicit( &cache->segments[i]->refs, 1, memory_order_relaxed );
+			new_snapshot->segments[i] = cache->segments[i];
+		}
+		cache->snapshot = new_snapshot;
+	}
+	snapshot = cache->snapshot;
+	atomic_fetch_add_explicit( &snapshot->refs, 1, memory_order_relaxed );
+end:
+	pthread_mutex_unlock( &cache->mutex );
+	return snapshot;
+}
+
+void replay_snapshot_put(replay_snapshot_t* snapshot)
+{
+	if( 1 != atomic_fetch_sub_explicit( &snapshot->refs, 1, memory_order_acq_rel ) ) {
+		return;
+	}
+	for( unsigned int i=0; i<snapshot->segment_count; i++ ) {
+		replay_segment_put( snapshot->segments[i] );
+	}
+	for( unsigned int i=0; i<REPLAY_SNAPSHOT_SPARES; i++ ) {
+		replay_snapshot_t* expected = NULL;
+		if( atomic_compare_exchange_strong_explicit(
+				&snapshot->cache->spares[i], &expected, snapshot,
+				memory_order_release, memory_order_relaxed
+		) ) {
+			return;
+		}
+	}
+	free( snapshot );
+}
+
+size_t replay_snapshot_size(replay_snapshot_t* snapshot)
+{
+	return snapshot->size;
+}
+
+ret_t replay_snapshot_write(
+		replay_snapshot_t* snapshot,
+		socket_output_t* output
+)
+{
+	return replay_snapshot_write_range( snapshot, output, 0, snapshot->size );
+}
+
+ret_t replay_snapshot_write_range(
+		replay_snapshot_t* snapshot,
+		socket_output_t* output,
+		size_t offset,
+		size_t size
+)
+{
+	offset += snapshot->head;
+	unsigned int i = offset / REPLAY_SEGMENT_SIZE;
+	size_t segment_offset = offset % REPLAY_SEGMENT_SIZE;
+	while( size > 0 ) {
+		size_t length = REPLAY_SEGMENT_SIZE - segment_offset;
+		if( length > size ) {
+			length = size;
+		}
+		if( RET_OK != socket_output_write( output, &snapshot->segments[i]->data[segment_offset], length ) ) {
+			return RET_ERR;
+		}
+		size -= length;
+		segment_offset = 0;
+		i++;
+	}
+	return RET_OK;
+}
+
+static void replay_segment_put(replay_segment_t* segment)
+{
+	if( 1 == atomic_fetch_sub_explicit( &segment->refs, 1, memory_order_acq_rel ) ) {
+		free( segment );
+	}
+}
+
+// must be called with cache->mutex held:
+static void replay_cache_clear(replay_cache_t* cache)
+{
+	if( cache->snapshot != NULL ) {
+		replay_snapshot_put( cache->snapshot );
+		cache->snapshot = NULL;
+	}
+	for( unsigned int i=0; i<cache->segment_count; i++ ) {
+		replay_segment_put( cache->segments[i] );
+	}
+	FREE( cache->segments );
+	cache->segment_count = 0;
+	cache->segment_capacity = 0;
+	cache->head = 0;
+	cache->size = 0;
+}
+
+// a released snapshot if one is large enough, must be called with cache->mutex held:
+static replay_snapshot_t* replay_snapshot_alloc(replay_cache_t* cache)
+{
+	for( unsigned int i=0; i<REPLAY_SNAPSHOT_SPARES; i++ ) {
+		replay_snapshot_t* snapshot = atomic_exchange_explicit(
+				&cache->spares[i], NULL, memory_order_acquire
+		);
+		if( snapshot == NULL ) {
+			continue;
+		}
+		if( snapshot->segment_capacity >= cache->segment_count ) {
+			return snapshot;
+		}
+		free( snapshot );
+	}
+	// room for the segments appended until the segment array grows again:
+	unsigned int capacity = cache->segment_capacity;
+	replay_snapshot_t* snapshot = malloc(
+			sizeof(replay_snapshot_t) + capacity * sizeof(replay_segment_t*)
+	);
+	if( snapshot == NULL ) {
+		perror( "malloc" );
+		return NULL;
+	}
+	snapshot->cache = cache;
+	snapshot->segment_capacity = capacity;
+	return snapshot;
+}
+
+// must be called with cache->mutex held:
+static void replay_cache_append_locked(
+		replay_cache_t* cache,
+		const char* data,
+		size_t size
+)
+{
+	if( !cache->enabled ) {
+		return;
+	}
+	if( cache->size + size > cache->max_size ) {
+		OUTPUT_INFO( "history exceeds %zu bytes, replay cache disabled\n", cache->max_size );
+		goto disable;
+	}
+	// the current snapshot stays valid for its holders, but is outdated:
+	if( cache->snapshot != NULL ) {
+		replay_snapshot_put( cache->snapshot );
+		cache->snapshot = NULL;
+	}
+	while( size > 0 ) {
+		size_t segment_offset = (cache->head + cache->size) % REPLAY_SEGMENT_SIZE;
+		if( segment_offset == 0 ) {
+			// new segment:
+			if( cache->segment_count == cache->segment_capacity ) {
+				unsigned int capacity = cache->segment_capacity ? 2 * cache->segment_capacity : 16;
+				replay_segment_t** segments = realloc( cache->segments, capacity * sizeof(replay_segment_t*) );
+				if( segments == NULL ) {
+					perror( "realloc" );
+					goto disable;
+				}
+				cache->segments = segments;
+				cache->segment_capacity = capacity;
+			}
+			replay_segment_t* segment = malloc( sizeof(replay_segment_t) );
+			if( segment == NULL ) {
+				perror( "malloc" );
+				goto disable;
+			}
+			atomic_init( &segment->refs, 1 );
+			cache->segments[cache->segment_count++] = segment;
+		}
+		// bytes behind the end of the history are not visible to any snapshot:
+		replay_segment_t* segment = cache->segments[cache->segment_count-1];
+		size_t length = REPLAY_SEGMENT_SIZE - segment_offset;
+		if( length > size ) {
+			length = size;
+		}
+		memcpy( &segment->data[segment_offset], data, length );
+		cache->size += length;
+		data += length;
+		size -= length;
+	}
+	return;
+
+disable:
+	replay_cache_clear( cache );
+	cache->enabled = false;
+}
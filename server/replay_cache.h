@@ -0,0 +1,69 @@
+#pragma once
+
+/*
+ * In memory copy of the history of the file backend, shared by all clients.
+ *
+ * The history is stored in fixed size, append only segments.
+ * A snapshot references the segments holding the history at the time it
+ * was taken, appending never modifies bytes a snapshot can see,
+ * so many clients can send the same snapshot concurrently without locks.
+ * Snapshots are only rebuilt after new data was appended.
+ * Dropping the oldest bytes only releases the segments holding nothing else.
+ */
+
+#include "server_impl.h"
+
+#include <stdint.h>
+
+typedef struct replay_cache replay_cache_t;
+typedef struct replay_snapshot replay_snapshot_t;
+
+// the cache disables itself once the history exceeds max_size:
+replay_cache_t* replay_cache_create(size_t max_size);
+// all snapshots must have been put:
+void replay_cache_destroy(replay_cache_t* cache);
+
+// drop the cached history, start over with an empty history described by origin:
+void replay_cache_reset(
+		replay_cache_t* cache,
+		uint64_t origin
+);
+// drop the cached history until the next reset:
+void replay_cache_disable(replay_cache_t* cache);
+// drop the oldest size bytes, the rest of the history is described by origin:
+void replay_cache_drop(
+		replay_cache_t* cache,
+		uint64_t origin,
+		size_t size
+);
+bool replay_cache_enabled(replay_cache_t* cache);
+// the origin passed to the last reset or drop:
+uint64_t replay_cache_origin(replay_cache_t* cache);
+void replay_cache_append(
+		replay_cache_t* cache,
+		const char* data,
+		size_t size
+);
+// put the history of prefix before the cached one, origin describes the start of prefix,
+// prefix ends up empty, nothing changes if either is disabled or both exceed max_size:
+void replay_cache_prepend(
+		replay_cache_t* cache,
+		replay_cache_t* prefix,
+		uint64_t origin
+);
+// NULL if the cache is disabled:
+replay_snapshot_t* replay_cache_snapshot(replay_cache_t* cache);
+
+void replay_snapshot_put(replay_snapshot_t* snapshot);
+size_t replay_snapshot_size(replay_snapshot_t* snapshot);
+ret_t replay_snapshot_write(
+		replay_snapshot_t* snapshot,
+		socket_output_t* output
+);
+// size bytes from offset on, must be within the snapshot:
+ret_t replay_snapshot_write_range(
+		replay_snapshot_t* snapshot,
+		socket_output_t* output,
+		size_t offset,
+		size_t size
+);
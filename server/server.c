@@ -1,4 +1,6 @@
 #include "server_impl.h"
+#include "affinity.h"
+#include "trace.h"
 
 
 #include <syslog.h>
@@ -22,13 +24,37 @@
 #include <arpa/inet.h>
 
 
-const char short_options[] = "hd";
+const char short_options[] = "hdDs:g:i:B:P:A:c:p:tT:";
 const  struct option long_options[] = {
 	{ "help", no_argument, 0, 'h' },
 	{ "demonize", no_argument, 0, 'd' },
+	{ "durable", no_argument, 0, 'D' },
+	{ "fsync", required_argument, 0, 's' },
+	{ "fsync-group", required_argument, 0, 'g' },
+	{ "fsync-interval", required_argument, 0, 'i' },
+	{ "retain-bytes", required_argument, 0, 'B' },
+	{ "retain-packets", required_argument, 0, 'P' },
+	{ "retain-age", required_argument, 0, 'A' },
+	{ "cpus", required_argument, 0, 'c' },
+	{ "placement", required_argument, 0, 'p' },
+	{ "takeover", no_argument, 0, 't' },
+	{ "trace", required_argument, 0, 'T' },
 	{ 0,0,0,0 },
 };
 
+const char* sync_policy_names[] = {
+	[WAL_SYNC_PACKET] = "packet",
+	[WAL_SYNC_GROUP] = "group",
+	[WAL_SYNC_INTERVAL] = "interval",
+};
+
+const char* placement_names[] = {
+	[PLACEMENT_NONE] = "none",
+	[PLACEMENT_SPREAD] = "spread",
+	[PLACEMENT_INCOMING] = "incoming",
+	[PLACEMENT_NODE] = "node",
+};
+
 void log_init(void);
 void log_exit(void);
 
@@ -40,9 +66,13 @@ int parse_cmd_line_args(
 		char* argv[],
 		args_t* args
 );
+unsigned long long parse_positive(
+		const char* arg
+);
 
 
 void int_handler(int sig);
+void usr1_handler(int sig);
 
 static data_t data;
 
@@ -53,6 +83,21 @@ int main(int argc, char* argv[])
 	server_zero_data(&data);
 	args_t args = {
 		.demonize = false,
+		.durable = false,
+		.wal_config = {
+			.sync_policy = WAL_SYNC_PACKET,
+			.group_size = 32,
+			.interval_ms = 1000,
+			.retain_bytes = 0,
+			.retain_packets = 0,
+			.retain_seconds = 0,
+		},
+		.affinity_config = {
+			.placement = PLACEMENT_NONE,
+			.cpus = NULL,
+		},
+		.takeover = false,
+		.trace_filename = NULL,
 	};
 	// parse cmd line args:
 	{
@@ -74,7 +119,26 @@ int main(int argc, char* argv[])
 	OUTPUT_INFO("-----------------------\n");
 	OUTPUT_INFO("OPTIONS:\n");
 	OUTPUT_INFO("demonize: %d\n", args.demonize);
+	OUTPUT_INFO("takeover: %d\n", args.takeover);
+	OUTPUT_INFO("durable: %d\n", args.durable);
+	if( args.durable ) {
+		OUTPUT_INFO("fsync: %s\n", sync_policy_names[args.wal_config.sync_policy]);
+		OUTPUT_INFO("fsync-group: %u\n", args.wal_config.group_size);
+		OUTPUT_INFO("fsync-interval: %ums\n", args.wal_config.interval_ms);
+		OUTPUT_INFO("retain-bytes: %llu\n", args.wal_config.retain_bytes);
+		OUTPUT_INFO("retain-packets: %llu\n", args.wal_config.retain_packets);
+		OUTPUT_INFO("retain-age: %llus\n", args.wal_config.retain_seconds);
+	}
+	OUTPUT_INFO("placement: %s\n", placement_names[args.affinity_config.placement]);
+	if( args.affinity_config.placement != PLACEMENT_NONE ) {
+		OUTPUT_INFO("cpus: %s\n", args.affinity_config.cpus ? args.affinity_config.cpus : "all");
+	}
+	OUTPUT_INFO("trace: %s\n", args.trace_filename ? args.trace_filename : "off");
 	OUTPUT_INFO("-----------------------\n");
+	data.durable = args.durable;
+	data.wal_config = args.wal_config;
+	data.affinity_config = args.affinity_config;
+	data.takeover = args.takeover;
 	if( args.demonize ) {
 		int child_pid = fork();
 		if( child_pid != 0 ) {
@@ -84,8 +148,22 @@ int main(int argc, char* argv[])
 	}
 	signal(SIGINT, int_handler);
 	signal(SIGTERM, int_handler);
+	// trace dump on demand (ignored without --trace):
+	signal(SIGUSR1, usr1_handler);
+	// (threads do not survive the fork)
+	if( !logger_start() ) {
+		log_exit();
+		return EXIT_FAILURE;
+	}
+	if( args.trace_filename != NULL ) {
+		if( !trace_start( args.trace_filename ) ) {
+			log_exit();
+			return EXIT_FAILURE;
+		}
+	}
 	if( RET_OK != server_init(&data) ) {
 		server_exit(&data);
+		log_exit();
 		return EXIT_FAILURE;
 	}
 	if( RET_OK != server_run(&data) ) {
@@ -97,6 +175,7 @@ int main(int argc, char* argv[])
 		log_exit();
 		return EXIT_FAILURE;
 	}
+	log_exit();
 	return EXIT_SUCCESS;
 }
 
@@ -105,6 +184,13 @@ void int_handler(int sig)
 	server_stop(&data);
 }
 
+void usr1_handler(int sig)
+{
+	(void )sig;
+	trace_request_dump();
+	server_request_stats();
+}
+
 void log_init(void)
 {
 	openlog( "server", 0, LOG_USER );
@@ -112,6 +198,9 @@ void log_init(void)
 
 void log_exit(void)
 {
+	// (the final dump may still log)
+	trace_stop();
+	logger_stop();
 	closelog();
 }
 
@@ -130,6 +219,69 @@ void print_cmd_line_info(
 			"%-16s: run in background as a demon process\n",
 			"--demonize|-d"
 	);
+	printf(
+			"%-16s: take over the socket and history of the running server, which exits once its connections are done\n",
+			"--takeover|-t"
+	);
+	printf(
+			"%-16s: keep the history across restarts in a write ahead log\n",
+			"--durable|-D"
+	);
+	printf(
+			"%-16s: durable mode: flush the log per 'packet' (default), per 'group' or at an 'interval'\n",
+			"--fsync|-s"
+	);
+	printf(
+			"%-16s: packets per flush with --fsync=group (default: 32)\n",
+			"--fsync-group|-g"
+	);
+	printf(
+			"%-16s: milliseconds between flushes with --fsync=interval (default: 1000)\n",
+			"--fsync-interval|-i"
+	);
+	printf(
+			"%-16s: durable mode: drop the oldest packets beyond this many bytes\n",
+			"--retain-bytes|-B"
+	);
+	printf(
+			"%-16s: durable mode: drop the oldest packets beyond this many packets\n",
+			"--retain-packets|-P"
+	);
+	printf(
+			"%-16s: durable mode: drop packets older than this many seconds\n",
+			"--retain-age|-A"
+	);
+	printf(
+			"%-16s: cpus for the server threads, like '0-3,8' (default: all, implies --placement=spread)\n",
+			"--cpus|-c"
+	);
+	printf(
+			"%-16s: pin each client thread to a cpu round robin ('spread'), to the cpu receiving the connection ('incoming') or to the NUMA node of that cpu ('node'), or not at all ('none', default)\n",
+			"--placement|-p"
+	);
+	printf(
+			"%-16s: record the phases of each request, dump them as Chrome trace JSON to this file on SIGUSR1 and on exit\n",
+			"--trace|-T"
+	);
+}
+
+/**
+ * @return the value of a positive integer option, 0 if invalid
+ */
+unsigned long long parse_positive(
+		const char* arg
+)
+{
+	char* endptr = NULL;
+	if( arg[0] == '-' ) {
+		return 0;
+	}
+	errno = 0;
+	unsigned long long value = strtoull( arg, &endptr, 10 );
+	if( endptr == arg || *endptr != '\0' || errno != 0 ) {
+		return 0;
+	}
+	return value;
 }
 
 int parse_cmd_line_args(
@@ -138,6 +290,7 @@ int parse_cmd_line_args(
 		args_t* args
 )
 {
+	bool placement_set = false;
 	// parse options:
 	while( true ) {
 		int option_index = 0;
@@ -155,9 +308,102 @@ int parse_cmd_line_args(
 			case 'd':
 				args->demonize = true;
 			break;
+			case 'D':
+				args->durable = true;
+			break;
+			case 't':
+				args->takeover = true;
+			break;
+			case 'T':
+				args->trace_filename = optarg;
+			break;
+			case 's':
+			{
+				bool found = false;
+				for( unsigned int i=0; i<sizeof(sync_policy_names)/sizeof(sync_policy_names[0]); i++ ) {
+					if( !strcmp( optarg, sync_policy_names[i] ) ) {
+						args->wal_config.sync_policy = i;
+						found = true;
+					}
+				}
+				if( !found ) {
+					fprintf( stderr, "invalid fsync policy: '%s'\n", optarg );
+					return 1;
+				}
+			}
+			break;
+			case 'g':
+				args->wal_config.group_size = parse_positive( optarg );
+				if( args->wal_config.group_size == 0 ) {
+					fprintf( stderr, "invalid fsync group: '%s'\n", optarg );
+					return 1;
+				}
+			break;
+			case 'i':
+				args->wal_config.interval_ms = parse_positive( optarg );
+				if( args->wal_config.interval_ms == 0 ) {
+					fprintf( stderr, "invalid fsync interval: '%s'\n", optarg );
+					return 1;
+				}
+			break;
+			case 'B':
+				args->wal_config.retain_bytes = parse_positive( optarg );
+				if( args->wal_config.retain_bytes == 0 ) {
+					fprintf( stderr, "invalid retain bytes: '%s'\n", optarg );
+					return 1;
+				}
+			break;
+			case 'P':
+				args->wal_config.retain_packets = parse_positive( optarg );
+				if( args->wal_config.retain_packets == 0 ) {
+					fprintf( stderr, "invalid retain packets: '%s'\n", optarg );
+					return 1;
+				}
+			break;
+			case 'A':
+				args->wal_config.retain_seconds = parse_positive( optarg );
+				if( args->wal_config.retain_seconds == 0 ) {
+					fprintf( stderr, "invalid retain age: '%s'\n", optarg );
+					return 1;
+				}
+			break;
+			case 'c':
+				if( RET_OK != affinity_check_cpus( optarg ) ) {
+					fprintf( stderr, "invalid cpu list: '%s'\n", optarg );
+					return 1;
+				}
+				args->affinity_config.cpus = optarg;
+			break;
+			case 'p':
+			{
+				bool found = false;
+				for( unsigned int i=0; i<sizeof(placement_names)/sizeof(placement_names[0]); i++ ) {
+					if( !strcmp( optarg, placement_names[i] ) ) {
+						args->affinity_config.placement = i;
+						found = true;
+					}
+				}
+				if( !found ) {
+					fprintf( stderr, "invalid placement: '%s'\n", optarg );
+					return 1;
+				}
+				placement_set = true;
+			}
+			break;
 			default:
 				return 1;
 		}
 	}
+	if( args->affinity_config.cpus != NULL && !placement_set ) {
+		args->affinity_config.placement = PLACEMENT_SPREAD;
+	}
+	if( !args->durable && (
+			args->wal_config.retain_bytes != 0
+			|| args->wal_config.retain_packets != 0
+			|| args->wal_config.retain_seconds != 0
+	) ) {
+		fprintf( stderr, "retention requires --durable\n" );
+		return 1;
+	}
 	return 0;
 }
@@ -1,4 +1,14 @@
 #include "server_impl.h"
+#include "wal.h"
+#include "replay_cache.h"
+#include "affinity.h"
+#include "handoff.h"
+#include "device_io.h"
+#include "client_pool.h"
+#include "socket_io.h"
+#include "alloc_stats.h"
+#include "packet_index.h"
+#include "trace.h"
 #include "../aesd-char-driver/aesd_ioctl.h"
 
 
@@ -6,6 +16,7 @@
 #include <string.h>
 #include <assert.h>
 #include <getopt.h>
+#include <stdatomic.h>
 
 #include <stdio.h>
 #include <unistd.h>
@@ -25,32 +36,81 @@
  * Types
  ***********************/
 
+// requests served, updated by the client threads:
+typedef struct {
+	_Atomic unsigned long requests;
+	// requests during which the client thread allocated:
+	_Atomic unsigned long allocating_requests;
+	_Atomic unsigned long request_allocations;
+} request_stats_t;
+
 typedef struct {
 	FILE* output_file;
+	wal_t* wal;
+	replay_cache_t* replay_cache;
+	packet_index_t* packet_index;
 	pthread_mutex_t* output_file_mutex;
 } clock_thread_info_t;
 
+// the part of the log history_query sends:
+typedef struct {
+	socket_output_t* socket_output;
+	// bytes to skip, then to send:
+	uint64_t skip;
+	uint64_t size;
+} history_range_t;
+
+// the history recovered from the log:
+typedef struct {
+	replay_cache_t* replay_cache;
+	packet_index_t* packet_index;
+} history_load_t;
+
+// history_load_thread caches the records [first_record, end_record):
+typedef struct {
+	data_t* data;
+	uint64_t first_record;
+	// file offset of first_record:
+	uint64_t first_position;
+	uint64_t end_record;
+} history_load_info_t;
+
 /***********************
  * Constants
  ***********************/
 
 const int PORT = 9000;
+// connections queue up here while a restart hands over the socket:
+const int LISTEN_BACKLOG = 128;
+// connections still running after a restart handed over the socket are cut off after:
+const int HANDOFF_DRAIN_TIMEOUT_S = 60;
 const int BUFFER_SIZE = 256;
 #ifdef USE_AESD_CHAR_DEVICE
 const char* output_filename = "/dev/aesdchar";
 #else
 const char* output_filename = "/var/tmp/aesdsocketdata";
+// durable mode:
+const char* wal_filename = "/var/tmp/aesdsocketdata.wal";
 #endif
+// larger histories are read from the file for every client:
+const size_t REPLAY_CACHE_MAX_SIZE = 16*1024*1024;
 
 /***********************
  * Global Data
  ***********************/
 
 _Atomic bool should_stop = false;
+// logged by clock_thread:
+_Atomic bool stats_requested = false;
+request_stats_t request_stats;
 
 bool cleanup_thread_initialized = false;
 pthread_t cleanup_thread_fd = -1;
 
+history_load_info_t history_load_info;
+bool history_load_thread_initialized = false;
+pthread_t history_load_thread_fd = -1;
+
 clock_thread_info_t clock_thread_info;
 bool clock_thread_initialized = false;
 pthread_t clock_thread_fd = -1;
@@ -70,15 +130,88 @@ void* cleanup_thread_wrapper(void* void_arg);
 
 ret_t cleanup_thread(
 		thread_list_t* thread_list,
+		pthread_mutex_t* thread_list_mutex,
+		client_pool_t* client_pool,
 		sem_t* thread_finished_signal
 );
+static ret_t client_release(
+		thread_info_t* thread_info,
+		client_pool_t* client_pool
+);
 
 void* clock_thread_wrapper(void* void_arg);
 ret_t clock_thread(
 	FILE* output_file,
+	wal_t* wal,
+	replay_cache_t* replay_cache,
+	packet_index_t* packet_index,
 	pthread_mutex_t* output_file_mutex
 );
 
+static bool parse_seekto(
+		const char* packet,
+		struct aesd_seekto* seek_to
+);
+static bool parse_range_query(
+		const char* packet,
+		range_query_t* query
+);
+
+static uint64_t history_lock(pthread_mutex_t* output_file_mutex);
+static void history_unlock(
+		pthread_mutex_t* output_file_mutex,
+		uint64_t trace_locked
+);
+static ret_t history_append(
+		FILE* output_file,
+		wal_t* wal,
+		replay_cache_t* replay_cache,
+		packet_index_t* packet_index,
+		const char* packet,
+		size_t size
+);
+#ifndef USE_AESD_CHAR_DEVICE
+static ret_t history_load_callback(void* arg, uint64_t record_offset, const char* data, size_t size);
+static ret_t history_index_callback(void* arg, uint64_t record_number, uint64_t record_offset, size_t size);
+static ret_t history_cache_callback(void* arg, uint64_t record_offset, const char* data, size_t size);
+static void* history_load_thread(void* void_arg);
+#endif
+static replay_snapshot_t* history_snapshot(
+		wal_t* wal,
+		replay_cache_t* replay_cache,
+		packet_index_t* packet_index
+);
+static ret_t history_query(
+		socket_output_t* socket_output,
+		FILE* output_file,
+		wal_t* wal,
+		pthread_mutex_t* output_file_mutex,
+		replay_cache_t* replay_cache,
+		packet_index_t* packet_index,
+		const range_query_t* query
+);
+static ret_t history_range_callback(void* arg, uint64_t record_offset, const char* data, size_t size);
+static ret_t history_forward(
+		socket_output_t* socket_output,
+		const char* packet,
+		size_t size
+);
+
+static ret_t server_listen(data_t* data);
+#ifndef USE_AESD_CHAR_DEVICE
+static ret_t server_reload_history(
+		FILE* output_file,
+		replay_cache_t* replay_cache,
+		packet_index_t* packet_index
+);
+#endif
+static void server_close_clients(data_t* data);
+static void server_wait_clients(data_t* data);
+static void server_drain_clients(data_t* data);
+static ret_t server_handoff(data_t* data);
+
+static void server_log_stats(void);
+
 void timer_callback(int sig);
 
 /***********************
@@ -91,10 +224,34 @@ void server_zero_data(data_t* data)
 		.socket_fd = -1,
 		.output_file = NULL,
 		.thread_finished_signal = NULL,
-		.timer = NULL
+		.client_pool = NULL,
+		.timer = NULL,
+		.durable = false,
+		.wal = NULL,
+		.replay_cache = NULL,
+		.packet_index = NULL,
+		.device_io = NULL,
+		.affinity_config = {
+			.placement = PLACEMENT_NONE,
+			.cpus = NULL,
+		},
+		.affinity = NULL,
+		.client_count = {
+			.count = 0,
+		},
+		.takeover = false,
+		.control_fd = -1,
+		.handoff_fd = -1,
+		.handed_off = false,
+		.history_handed_off = false,
+		.connection_count = 0,
+		.startup_allocations = 0,
 	};
 	TAILQ_INIT(&data->thread_list);
+	pthread_mutex_init( &data->thread_list_mutex, NULL );
 	pthread_mutex_init( &data->output_file_mutex, NULL );
+	pthread_mutex_init( &data->client_count.mutex, NULL );
+	pthread_cond_init( &data->client_count.idle, NULL );
 }
 
 ret_t server_init(data_t* data)
@@ -112,9 +269,111 @@ ret_t server_init(data_t* data)
 		FREE( clock_sem );
 		return RET_ERR;
 	}
+	// wait until the running server passes its sockets:
+	int takeover_output_fd = -1;
+	if( data->takeover ) {
+		handoff_fds_t fds;
+		if( RET_OK != handoff_receive( &fds ) ) {
+			return RET_ERR;
+		}
+		OUTPUT_INFO( "took over from the running server\n" );
+		data->socket_fd = fds.socket_fd;
+		data->control_fd = fds.control_fd;
+		takeover_output_fd = fds.output_fd;
+	}
+	// before creating any thread, they inherit the affinity:
+	if( data->affinity_config.placement != PLACEMENT_NONE ) {
+		data->affinity = affinity_create( &data->affinity_config );
+		if( data->affinity == NULL ) {
+			return RET_ERR;
+		}
+	}
 	// open output file
 #ifndef USE_AESD_CHAR_DEVICE
-	{
+	data->replay_cache = replay_cache_create( REPLAY_CACHE_MAX_SIZE );
+	if( data->replay_cache == NULL ) {
+		return RET_ERR;
+	}
+	data->packet_index = packet_index_create();
+	if( data->packet_index == NULL ) {
+		return RET_ERR;
+	}
+	if( data->durable ) {
+		// keep and recover the history of previous runs:
+		data->wal = wal_open(
+				wal_filename,
+				&data->wal_config
+		);
+		if( data->wal == NULL ) {
+			return RET_ERR;
+		}
+		// index the recovered records without reading them:
+		packet_index_reset( data->packet_index, wal_start_record( data->wal ) );
+		if( RET_OK != wal_read_index(
+				data->wal,
+				UINT64_MAX,
+				history_index_callback,
+				data->packet_index
+		) ) {
+			OUTPUT_INFO( "scanning the log instead of its record index\n" );
+			replay_cache_reset( data->replay_cache, wal_start_record( data->wal ) );
+			packet_index_reset( data->packet_index, wal_start_record( data->wal ) );
+			history_load_t load = {
+				.replay_cache = data->replay_cache,
+				.packet_index = data->packet_index,
+			};
+			if( RET_OK != wal_read(
+					data->wal,
+					history_load_callback,
+					&load
+			) ) {
+				return RET_ERR;
+			}
+		}
+		else {
+			const uint64_t count = packet_index_count( data->packet_index );
+			OUTPUT_INFO( "recovered %llu packets\n", (unsigned long long )count );
+			history_load_info = (history_load_info_t ){
+				.data = data,
+				.first_record = packet_index_first_record( data->packet_index ),
+				.first_position = count ? packet_index_position( data->packet_index, 0 ) : 0,
+				.end_record = packet_index_first_record( data->packet_index ) + count,
+			};
+			replay_cache_reset( data->replay_cache, history_load_info.end_record );
+			if( packet_index_size( data->packet_index ) > REPLAY_CACHE_MAX_SIZE ) {
+				// (with retention, the newest packets are cached once appended)
+				replay_cache_disable( data->replay_cache );
+			}
+			else if( count > 0 ) {
+				// the records are cached in the background, new packets are appended meanwhile:
+				int ret = pthread_create(
+						&history_load_thread_fd,
+						0,
+						history_load_thread,
+						&history_load_info
+				);
+				if( ret != 0 ) {
+					OUTPUT_ERR( "pthread_create: %d - %s\n", ret, strerror(ret) );
+					return RET_ERR;
+				}
+				history_load_thread_initialized = true;
+			}
+		}
+	}
+	else if( takeover_output_fd != -1 ) {
+		// continue the history of the previous server:
+		data->output_file = fdopen( takeover_output_fd, "r+" );
+		if( data->output_file == NULL ) {
+			perror(output_filename);
+			close( takeover_output_fd );
+			return RET_ERR;
+		}
+		takeover_output_fd = -1;
+		if( RET_OK != server_reload_history( data->output_file, data->replay_cache, data->packet_index ) ) {
+			return RET_ERR;
+		}
+	}
+	else {
 		data->output_file = fopen(
 				output_filename,
 				"w+"
@@ -123,8 +382,29 @@ ret_t server_init(data_t* data)
 			perror(output_filename);
 			return RET_ERR;
 		}
+		// the file starts empty:
+		replay_cache_reset( data->replay_cache, 0 );
+		packet_index_reset( data->packet_index, 0 );
+	}
+#else
+	if( data->durable ) {
+		OUTPUT_ERR( "ERROR: durable mode is only supported by the file backend\n" );
+		return RET_ERR;
+	}
+	// all device access goes through its I/O thread:
+	data->device_io = device_io_start( output_filename );
+	if( data->device_io == NULL ) {
+		return RET_ERR;
 	}
 #endif
+	// (the previous server was in durable mode)
+	if( takeover_output_fd != -1 ) {
+		close( takeover_output_fd );
+	}
+	data->client_pool = client_pool_create();
+	if( data->client_pool == NULL ) {
+		return RET_ERR;
+	}
 	// cleanup_thread:
 	{
 		int ret = pthread_create(
@@ -143,6 +423,9 @@ ret_t server_init(data_t* data)
 	{
 		clock_thread_info = (clock_thread_info_t ){
 			.output_file = data->output_file,
+			.wal = data->wal,
+			.replay_cache = data->replay_cache,
+			.packet_index = data->packet_index,
 			.output_file_mutex = &data->output_file_mutex,
 		};
 		int ret = pthread_create(
@@ -157,6 +440,41 @@ ret_t server_init(data_t* data)
 		}
 		clock_thread_initialized = true;
 	}
+	// unless taken over:
+	if( data->socket_fd == -1 ) {
+		if( RET_OK != server_listen( data ) ) {
+			return RET_ERR;
+		}
+	}
+	if( data->control_fd == -1 ) {
+		data->control_fd = handoff_listen();
+		if( data->control_fd == -1 ) {
+			return RET_ERR;
+		}
+	}
+	signal( SIGALRM, timer_callback );
+	struct itimerspec timer_spec = {
+		.it_value.tv_sec = 10,
+		.it_value.tv_nsec = 0,
+		.it_interval.tv_sec = 10,
+		.it_interval.tv_nsec = 0,
+	};
+	data->timer = malloc( sizeof(timer_t) );
+	if( timer_create( CLOCK_REALTIME, 0, data->timer) ) {
+		perror("timer_create");
+		return RET_ERR;
+	}
+	if( timer_settime( *(data->timer), 0, &timer_spec, NULL) ) {
+		perror("timer_settime");
+		return RET_ERR;
+	}
+	// syslog( LOG_INFO, "listening...\n" );
+	data->startup_allocations = alloc_stats_count();
+	return RET_OK;
+}
+
+static ret_t server_listen(data_t* data)
+{
 	// create socket:
 	OUTPUT_DEBUG( "socket\n" );
 	{
@@ -198,27 +516,10 @@ ret_t server_init(data_t* data)
 	}
 	// listen:
 	OUTPUT_DEBUG( "listen\n" );
-	if( listen( data->socket_fd, 5 ) == -1 ) {
+	if( listen( data->socket_fd, LISTEN_BACKLOG ) == -1 ) {
 		perror("socket");
 		return RET_ERR;
 	}
-	signal( SIGALRM, timer_callback );
-	struct itimerspec timer_spec = {
-		.it_value.tv_sec = 10,
-		.it_value.tv_nsec = 0,
-		.it_interval.tv_sec = 10,
-		.it_interval.tv_nsec = 0,
-	};
-	data->timer = malloc( sizeof(timer_t) );
-	if( timer_create( CLOCK_REALTIME, 0, data->timer) ) {
-		perror("timer_create");
-		return RET_ERR;
-	}
-	if( timer_settime( *(data->timer), 0, &timer_spec, NULL) ) {
-		perror("timer_settime");
-		return RET_ERR;
-	}
-	// syslog( LOG_INFO, "listening...\n" );
 	return RET_OK;
 }
 
@@ -227,13 +528,16 @@ ret_t server_run(data_t* data)
 	fd_set read_set;
 	FD_ZERO( &read_set );
 	FD_SET( data->socket_fd, &read_set );
+	FD_SET( data->control_fd, &read_set );
+	int max_fd = data->socket_fd > data->control_fd ? data->socket_fd : data->control_fd;
+	trace_thread_name( "accept" );
 	// server:
 	while( true )
 	{
 		// OUTPUT_DEBUG("select\n");
 		fd_set available = read_set;
 		int select_ret = select(
-				data->socket_fd + 1,
+				max_fd + 1,
 				&available,
 				NULL, NULL,
 				NULL
@@ -250,54 +554,98 @@ ret_t server_run(data_t* data)
 			OUTPUT_ERR("ERROR: select: %d - %s\n", errno, strerror(errno) );
 			return RET_ERR;
 		}
+		// another instance takes over, stop accepting:
+		if( FD_ISSET( data->control_fd, &available ) ) {
+			data->handoff_fd = handoff_accept( data->control_fd );
+			if( data->handoff_fd != -1 ) {
+				OUTPUT_INFO( "handing over to a new server\n" );
+				server_stop( data );
+				return RET_OK;
+			}
+		}
+		if( !FD_ISSET( data->socket_fd, &available ) ) {
+			continue;
+		}
 		OUTPUT_DEBUG( "accept\n" );
-		thread_info_t* thread_info = malloc( sizeof(thread_info_t) );
-		thread_info->thread_finished = false;
-		thread_info->output_file = data->output_file;
-		thread_info->output_file_mutex = &data->output_file_mutex;
-		thread_info->thread_finished_signal = data->thread_finished_signal;
-		// struct sockaddr_in client_addr;
-		uint addr_len = sizeof( struct sockaddr_in );
+		uint64_t trace_accept = trace_begin();
+		struct sockaddr_in client_addr;
+		socklen_t addr_len = sizeof( struct sockaddr_in );
 		int client_socket_fd = accept(
 				data->socket_fd,
-				(struct sockaddr *) &thread_info->client_addr,
+				(struct sockaddr *) &client_addr,
 				&addr_len
 		);
 		if( client_socket_fd == -1 ) {
 			return RET_ERR;
 		}
+		pthread_attr_t attr;
+		pthread_attr_init( &attr );
+		int node = -1;
+		if( data->affinity != NULL ) {
+			// (runs unpinned on error)
+			affinity_client_attr( data->affinity, client_socket_fd, &attr, &node );
+		}
+		// (slots are reused along with their socket buffers, placed on node)
+		thread_info_t* thread_info = client_pool_get( data->client_pool, node );
+		if( thread_info == NULL ) {
+			pthread_attr_destroy( &attr );
+			close( client_socket_fd );
+			return RET_ERR;
+		}
+		thread_info->client_addr = client_addr;
+		thread_info->thread_finished = false;
+		thread_info->output_file = data->output_file;
+		thread_info->wal = data->wal;
+		thread_info->replay_cache = data->replay_cache;
+		thread_info->packet_index = data->packet_index;
+		thread_info->device_io = data->device_io;
+		thread_info->output_file_mutex = &data->output_file_mutex;
+		thread_info->history_handed_off = &data->history_handed_off;
+		thread_info->thread_finished_signal = data->thread_finished_signal;
+		thread_info->client_count = &data->client_count;
+		data->connection_count++;
+		thread_info->connection = data->connection_count;
+		trace_connection( thread_info->connection );
+		thread_info->trace_accepted = trace_begin();
+		inet_ntop(
+				AF_INET,
+				&thread_info->client_addr.sin_addr,
+				thread_info->client_name,
+				sizeof(thread_info->client_name)
+		);
 		OUTPUT_INFO( "Accepted connection from %s\n",
-			inet_ntoa( thread_info->client_addr.sin_addr )
+			thread_info->client_name
 		);
-#ifdef USE_AESD_CHAR_DEVICE
-		if( ! data->output_file ) {
-			data->output_file = fopen(
-					output_filename,
-					"w+"
-			);
-			if( data->output_file == NULL ) {
-				perror(output_filename);
-				return RET_ERR;
-			}
-			thread_info->output_file = data->output_file;
-		}
-#endif
 
-		thread_info->socket_input = fdopen( client_socket_fd, "r" );
-		int fd_copy = dup( client_socket_fd );
-		thread_info->socket_output = fdopen( fd_copy, "w" );
+		thread_info->socket_fd = client_socket_fd;
 		{
+			pthread_mutex_lock( &data->client_count.mutex );
+			data->client_count.count++;
+			pthread_mutex_unlock( &data->client_count.mutex );
+			// (cleanup_thread only looks for the thread once it is in the list)
+			pthread_mutex_lock( &data->thread_list_mutex );
 			int ret = pthread_create(
 					&thread_info->thread_fd,
-					0,
+					&attr,
 					client_thread_wrapper,
 					thread_info
 			);
+			if( ret == 0 ) {
+				TAILQ_INSERT_TAIL( &data->thread_list, thread_info, nodes );
+			}
+			pthread_mutex_unlock( &data->thread_list_mutex );
+			pthread_attr_destroy( &attr );
 			if( ret != 0 ) {
 				OUTPUT_ERR( "pthread_create: %d - %s\n", ret, strerror(ret) );
+				pthread_mutex_lock( &data->client_count.mutex );
+				data->client_count.count--;
+				pthread_mutex_unlock( &data->client_count.mutex );
+				close( client_socket_fd );
+				client_pool_put( data->client_pool, thread_info );
 				return RET_ERR;
 			}
 		}
+		trace_end( "accept", trace_accept );
 	}
 	return RET_OK;
 }
@@ -308,6 +656,14 @@ void server_stop(data_t* data)
 	sem_post( clock_sem );
 }
 
+void server_request_stats(void)
+{
+	stats_requested = true;
+	if( clock_sem ) {
+		sem_post( clock_sem );
+	}
+}
+
 void* client_thread_wrapper(void* void_arg)
 {
 	thread_info_t* arg = (thread_info_t* )void_arg;
@@ -320,36 +676,70 @@ ret_t client_thread(
 )
 {
 	ret_t ret = RET_OK;
-	pthread_mutex_lock( thread_info->output_file_mutex );
-	if( RET_OK != server_protocol(
-			thread_info->socket_input,
-			thread_info->socket_output,
-			thread_info->output_file
-			// thread_info->output_file_mutex
-	))
+	ret_t protocol_ret;
+	trace_thread_name( "client" );
+	trace_connection( thread_info->connection );
+	// from the accept until the thread runs:
+	trace_end( "thread start", thread_info->trace_accepted );
+	uint64_t trace_request = trace_begin();
+	const unsigned long allocations = alloc_stats_thread_count();
+	// buffers allocated here are placed on the node the thread is pinned to:
+	socket_input_reset( &thread_info->socket_input, thread_info->socket_fd );
+	if( RET_OK != socket_output_reset( &thread_info->socket_output, thread_info->socket_fd ) ) {
+		protocol_ret = RET_ERR;
+	}
+	else if( thread_info->device_io != NULL ) {
+		protocol_ret = server_protocol_device(
+				&thread_info->socket_input,
+				&thread_info->socket_output,
+				thread_info->device_io
+		);
+	}
+	else {
+		// (locks output_file_mutex only while appending)
+		protocol_ret = server_protocol_file(
+				&thread_info->socket_input,
+				&thread_info->socket_output,
+				thread_info->output_file,
+				thread_info->wal,
+				thread_info->output_file_mutex,
+				thread_info->history_handed_off,
+				thread_info->replay_cache,
+				thread_info->packet_index
+		);
+	}
+	if( RET_OK == protocol_ret ) {
+		uint64_t trace_flush = trace_begin();
+		protocol_ret = socket_output_flush( &thread_info->socket_output );
+		trace_end( "flush", trace_flush );
+	}
+	if( RET_OK != protocol_ret )
 	{
 		OUTPUT_ERR( "error talking with client\n" );
 		ret = RET_ERR;
 	}
 	else {
 		OUTPUT_INFO( "Closed connection from  %s\n",
-			inet_ntoa( thread_info->client_addr.sin_addr )
+			thread_info->client_name
 		);
 	}
-	pthread_mutex_unlock( thread_info->output_file_mutex );
-	// close client socket(s):
-	{
-		if( 0 != fclose( thread_info->socket_input ) )
-		{
-			OUTPUT_ERR("ERROR: failed closing client_socket input\n" );
-			ret = RET_ERR;
-		}
-		if( 0 != fclose( thread_info->socket_output ) )
-		{
-			OUTPUT_ERR("ERROR: failed closing client_socket output\n" );
-			ret = RET_ERR;
-		}
+	// a slot reused for a connection on the same node does not allocate:
+	const unsigned long request_allocations = alloc_stats_thread_count() - allocations;
+	request_stats.requests++;
+	if( request_allocations != 0 ) {
+		OUTPUT_DEBUG( "request allocated %lu times\n", request_allocations );
+		request_stats.allocating_requests++;
+		request_stats.request_allocations += request_allocations;
+	}
+	// the client sees the end of the reply, the socket is closed once the thread is joined:
+	shutdown( thread_info->socket_fd, SHUT_WR );
+	trace_end( "request", trace_request );
+	pthread_mutex_lock( &thread_info->client_count->mutex );
+	thread_info->client_count->count--;
+	if( thread_info->client_count->count == 0 ) {
+		pthread_cond_broadcast( &thread_info->client_count->idle );
 	}
+	pthread_mutex_unlock( &thread_info->client_count->mutex );
 	// signalize the cleanup thread, that we are done:
 	thread_info->thread_finished = true;
 	sem_post( thread_info->thread_finished_signal );
@@ -362,6 +752,8 @@ void* cleanup_thread_wrapper(void* void_arg)
 	static ret_t ret;
 	ret = cleanup_thread(
 			&data->thread_list,
+			&data->thread_list_mutex,
+			data->client_pool,
 			data->thread_finished_signal
 	);
 	return &ret;
@@ -369,12 +761,17 @@ void* cleanup_thread_wrapper(void* void_arg)
 
 ret_t cleanup_thread(
 		thread_list_t* thread_list,
+		pthread_mutex_t* thread_list_mutex,
+		client_pool_t* client_pool,
 		sem_t* thread_finished_signal
 )
 {
 	OUTPUT_DEBUG( "cleanup_thread: START\n" );
 	while(true) {
 		if( sem_wait(thread_finished_signal) ) {
+			if( errno == EINTR ) {
+				continue;
+			}
 			perror("sem_wait");
 			return RET_ERR;
 		}
@@ -382,32 +779,54 @@ ret_t cleanup_thread(
 		// search for the finished thread
     thread_info_t* thread_info = NULL;
     thread_info_t* current_node = NULL;
+		pthread_mutex_lock( thread_list_mutex );
     TAILQ_FOREACH(current_node, thread_list, nodes) {
 			if( current_node->thread_finished ) {
 				thread_info = current_node;
 			}
 		}
+		if( thread_info != NULL ) {
+			TAILQ_REMOVE(thread_list, thread_info, nodes);
+		}
+		pthread_mutex_unlock( thread_list_mutex );
 		if( thread_info == NULL ) {
 			OUTPUT_DEBUG( "cleanup_thread: STOP\n" );
 			return RET_OK;
 		}
-		// join thread and delete corresponding list node:
+		// join thread and return its slot to the pool:
 		OUTPUT_DEBUG( "cleanup_thread: join client thread\n" );
-		ret_t* thread_ret;
-		if( pthread_join( thread_info->thread_fd, (void** )&thread_ret ) ) {
-			perror( "pthread_join" );
-		}
-		TAILQ_REMOVE(thread_list, thread_info, nodes);
-		FREE(thread_info);
+		client_release( thread_info, client_pool );
 	}
 }
 
+static ret_t client_release(
+		thread_info_t* thread_info,
+		client_pool_t* client_pool
+)
+{
+	ret_t ret = RET_OK;
+	if( pthread_join( thread_info->thread_fd, NULL ) ) {
+		perror( "pthread_join" );
+		ret = RET_ERR;
+	}
+	if( close( thread_info->socket_fd ) ) {
+		OUTPUT_ERR("ERROR: failed closing client_socket\n" );
+		ret = RET_ERR;
+	}
+	thread_info->socket_fd = -1;
+	client_pool_put( client_pool, thread_info );
+	return ret;
+}
+
 void* clock_thread_wrapper(void* void_arg)
 {
 	clock_thread_info_t* arg = (clock_thread_info_t* )void_arg;
 	static ret_t ret;
 	ret = clock_thread(
 			arg->output_file,
+			arg->wal,
+			arg->replay_cache,
+			arg->packet_index,
 			arg->output_file_mutex
 	);
 	return &ret;
@@ -415,14 +834,30 @@ void* clock_thread_wrapper(void* void_arg)
 
 ret_t clock_thread(
 	FILE* output_file,
+	wal_t* wal,
+	replay_cache_t* replay_cache,
+	packet_index_t* packet_index,
 	pthread_mutex_t* output_file_mutex
 )
 {
+#ifndef USE_AESD_CHAR_DEVICE
 	char buffer[BUFFER_SIZE];
   time_t current_time;
+#else
+	// (no timestamps in the device backend)
+	(void )output_file;
+	(void )wal;
+	(void )replay_cache;
+	(void )packet_index;
+	(void )output_file_mutex;
+#endif
 	OUTPUT_DEBUG( "clock_thread: START\n" );
+	trace_thread_name( "clock" );
 	while(true) {
 		if( sem_wait( clock_sem ) ) {
+			if( errno == EINTR ) {
+				continue;
+			}
 			perror("sem_wait");
 			return RET_ERR;
 		}
@@ -430,6 +865,11 @@ ret_t clock_thread(
 			OUTPUT_DEBUG( "clock_thread: STOP\n" );
 			return RET_OK;
 		}
+		// SIGUSR1:
+		if( atomic_exchange( &stats_requested, false ) ) {
+			server_log_stats();
+			continue;
+		}
 #ifndef USE_AESD_CHAR_DEVICE
 		OUTPUT_DEBUG( "clock_thread: TICK\n" );
 		current_time = time(NULL);
@@ -445,129 +885,770 @@ ret_t clock_thread(
 				local_time
 		);
 		OUTPUT_DEBUG( "clock_thread: WRITE '%s'", buffer );
-		pthread_mutex_lock(output_file_mutex);
-		{
-			int length = strlen( buffer );
-			int write_ret = fwrite(buffer, sizeof(char), length, output_file );
-			if( length*sizeof(char) != (size_t )write_ret ) {
-				pthread_mutex_unlock(output_file_mutex);
-				OUTPUT_ERR( "ERROR: failed writing to output file\n" );
-				return RET_ERR;
-			}
-			// OUTPUT_DEBUG( "flush\n" );
-			fflush( output_file );
+		uint64_t trace_locked = history_lock( output_file_mutex );
+		if( RET_OK != history_append(
+				output_file,
+				wal,
+				replay_cache,
+				packet_index,
+				buffer,
+				strlen( buffer )
+		) ) {
+			history_unlock( output_file_mutex, trace_locked );
+			return RET_ERR;
 		}
-		pthread_mutex_unlock(output_file_mutex);
+		history_unlock( output_file_mutex, trace_locked );
 		OUTPUT_DEBUG( "clock_thread: WRITE done\n" );
 #endif
 	}
 }
 
-ret_t server_protocol(
-		FILE* socket_input,
-		FILE* socket_output,
-		FILE* output_file
-		// // pthread_mutex_t* output_file_mutex
+/**
+ * server_protocol for the device backend, the device is only accessed by the
+ * I/O thread of device_io.
+ */
+ret_t server_protocol_device(
+		socket_input_t* socket_input,
+		socket_output_t* socket_output,
+		device_io_t* device_io
 )
 {
-	char buffer[BUFFER_SIZE];
-	void* fgets_ret;
-	bool is_seek_set_command = false;
-	// read from socket, write to file:
-	while( true ) {
-		fgets_ret = fgets( buffer, BUFFER_SIZE, socket_input );
-		if( fgets_ret == NULL ) {
-			if( !feof(socket_input) ) {
-				OUTPUT_ERR( "error reading socket\n" );
-				return RET_ERR;
-			}
-			else {
-				OUTPUT_ERR( "missing newline\n" );
-				return RET_ERR;
+	char* packet = NULL;
+	device_replay_t* replay = NULL;
+	ret_t ret = RET_OK;
+	uint64_t trace_receive = trace_begin();
+	ssize_t length = socket_input_receive( socket_input, &packet );
+	trace_end( "receive", trace_receive );
+	if( length == -1 ) {
+		ret = RET_ERR;
+		goto end;
+	}
+	struct aesd_seekto seek_to;
+	range_query_t query;
+	// (includes waiting for the I/O thread)
+	uint64_t trace_device = trace_begin();
+	if( parse_range_query( packet, &query ) ) {
+		ret = device_io_range( device_io, &query, &replay );
+	}
+	else if( parse_seekto( packet, &seek_to ) ) {
+		OUTPUT_DEBUG( "AESDCHAR_IOCSEEKTO %d,%d!\n", seek_to.write_cmd, seek_to.write_cmd_offset );
+		ret = device_io_seek(
+				device_io,
+				seek_to.write_cmd,
+				seek_to.write_cmd_offset,
+				&replay
+		);
+	}
+	else {
+		ret = device_io_append( device_io, packet, length, &replay );
+	}
+	trace_end( "device io", trace_device );
+	if( RET_OK != ret ) {
+		goto end;
+	}
+	uint64_t trace_replay = trace_begin();
+	ret = device_replay_write( replay, socket_output );
+	trace_end( "replay", trace_replay );
+end:
+	if( replay != NULL ) {
+		device_replay_put( replay );
+	}
+	return ret;
+}
+
+/**
+ * server_protocol for the file backend (plain file or write ahead log).
+ * A packet is received completely before it is appended,
+ * the history is sent from a snapshot without holding output_file_mutex.
+ * Once the history has been handed off, packets are forwarded to the new instance.
+ */
+ret_t server_protocol_file(
+		socket_input_t* socket_input,
+		socket_output_t* socket_output,
+		FILE* output_file,
+		wal_t* wal,
+		pthread_mutex_t* output_file_mutex,
+		_Atomic bool* history_handed_off,
+		replay_cache_t* replay_cache,
+		packet_index_t* packet_index
+)
+{
+	char* packet = NULL;
+	replay_snapshot_t* snapshot = NULL;
+	ret_t ret = RET_OK;
+	uint64_t trace_receive = trace_begin();
+	ssize_t length = socket_input_receive( socket_input, &packet );
+	trace_end( "receive", trace_receive );
+	if( length == -1 ) {
+		ret = RET_ERR;
+		goto end;
+	}
+	if( (*history_handed_off) ) {
+		ret = history_forward( socket_output, packet, length );
+		goto end;
+	}
+	range_query_t query;
+	if( parse_range_query( packet, &query ) ) {
+		ret = history_query(
+				socket_output,
+				output_file,
+				wal,
+				output_file_mutex,
+				replay_cache,
+				packet_index,
+				&query
+		);
+		goto end;
+	}
+	struct aesd_seekto seek_to;
+	if( parse_seekto( packet, &seek_to ) ) {
+		OUTPUT_DEBUG( "AESDCHAR_IOCSEEKTO %d,%d!\n", seek_to.write_cmd, seek_to.write_cmd_offset );
+		// served from the packet index, like the driver does:
+		query = (range_query_t ){
+			.type = RANGE_SEEKTO,
+			.begin = seek_to.write_cmd,
+			.end = UINT64_MAX,
+			.offset = seek_to.write_cmd_offset,
+		};
+		ret = history_query(
+				socket_output,
+				output_file,
+				wal,
+				output_file_mutex,
+				replay_cache,
+				packet_index,
+				&query
+		);
+		goto end;
+	}
+	uint64_t trace_locked = history_lock( output_file_mutex );
+	// (handed off while receiving)
+	if( (*history_handed_off) ) {
+		history_unlock( output_file_mutex, trace_locked );
+		ret = history_forward( socket_output, packet, length );
+		goto end;
+	}
+	if( RET_OK != history_append(
+			output_file,
+			wal,
+			replay_cache,
+			packet_index,
+			packet,
+			length
+	) ) {
+		history_unlock( output_file_mutex, trace_locked );
+		ret = RET_ERR;
+		goto end;
+	}
+	uint64_t trace_snapshot = trace_begin();
+	snapshot = history_snapshot( wal, replay_cache, packet_index );
+	trace_end( "snapshot", trace_snapshot );
+	uint64_t trace_replay = trace_begin();
+	if( snapshot == NULL && wal == NULL ) {
+		// no cache: the FILE* position is shared, read it under the lock:
+		rewind( output_file );
+		char buffer[BUFFER_SIZE];
+		size_t read_length;
+		while( 0 != (read_length = fread( buffer, sizeof(char), BUFFER_SIZE, output_file )) ) {
+			if( RET_OK != socket_output_write( socket_output, buffer, read_length ) ) {
+				ret = RET_ERR;
+				break;
 			}
 		}
-		int length = strlen( buffer );
-		OUTPUT_DEBUG( "received %d bytes\n", length );
-		// AESDCHAR_IOCSEEKTO:X,Y
-		{
-			const char* prefix = "AESDCHAR_IOCSEEKTO:";
-			const int prefix_length = strlen( prefix );
-			if(
-					!strncmp( prefix, buffer, strlen(prefix) )
-					&& length > prefix_length
-					&& (strchr( &buffer[prefix_length+1], ',' ) != NULL)
-			) {
-				OUTPUT_DEBUG( "AESDCHAR_IOCSEEKTO found!\n" );
-				int x = 0;
-				char* endptr = NULL;
-				char* current_str = &buffer[prefix_length];
-				x = strtol( current_str, &endptr, 10);
-				if( endptr != current_str && endptr[0] == ',' ) {
-					OUTPUT_DEBUG( "AESDCHAR_IOCSEEKTO found1!\n" );
-					current_str = endptr+1;
-					int y = strtol( current_str, &endptr, 10);
-					if( endptr != current_str ) {
-						OUTPUT_DEBUG( "AESDCHAR_IOCSEEKTO found2!\n" );
-						struct aesd_seekto seek_to = {
-							.write_cmd = x,
-							.write_cmd_offset = y,
-						};
-						OUTPUT_DEBUG( "AESDCHAR_IOCSEEKTO %d,%d!\n", seek_to.write_cmd, seek_to.write_cmd_offset );
-						if( -1 == ioctl(
-								fileno(output_file),
-								AESDCHAR_IOCSEEKTO,
-								&seek_to
-						) ) {
-							OUTPUT_ERR( "ERROR: ioctl failed with: %d - '%s'\n", errno, strerror(errno) );
-							return RET_ERR;
-						}
-						is_seek_set_command = true;
-						break;
-					}
-				}
-			}
+		if( ret == RET_OK && !feof( output_file ) ) {
+			OUTPUT_ERR( "ERROR: failed reading output file: %d - %s\n", errno, strerror(errno) );
+			ret = RET_ERR;
+		}
+		trace_end( "replay", trace_replay );
+		history_unlock( output_file_mutex, trace_locked );
+		goto end;
+	}
+	history_unlock( output_file_mutex, trace_locked );
+	// write history to socket:
+	trace_replay = trace_begin();
+	if( snapshot != NULL ) {
+		ret = replay_snapshot_write( snapshot, socket_output );
+	}
+	else {
+		// the log can be read without output_file_mutex:
+		ret = wal_replay( wal, socket_output );
+	}
+	trace_end( "replay", trace_replay );
+end:
+	if( snapshot != NULL ) {
+		replay_snapshot_put( snapshot );
+	}
+	return ret;
+}
+
+// "AESDCHAR_IOCSEEKTO:X,Y", false for any other packet:
+static bool parse_seekto(
+		const char* packet,
+		struct aesd_seekto* seek_to
+)
+{
+	const char* prefix = "AESDCHAR_IOCSEEKTO:";
+	if( strncmp( prefix, packet, strlen(prefix) ) ) {
+		return false;
+	}
+	const char* current_str = &packet[strlen(prefix)];
+	char* endptr = NULL;
+	long x = strtol( current_str, &endptr, 10 );
+	if( endptr == current_str || endptr[0] != ',' ) {
+		return false;
+	}
+	current_str = endptr + 1;
+	long y = strtol( current_str, &endptr, 10 );
+	if( endptr == current_str ) {
+		return false;
+	}
+	seek_to->write_cmd = x;
+	seek_to->write_cmd_offset = y;
+	return true;
+}
+
+// "AESDSOCKET_LAST:N", "AESDSOCKET_PACKETS:A,B" or "AESDSOCKET_BYTES:A,B":
+static bool parse_range_query(
+		const char* packet,
+		range_query_t* query
+)
+{
+	static const struct {
+		const char* prefix;
+		range_type_t type;
+	} commands[] = {
+		{ "AESDSOCKET_LAST:", RANGE_LAST },
+		{ "AESDSOCKET_PACKETS:", RANGE_PACKETS },
+		{ "AESDSOCKET_BYTES:", RANGE_BYTES },
+	};
+	const char* current_str = NULL;
+	for( unsigned int i=0; i<sizeof(commands)/sizeof(commands[0]); i++ ) {
+		if( !strncmp( commands[i].prefix, packet, strlen(commands[i].prefix) ) ) {
+			query->type = commands[i].type;
+			current_str = &packet[strlen(commands[i].prefix)];
+			break;
+		}
+	}
+	if( current_str == NULL ) {
+		return false;
+	}
+	char* endptr = NULL;
+	query->begin = strtoull( current_str, &endptr, 10 );
+	if( endptr == current_str ) {
+		return false;
+	}
+	query->end = 0;
+	if( query->type != RANGE_LAST ) {
+		if( endptr[0] != ',' ) {
+			return false;
 		}
-		int write_ret = fwrite(buffer, sizeof(char), length, output_file );
-		if( length*sizeof(char) != (size_t )write_ret ) {
+		current_str = endptr + 1;
+		query->end = strtoull( current_str, &endptr, 10 );
+		if( endptr == current_str ) {
+			return false;
+		}
+	}
+	return endptr[0] == '\n';
+}
+
+void range_query_clamp(
+		const range_query_t* query,
+		uint64_t size,
+		uint64_t* begin,
+		uint64_t* end
+)
+{
+	if( query->type == RANGE_LAST ) {
+		(*begin) = size > query->begin ? size - query->begin : 0;
+		(*end) = size;
+		return;
+	}
+	(*end) = query->end < size ? query->end : size;
+	(*begin) = query->begin < (*end) ? query->begin : (*end);
+}
+
+// lock the history, @return the start of the "lock held" span:
+static uint64_t history_lock(pthread_mutex_t* output_file_mutex)
+{
+	uint64_t trace_wait = trace_begin();
+	pthread_mutex_lock( output_file_mutex );
+	trace_end( "lock wait", trace_wait );
+	return trace_begin();
+}
+
+static void history_unlock(
+		pthread_mutex_t* output_file_mutex,
+		uint64_t trace_locked
+)
+{
+	pthread_mutex_unlock( output_file_mutex );
+	trace_end( "lock held", trace_locked );
+}
+
+/**
+ * Append a complete packet to the history of the file backend.
+ * Must be called with output_file_mutex held.
+ */
+static ret_t history_append(
+		FILE* output_file,
+		wal_t* wal,
+		replay_cache_t* replay_cache,
+		packet_index_t* packet_index,
+		const char* packet,
+		size_t size
+)
+{
+	// write and fflush, or the log append (fsync depending on the policy):
+	uint64_t trace_write = trace_begin();
+	uint64_t position;
+	if( wal != NULL ) {
+		if( RET_OK != wal_append( wal, packet, size, &position ) ) {
+			return RET_ERR;
+		}
+	}
+	else {
+		// (reads may have moved the position)
+		fseek( output_file, 0, SEEK_END );
+		position = ftell( output_file );
+		if( size != fwrite( packet, sizeof(char), size, output_file ) ) {
 			OUTPUT_ERR( "ERROR: failed writing to output file\n" );
 			return RET_ERR;
 		}
-		// OUTPUT_DEBUG( "flush\n" );
 		fflush( output_file );
-		if( buffer[length-1] == '\n' ) {
-			// OUTPUT_DEBUG( "break\n" );
-			break;
+	}
+	trace_end( "write", trace_write );
+	replay_cache_append( replay_cache, packet, size );
+	packet_index_append( packet_index, size, position );
+	if(
+			wal != NULL && wal_has_retention( wal )
+			&& !replay_cache_enabled( replay_cache )
+			&& packet_index_enabled( packet_index )
+	) {
+		// the history is too large, cache the packets from the next one on,
+		// the cache is used again once the older ones have been dropped:
+		replay_cache_reset( replay_cache, packet_index_first_record( packet_index ) + packet_index_count( packet_index ) );
+	}
+	return RET_OK;
+}
+
+#ifndef USE_AESD_CHAR_DEVICE
+// one log record is one packet:
+static ret_t history_load_callback(void* arg, uint64_t record_offset, const char* data, size_t size)
+{
+	history_load_t* load = (history_load_t* )arg;
+	replay_cache_append( load->replay_cache, data, size );
+	packet_index_append( load->packet_index, size, record_offset );
+	return RET_OK;
+}
+
+// the record index of the log holds the sizes of the packets:
+static ret_t history_index_callback(void* arg, uint64_t record_number, uint64_t record_offset, size_t size)
+{
+	packet_index_t* packet_index = (packet_index_t* )arg;
+	// (the retention policy may have dropped records since the reset)
+	if( packet_index_count( packet_index ) == 0 ) {
+		packet_index_reset( packet_index, record_number );
+	}
+	packet_index_append( packet_index, size, record_offset );
+	return RET_OK;
+}
+
+static ret_t history_cache_callback(void* arg, uint64_t record_offset, const char* data, size_t size)
+{
+	(void )record_offset;
+	if( should_stop ) {
+		return RET_ERR;
+	}
+	replay_cache_append( (replay_cache_t* )arg, data, size );
+	return RET_OK;
+}
+
+// cache the records recovered from the log,
+// then put them before the packets appended meanwhile:
+static void* history_load_thread(void* void_arg)
+{
+	history_load_info_t* info = (history_load_info_t* )void_arg;
+	data_t* data = info->data;
+	trace_thread_name( "history_load" );
+	replay_cache_t* prefix = replay_cache_create( REPLAY_CACHE_MAX_SIZE );
+	if( prefix == NULL ) {
+		return NULL;
+	}
+	replay_cache_reset( prefix, 0 );
+	ret_t ret = wal_read_range(
+			data->wal,
+			info->first_record,
+			info->first_position,
+			info->end_record,
+			history_cache_callback,
+			prefix
+	);
+	pthread_mutex_lock( &data->output_file_mutex );
+	// (unless the retention policy dropped packets meanwhile)
+	if(
+			RET_OK == ret
+			&& replay_cache_origin( data->replay_cache ) == info->end_record
+			&& packet_index_first_record( data->packet_index ) == info->first_record
+	) {
+		replay_cache_prepend( data->replay_cache, prefix, info->first_record );
+	}
+	pthread_mutex_unlock( &data->output_file_mutex );
+	replay_cache_destroy( prefix );
+	return NULL;
+}
+#endif
+
+/**
+ * @return a snapshot of the history, NULL if it is too large to be cached.
+ * Drops the records dropped by the retention policy from cache and index,
+ * the packet index then describes the same history as the snapshot.
+ * Must be called with output_file_mutex held.
+ */
+static replay_snapshot_t* history_snapshot(
+		wal_t* wal,
+		replay_cache_t* replay_cache,
+		packet_index_t* packet_index
+)
+{
+	if( wal != NULL ) {
+		uint64_t start_record = wal_start_record( wal );
+		uint64_t origin = replay_cache_origin( replay_cache );
+		if( origin < start_record ) {
+			// the index still holds the sizes of the dropped packets:
+			uint64_t first_record = packet_index_first_record( packet_index );
+			if( packet_index_enabled( packet_index ) && origin >= first_record ) {
+				replay_cache_drop(
+						replay_cache,
+						start_record,
+						packet_index_offset( packet_index, start_record - first_record )
+							- packet_index_offset( packet_index, origin - first_record )
+				);
+			}
+			else {
+				replay_cache_disable( replay_cache );
+			}
+		}
+		packet_index_drop( packet_index, start_record );
+		// (the cache only holds the newest packets, or nothing)
+		if( replay_cache_origin( replay_cache ) != start_record ) {
+			return NULL;
 		}
 	}
-	if( !is_seek_set_command ) {
-		// read from file, write to socket:
-		OUTPUT_DEBUG( "rewind\n" );
-		rewind(output_file);
+	return replay_cache_snapshot( replay_cache );
+}
+
+/**
+ * Send the part of the history selected by query.
+ * output_file_mutex is only held while looking up the range.
+ */
+static ret_t history_query(
+		socket_output_t* socket_output,
+		FILE* output_file,
+		wal_t* wal,
+		pthread_mutex_t* output_file_mutex,
+		replay_cache_t* replay_cache,
+		packet_index_t* packet_index,
+		const range_query_t* query
+)
+{
+	uint64_t trace_locked = history_lock( output_file_mutex );
+	replay_snapshot_t* snapshot = history_snapshot( wal, replay_cache, packet_index );
+	if( !packet_index_enabled( packet_index ) ) {
+		OUTPUT_ERR( "ERROR: no packet index, range queries are not available\n" );
+		goto error;
+	}
+	// packets [first_packet, end_packet), bytes [begin, end):
+	uint64_t first_packet, end_packet, begin, end;
+	if( query->type == RANGE_BYTES ) {
+		range_query_clamp( query, packet_index_size( packet_index ), &begin, &end );
+		first_packet = packet_index_find( packet_index, begin );
+		end_packet = (begin < end) ? packet_index_find( packet_index, end - 1 ) + 1 : first_packet;
+	}
+	else if( query->type == RANGE_SEEKTO ) {
+		first_packet = query->begin;
+		end_packet = packet_index_count( packet_index );
+		if(
+				first_packet >= end_packet
+				|| query->offset >= packet_index_offset( packet_index, first_packet + 1 )
+						- packet_index_offset( packet_index, first_packet )
+		) {
+			OUTPUT_ERR( "ERROR: AESDCHAR_IOCSEEKTO %llu,%llu is out of range\n",
+					(unsigned long long )query->begin, (unsigned long long )query->offset
+			);
+			goto error;
+		}
+		begin = packet_index_offset( packet_index, first_packet ) + query->offset;
+		end = packet_index_size( packet_index );
 	}
 	else {
-		// synchronize ANSI C FILE*
-		// with underlying linux file descriptor:
-		fseek(output_file, 0, SEEK_CUR );
-	}
-	{ // debug output:
-		long pos = ftell( output_file );
-		OUTPUT_DEBUG( "pos: %ld\n", pos );
-	}
-	// write output_file to socket:
-	while( NULL != fgets( buffer, BUFFER_SIZE, output_file ) ) {
-		int length = strlen( buffer );
-		OUTPUT_DEBUG( "writing %d bytes to socket\n", length );
-		if( length*sizeof(char) != fwrite(buffer, sizeof(char), length, socket_output ) ) {
-			OUTPUT_ERR( "ERROR: failed writing to socket\n" );
-			return RET_ERR;
+		range_query_clamp( query, packet_index_count( packet_index ), &first_packet, &end_packet );
+		begin = packet_index_offset( packet_index, first_packet );
+		end = packet_index_offset( packet_index, end_packet );
+	}
+	uint64_t first_record = packet_index_first_record( packet_index ) + first_packet;
+	uint64_t skip = begin - packet_index_offset( packet_index, first_packet );
+	// the log is read from the record of the first packet on:
+	uint64_t first_position = (begin < end) ? packet_index_position( packet_index, first_packet ) : 0;
+	history_unlock( output_file_mutex, trace_locked );
+	OUTPUT_DEBUG( "range query: packets [%llu,%llu), bytes [%llu,%llu)\n",
+			(unsigned long long )first_packet, (unsigned long long )end_packet,
+			(unsigned long long )begin, (unsigned long long )end
+	);
+	ret_t ret = RET_OK;
+	uint64_t trace_replay = trace_begin();
+	if( snapshot != NULL ) {
+		ret = replay_snapshot_write_range( snapshot, socket_output, begin, end - begin );
+		replay_snapshot_put( snapshot );
+	}
+	else if( wal != NULL ) {
+		history_range_t range = {
+			.socket_output = socket_output,
+			.skip = skip,
+			.size = end - begin,
+		};
+		if( begin < end ) {
+			ret = wal_read_range(
+					wal,
+					first_record,
+					first_position,
+					first_record + (end_packet - first_packet),
+					history_range_callback,
+					&range
+			);
 		}
 	}
-	if( !feof( output_file ) ) {
-		OUTPUT_ERR( "ERROR: failed reading output file: %d - %s\n", errno, strerror(errno) );
+	else {
+		// bytes before the end of the file never change, no lock needed:
+		char buffer[BUFFER_SIZE];
+		int fd = fileno( output_file );
+		while( begin < end ) {
+			size_t length = end - begin < (uint64_t )BUFFER_SIZE ? end - begin : (size_t )BUFFER_SIZE;
+			ssize_t read_length = pread( fd, buffer, length, begin );
+			if( read_length == -1 && errno == EINTR ) {
+				continue;
+			}
+			if( read_length <= 0 ) {
+				OUTPUT_ERR( "ERROR: failed reading output file: %d - %s\n", errno, strerror(errno) );
+				ret = RET_ERR;
+				break;
+			}
+			if( RET_OK != socket_output_write( socket_output, buffer, read_length ) ) {
+				ret = RET_ERR;
+				break;
+			}
+			begin += read_length;
+		}
+	}
+	trace_end( "replay", trace_replay );
+	return ret;
+
+error:
+	history_unlock( output_file_mutex, trace_locked );
+	if( snapshot != NULL ) {
+		replay_snapshot_put( snapshot );
+	}
+	return RET_ERR;
+}
+
+static ret_t history_range_callback(void* arg, uint64_t record_offset, const char* data, size_t size)
+{
+	(void )record_offset;
+	history_range_t* range = (history_range_t* )arg;
+	if( range->skip >= size ) {
+		range->skip -= size;
+		return RET_OK;
+	}
+	data += range->skip;
+	size -= range->skip;
+	range->skip = 0;
+	if( size > range->size ) {
+		size = range->size;
+	}
+	range->size -= size;
+	return socket_output_write( range->socket_output, data, size );
+}
+
+/**
+ * Send a packet to the instance which took over the listening socket,
+ * relay its reply.
+ */
+static ret_t history_forward(
+		socket_output_t* socket_output,
+		const char* packet,
+		size_t size
+)
+{
+	ret_t ret = RET_ERR;
+	char buffer[BUFFER_SIZE];
+	int fd = socket( PF_INET, SOCK_STREAM, 0 );
+	if( fd == -1 ) {
+		perror( "socket" );
+		return RET_ERR;
+	}
+	struct sockaddr_in addr;
+	memset( &addr, 0, sizeof(addr) );
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+	addr.sin_port = htons( PORT );
+	if( connect( fd, (struct sockaddr* )&addr, sizeof(addr) ) ) {
+		perror( "connect" );
+		goto end;
+	}
+	while( size > 0 ) {
+		ssize_t sent = send( fd, packet, size, MSG_NOSIGNAL );
+		if( sent == -1 && errno == EINTR ) {
+			continue;
+		}
+		if( sent == -1 ) {
+			perror( "send" );
+			goto end;
+		}
+		packet += sent;
+		size -= sent;
+	}
+	shutdown( fd, SHUT_WR );
+	while( true ) {
+		ssize_t received = recv( fd, buffer, BUFFER_SIZE, 0 );
+		if( received == -1 && errno == EINTR ) {
+			continue;
+		}
+		if( received == -1 ) {
+			perror( "recv" );
+			goto end;
+		}
+		if( received == 0 ) {
+			break;
+		}
+		if( RET_OK != socket_output_write( socket_output, buffer, received ) ) {
+			goto end;
+		}
+	}
+	ret = RET_OK;
+end:
+	close( fd );
+	return ret;
+}
+
+#ifndef USE_AESD_CHAR_DEVICE
+// fill replay cache and packet index with the history left by the previous server:
+static ret_t server_reload_history(
+		FILE* output_file,
+		replay_cache_t* replay_cache,
+		packet_index_t* packet_index
+)
+{
+	char buffer[BUFFER_SIZE];
+	replay_cache_reset( replay_cache, 0 );
+	packet_index_reset( packet_index, 0 );
+	if( fseek( output_file, 0, SEEK_SET ) ) {
+		perror(output_filename);
+		return RET_ERR;
+	}
+	size_t size;
+	size_t packet_size = 0;
+	uint64_t position = 0;
+	while( (size = fread( buffer, sizeof(char), BUFFER_SIZE, output_file )) > 0 ) {
+		replay_cache_append( replay_cache, buffer, size );
+		// packets end with a newline:
+		for( size_t i=0; i<size; i++ ) {
+			packet_size++;
+			if( buffer[i] == '\n' ) {
+				packet_index_append( packet_index, packet_size, position );
+				position += packet_size;
+				packet_size = 0;
+			}
+		}
+	}
+	if( ferror( output_file ) ) {
+		perror(output_filename);
 		return RET_ERR;
 	}
 	return RET_OK;
 }
+#endif
+
+// cut off all connections, so stopping does not wait for idle clients:
+static void server_close_clients(data_t* data)
+{
+	pthread_mutex_lock( &data->thread_list_mutex );
+	thread_info_t* thread_info = NULL;
+	TAILQ_FOREACH(thread_info, &data->thread_list, nodes) {
+		if( !thread_info->thread_finished ) {
+			shutdown( thread_info->socket_fd, SHUT_RDWR );
+		}
+	}
+	pthread_mutex_unlock( &data->thread_list_mutex );
+}
+
+static void server_wait_clients(data_t* data)
+{
+	pthread_mutex_lock( &data->client_count.mutex );
+	while( data->client_count.count > 0 ) {
+		pthread_cond_wait( &data->client_count.idle, &data->client_count.mutex );
+	}
+	pthread_mutex_unlock( &data->client_count.mutex );
+}
+
+// give the connections HANDOFF_DRAIN_TIMEOUT_S to finish, then cut them off:
+static void server_drain_clients(data_t* data)
+{
+	struct timespec deadline;
+	clock_gettime( CLOCK_REALTIME, &deadline );
+	deadline.tv_sec += HANDOFF_DRAIN_TIMEOUT_S;
+	pthread_mutex_lock( &data->client_count.mutex );
+	while( data->client_count.count > 0 ) {
+		if( ETIMEDOUT == pthread_cond_timedwait( &data->client_count.idle, &data->client_count.mutex, &deadline ) ) {
+			OUTPUT_INFO( "closing %u connections left after the restart\n", data->client_count.count );
+			break;
+		}
+	}
+	pthread_mutex_unlock( &data->client_count.mutex );
+	server_close_clients( data );
+	server_wait_clients( data );
+}
+
+// pass sockets and history to the new instance, then finish the connections:
+static ret_t server_handoff(data_t* data)
+{
+	// the connections still running forward their packets from now on:
+	pthread_mutex_lock( &data->output_file_mutex );
+	data->history_handed_off = true;
+	// the new instance recovers the log as soon as it has the sockets,
+	// replays still running read the records until the log is closed:
+	ret_t ret = RET_OK;
+	if( data->wal != NULL ) {
+		ret = wal_stop( data->wal );
+	}
+#ifndef USE_AESD_CHAR_DEVICE
+	if( data->output_file != NULL && fflush( data->output_file ) ) {
+		perror(output_filename);
+		ret = RET_ERR;
+	}
+#endif
+	pthread_mutex_unlock( &data->output_file_mutex );
+	if( RET_OK == ret ) {
+		handoff_fds_t fds = {
+			.socket_fd = data->socket_fd,
+			.control_fd = data->control_fd,
+			.output_fd = -1,
+		};
+#ifndef USE_AESD_CHAR_DEVICE
+		if( data->output_file != NULL ) {
+			fds.output_fd = fileno( data->output_file );
+		}
+#endif
+		ret = handoff_send( data->handoff_fd, &fds );
+	}
+	close( data->handoff_fd );
+	data->handoff_fd = -1;
+	data->handed_off = (RET_OK == ret);
+	if( !data->handed_off ) {
+		// nobody serves forwarded packets, reset the connections queued up:
+		shutdown( data->socket_fd, SHUT_RDWR );
+	}
+	server_drain_clients( data );
+	return ret;
+}
 
 ret_t server_exit(data_t* data)
 {
@@ -580,6 +1661,23 @@ ret_t server_exit(data_t* data)
 		}
 		FREE( data->timer );
 	}
+	if( clock_thread_initialized ) {
+		ret_t* clock_ret;
+		OUTPUT_DEBUG( "join clock_thread\n" );
+		if( pthread_join( clock_thread_fd, (void** )&clock_ret) ) {
+			perror( "pthread_join" );
+		}
+	}
+	// zero downtime restart, the connections finish while the new instance runs:
+	if( data->handoff_fd != -1 ) {
+		if( RET_OK != server_handoff( data ) ) {
+			ret = RET_ERR;
+		}
+	}
+	else {
+		server_close_clients( data );
+		server_wait_clients( data );
+	}
 	if( cleanup_thread_initialized ) {
 		ret_t* cleanup_ret;
 		OUTPUT_DEBUG( "join cleanup_thread\n" );
@@ -588,13 +1686,16 @@ ret_t server_exit(data_t* data)
 			perror( "pthread_join" );
 		}
 	}
-	if( clock_thread_initialized ) {
-		ret_t* clock_ret;
-		OUTPUT_DEBUG( "join clock_thread\n" );
-		if( pthread_join( clock_thread_fd, (void** )&clock_ret) ) {
+	if( history_load_thread_initialized ) {
+		OUTPUT_DEBUG( "join history_load_thread\n" );
+		if( pthread_join( history_load_thread_fd, NULL ) ) {
 			perror( "pthread_join" );
 		}
 	}
+	if( data->control_fd != -1 ) {
+		handoff_close( data->control_fd, data->handed_off );
+		data->control_fd = -1;
+	}
 	// socket:
 	if( data->socket_fd != -1 ) {
 		if( close(data->socket_fd) == -1 ) {
@@ -602,6 +1703,31 @@ ret_t server_exit(data_t* data)
 			ret = RET_ERR;
 		}
 	}
+	// write ahead log:
+	if( data->wal != NULL ) {
+		if( RET_OK != wal_close( data->wal ) ) {
+			ret = RET_ERR;
+		}
+		data->wal = NULL;
+	}
+	if( data->replay_cache != NULL ) {
+		replay_cache_destroy( data->replay_cache );
+		data->replay_cache = NULL;
+	}
+	if( data->packet_index != NULL ) {
+		packet_index_destroy( data->packet_index );
+		data->packet_index = NULL;
+	}
+	if( data->device_io != NULL ) {
+		if( RET_OK != device_io_stop( data->device_io ) ) {
+			ret = RET_ERR;
+		}
+		data->device_io = NULL;
+	}
+	if( data->affinity != NULL ) {
+		affinity_destroy( data->affinity );
+		data->affinity = NULL;
+	}
 	// output file:
 	if( data->output_file != NULL ) {
 		if( 0 != fclose( data->output_file ) ) {
@@ -617,6 +1743,8 @@ ret_t server_exit(data_t* data)
 			ret = RET_ERR;
 		}
 	}
+	pthread_mutex_destroy( &data->client_count.mutex );
+	pthread_cond_destroy( &data->client_count.idle );
 	if( data->thread_finished_signal != NULL ) {
 		if( sem_destroy( data->thread_finished_signal ) ) {
 			perror( "sem_destroy" );
@@ -631,22 +1759,31 @@ ret_t server_exit(data_t* data)
 		}
 		FREE( clock_sem );
 	}
-	// free queue:
+	// join the client threads cleanup_thread has not seen finishing:
 	{
 		thread_info_t * e = NULL;
-		if( !TAILQ_EMPTY(&data->thread_list) ) {
-			OUTPUT_ERR("thread_list is not empty");
-		}
 		while (!TAILQ_EMPTY(&data->thread_list))
 		{
 			e = TAILQ_FIRST(&data->thread_list);
 			TAILQ_REMOVE(&data->thread_list, e, nodes);
-			free(e);
-			e = NULL;
+			if( RET_OK != client_release( e, data->client_pool ) ) {
+				ret = RET_ERR;
+			}
 		}	
 	}
+	if( data->client_pool != NULL ) {
+		client_pool_destroy( data->client_pool );
+		data->client_pool = NULL;
+	}
+	pthread_mutex_destroy( &data->thread_list_mutex );
+	OUTPUT_INFO( "%lu connections, %lu allocations after startup\n",
+		data->connection_count,
+		alloc_stats_count() - data->startup_allocations
+	);
+	server_log_stats();
 #ifndef USE_AESD_CHAR_DEVICE
-	if( unlink( output_filename ) ) {
+	// (the write ahead log is kept, the new server continues the history)
+	if( !data->durable && !data->handed_off && unlink( output_filename ) ) {
 		perror(output_filename);
 		ret = RET_ERR;
 	}
@@ -654,6 +1791,15 @@ ret_t server_exit(data_t* data)
 	return ret;
 }
 
+static void server_log_stats(void)
+{
+	OUTPUT_INFO( "%lu requests, %lu of them allocated (%lu allocations)\n",
+		request_stats.requests,
+		request_stats.allocating_requests,
+		request_stats.request_allocations
+	);
+}
+
 void timer_callback(int sig)
 {
 	if( clock_sem ) {
@@ -1,8 +1,11 @@
 #pragma once
 
+#include "logger.h"
+
 #include <syslog.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdint.h>
 
 // posix threads:
 #include <pthread.h>
@@ -14,11 +17,12 @@
 
 // sockets:
 #include <netinet/in.h>
+#include <arpa/inet.h>
 
 
-#define OUTPUT_ERR(fmt,...) syslog(LOG_ERR, fmt, ## __VA_ARGS__ )
+#define OUTPUT_ERR(fmt,...) logger_log(LOG_ERR, fmt, ## __VA_ARGS__ )
 // #define OUTPUT_ERR(fmt,...) fprintf(stderr, fmt, ## __VA_ARGS__ )
-#define OUTPUT_INFO(fmt,...) syslog(LOG_INFO, fmt, ## __VA_ARGS__ )
+#define OUTPUT_INFO(fmt,...) logger_log(LOG_INFO, fmt, ## __VA_ARGS__ )
 // #define OUTPUT_INFO(fmt,...) fprintf(stdout, fmt, ## __VA_ARGS__ )
 #ifndef DEBUG_OUTPUT
 #define OUTPUT_DEBUG(fmt,...)
@@ -42,17 +46,133 @@ typedef enum {
 	RET_ERR,
 } ret_t;
 
+// when the write ahead log (durable mode) is flushed to disk:
+typedef enum {
+	// before answering each packet:
+	WAL_SYNC_PACKET,
+	// after every wal_config_t.group_size packets:
+	WAL_SYNC_GROUP,
+	// every wal_config_t.interval_ms milliseconds:
+	WAL_SYNC_INTERVAL,
+} wal_sync_policy_t;
+
+typedef struct {
+	wal_sync_policy_t sync_policy;
+	unsigned int group_size;
+	unsigned int interval_ms;
+	// retention, older packets are dropped in the background (0: unlimited):
+	unsigned long long retain_bytes;
+	unsigned long long retain_packets;
+	unsigned long long retain_seconds;
+} wal_config_t;
+
+// which cpus client threads run on:
+typedef enum {
+	// no pinning:
+	PLACEMENT_NONE,
+	// round robin, one cpu per connection:
+	PLACEMENT_SPREAD,
+	// the cpu which received the connection (NIC rx queue), spread if unknown:
+	PLACEMENT_INCOMING,
+	// all cpus on the NUMA node of the cpu which received the connection:
+	PLACEMENT_NODE,
+} placement_t;
+
+typedef struct {
+	placement_t placement;
+	// cpu list like "0-3,8", NULL: all cpus the process may run on
+	const char* cpus;
+} affinity_config_t;
+
+// range queries, answered with part of the history instead of all of it:
+typedef enum {
+	// "AESDSOCKET_LAST:N", the last N packets:
+	RANGE_LAST,
+	// "AESDSOCKET_PACKETS:A,B", packets [A,B):
+	RANGE_PACKETS,
+	// "AESDSOCKET_BYTES:A,B", bytes [A,B):
+	RANGE_BYTES,
+	// "AESDCHAR_IOCSEEKTO:X,Y" on the file backend,
+	// packet X from byte Y of it on to the end:
+	RANGE_SEEKTO,
+} range_type_t;
+
+typedef struct {
+	range_type_t type;
+	// RANGE_LAST: number of packets in begin
+	uint64_t begin;
+	uint64_t end;
+	// RANGE_SEEKTO: byte within packet begin
+	uint64_t offset;
+} range_query_t;
+
+// small writes to a socket are collected up to:
+#define SOCKET_OUTPUT_SIZE 4096
+// longer packets (including the newline) close the connection:
+#define MAX_PACKET_SIZE (64u*1024*1024)
+
+// reading a socket (see socket_io.h):
+typedef struct {
+	int fd;
+	// kept for the next connection:
+	char* buffer;
+	size_t buffer_size;
+	// received bytes in buffer:
+	size_t fill;
+} socket_input_t;
+
+// writing a socket (see socket_io.h):
+typedef struct {
+	int fd;
+	// SOCKET_OUTPUT_SIZE bytes, kept for the next connection:
+	char* buffer;
+	size_t fill;
+} socket_output_t;
+
+struct wal;
+struct replay_cache;
+struct affinity;
+struct device_io;
+struct client_pool;
+struct packet_index;
+
+// connections being served:
+typedef struct {
+	unsigned int count;
+	pthread_mutex_t mutex;
+	// signaled when count drops to 0:
+	pthread_cond_t idle;
+} client_count_t;
+
 typedef struct thread_info {
 	pthread_t thread_fd;
 	struct sockaddr_in client_addr;
-	FILE* socket_input;
-	FILE* socket_output;
+	// client_addr as text (for logging):
+	char client_name[INET_ADDRSTRLEN];
+	// closed by cleanup_thread once the thread is joined:
+	int socket_fd;
+	socket_input_t socket_input;
+	socket_output_t socket_output;
+	// NUMA node the socket buffers were allocated on, -1 if unpinned:
+	int node;
 	FILE* output_file;
+	// durable mode, replaces output_file:
+	struct wal* wal;
+	// file backend:
+	struct replay_cache* replay_cache;
+	struct packet_index* packet_index;
+	// device backend, replaces output_file:
+	struct device_io* device_io;
 	pthread_mutex_t* output_file_mutex;
+	_Atomic bool* history_handed_off;
 	sem_t* thread_finished_signal;
-	bool thread_finished;
+	client_count_t* client_count;
+	_Atomic bool thread_finished;
 	ret_t ret;
-	// 
+	// tracing, connection number and time of the accept:
+	unsigned long connection;
+	uint64_t trace_accepted;
+	// thread_list, or the free list of the client pool:
 	TAILQ_ENTRY(thread_info) nodes;
 } thread_info_t;
 
@@ -65,12 +185,47 @@ typedef struct {
 	FILE* output_file;
 	pthread_mutex_t output_file_mutex;
 	sem_t* thread_finished_signal;
+	// running client threads, the slots come from client_pool:
 	thread_list_t thread_list;
+	pthread_mutex_t thread_list_mutex;
+	struct client_pool* client_pool;
 	timer_t* timer;
+	// durable mode:
+	bool durable;
+	wal_config_t wal_config;
+	struct wal* wal;
+	// file backend:
+	struct replay_cache* replay_cache;
+	struct packet_index* packet_index;
+	// device backend:
+	struct device_io* device_io;
+	// NULL unless a placement is configured:
+	affinity_config_t affinity_config;
+	struct affinity* affinity;
+	client_count_t client_count;
+	// zero downtime restart:
+	bool takeover;
+	// unix socket accepting takeover requests:
+	int control_fd;
+	// connection of the instance taking over, -1 if none:
+	int handoff_fd;
+	bool handed_off;
+	// set with output_file_mutex held, packets are forwarded to the new instance from then on:
+	_Atomic bool history_handed_off;
+	// statistics:
+	unsigned long connection_count;
+	// allocations made by server_init:
+	unsigned long startup_allocations;
 } data_t;
 
 typedef struct {
 	bool demonize;
+	bool durable;
+	wal_config_t wal_config;
+	affinity_config_t affinity_config;
+	bool takeover;
+	// NULL: no tracing
+	const char* trace_filename;
 } args_t;
 
 /***********************
@@ -81,11 +236,33 @@ void server_zero_data(data_t* data);
 ret_t server_init(data_t* data);
 ret_t server_run(data_t* data);
 ret_t server_exit(data_t* data);
-ret_t server_protocol(
-		FILE* socket_input,
-		FILE* socket_output,
-		FILE* output_file
+ret_t server_protocol_device(
+		socket_input_t* socket_input,
+		socket_output_t* socket_output,
+		struct device_io* device_io
+);
+ret_t server_protocol_file(
+		socket_input_t* socket_input,
+		socket_output_t* socket_output,
+		FILE* output_file,
+		struct wal* wal,
+		pthread_mutex_t* output_file_mutex,
+		_Atomic bool* history_handed_off,
+		struct replay_cache* replay_cache,
+		struct packet_index* packet_index
+);
+/**
+ * The part [*begin, *end) of a history of size items (packets or bytes,
+ * depending on the query) selected by query.
+ */
+void range_query_clamp(
+		const range_query_t* query,
+		uint64_t size,
+		uint64_t* begin,
+		uint64_t* end
 );
 
 // may be called in a interrupt handler:
 void server_stop(data_t* data);
+// log the request statistics, may be called in a interrupt handler:
+void server_request_stats(void);
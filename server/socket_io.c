@@ -0,0 +1,178 @@
+#include "socket_io.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+/***********************
+ * Constants
+ ***********************/
+
+// initial size of the input buffer:
+#define SOCKET_INPUT_SIZE 1024
+// larger input buffers are not kept for the next connection:
+#define SOCKET_INPUT_KEEP_SIZE (64*1024)
+
+/***********************
+ * Function Declarations
+ ***********************/
+
+static ret_t socket_send(
+		int fd,
+		const char* data,
+		size_t size
+);
+
+/***********************
+ * Function Definitions
+ ***********************/
+
+void socket_input_reset(
+		socket_input_t* input,
+		int fd
+)
+{
+	if( input->buffer_size > SOCKET_INPUT_KEEP_SIZE ) {
+		socket_input_free( input );
+	}
+	input->fd = fd;
+	input->fill = 0;
+}
+
+void socket_input_free(socket_input_t* input)
+{
+	FREE( input->buffer );
+	input->buffer_size = 0;
+	input->fill = 0;
+}
+
+ssize_t socket_input_receive(
+		socket_input_t* input,
+		char** packet
+)
+{
+	while( true ) {
+		// (one byte is left for the terminating NUL)
+		if( input->fill + 1 >= input->buffer_size ) {
+			// no newline in the first MAX_PACKET_SIZE bytes:
+			if( input->fill >= MAX_PACKET_SIZE ) {
+				OUTPUT_ERR( "packet exceeds %u bytes\n", MAX_PACKET_SIZE );
+				return -1;
+			}
+			size_t size = input->buffer_size ? 2 * input->buffer_size : SOCKET_INPUT_SIZE;
+			if( size > MAX_PACKET_SIZE + 1 ) {
+				size = MAX_PACKET_SIZE + 1;
+			}
+			char* buffer = realloc( input->buffer, size );
+			if( buffer == NULL ) {
+				perror( "realloc" );
+				return -1;
+			}
+			input->buffer = buffer;
+			input->buffer_size = size;
+		}
+		ssize_t ret = recv(
+				input->fd,
+				&input->buffer[input->fill],
+				input->buffer_size - input->fill - 1,
+				0
+		);
+		if( ret == -1 ) {
+			if( errno == EINTR ) {
+				continue;
+			}
+			OUTPUT_ERR( "error reading socket\n" );
+			return -1;
+		}
+		if( ret == 0 ) {
+			// incomplete packets are never stored:
+			OUTPUT_ERR( "missing newline\n" );
+			return -1;
+		}
+		char* newline = memchr( &input->buffer[input->fill], '\n', ret );
+		input->fill += ret;
+		if( newline != NULL ) {
+			// (anything the client sent after the packet is ignored)
+			ssize_t length = newline - input->buffer + 1;
+			input->buffer[length] = '\0';
+			(*packet) = input->buffer;
+			OUTPUT_DEBUG( "received %zd bytes\n", length );
+			return length;
+		}
+	}
+}
+
+ret_t socket_output_reset(
+		socket_output_t* output,
+		int fd
+)
+{
+	output->fd = fd;
+	output->fill = 0;
+	if( output->buffer == NULL ) {
+		output->buffer = malloc( SOCKET_OUTPUT_SIZE );
+		if( output->buffer == NULL ) {
+			perror( "malloc" );
+			return RET_ERR;
+		}
+	}
+	return RET_OK;
+}
+
+void socket_output_free(socket_output_t* output)
+{
+	FREE( output->buffer );
+	output->fill = 0;
+}
+
+ret_t socket_output_write(
+		socket_output_t* output,
+		const char* data,
+		size_t size
+)
+{
+	if( output->fill + size <= SOCKET_OUTPUT_SIZE ) {
+		memcpy( &output->buffer[output->fill], data, size );
+		output->fill += size;
+		return RET_OK;
+	}
+	if( RET_OK != socket_output_flush( output ) ) {
+		return RET_ERR;
+	}
+	if( size < SOCKET_OUTPUT_SIZE ) {
+		memcpy( output->buffer, data, size );
+		output->fill = size;
+		return RET_OK;
+	}
+	return socket_send( output->fd, data, size );
+}
+
+ret_t socket_output_flush(socket_output_t* output)
+{
+	ret_t ret = socket_send( output->fd, output->buffer, output->fill );
+	output->fill = 0;
+	return ret;
+}
+
+static ret_t socket_send(
+		int fd,
+		const char* data,
+		size_t size
+)
+{
+	while( size > 0 ) {
+		// a client which closed its connection must not kill the server:
+		ssize_t ret = send( fd, data, size, MSG_NOSIGNAL );
+		if( ret == -1 ) {
+			if( errno == EINTR ) {
+				continue;
+			}
+			OUTPUT_ERR( "ERROR: failed writing to socket\n" );
+			return RET_ERR;
+		}
+		data += ret;
+		size -= ret;
+	}
+	return RET_OK;
+}
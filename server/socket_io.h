@@ -0,0 +1,44 @@
+#pragma once
+
+/*
+ * Socket I/O of the client threads, on the raw fd.
+ *
+ * The buffers belong to the connection slot (see client_pool.h) and are
+ * reused by the next connection instead of a pair of FILE streams per
+ * connection. They are allocated by the client thread, on its NUMA node. Packets are assembled in the input buffer. Small writes
+ * are collected in the output buffer, large ones go to the socket directly.
+ */
+
+#include "server_impl.h"
+
+#include <sys/types.h>
+
+// start reading a new connection, shrinks a buffer grown by a large packet:
+void socket_input_reset(
+		socket_input_t* input,
+		int fd
+);
+void socket_input_free(socket_input_t* input);
+/**
+ * Receive one packet, terminated by a newline.
+ * @return the length of the packet, -1 on error or if it exceeds MAX_PACKET_SIZE
+ * *packet is NUL terminated and valid until the next reset.
+ */
+ssize_t socket_input_receive(
+		socket_input_t* input,
+		char** packet
+);
+
+// start writing a new connection, allocates the buffer unless kept:
+ret_t socket_output_reset(
+		socket_output_t* output,
+		int fd
+);
+void socket_output_free(socket_output_t* output);
+ret_t socket_output_write(
+		socket_output_t* output,
+		const char* data,
+		size_t size
+);
+// send what is still buffered:
+ret_t socket_output_flush(socket_output_t* output);
@@ -0,0 +1,95 @@
+#include "thread_rings.h"
+#include "server_impl.h"
+#include "../aesd-char-driver/aesd-lockfree-ring.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/***********************
+ * Function Declarations
+ ***********************/
+
+static void thread_ring_release(void* void_arg);
+
+/***********************
+ * Function Definitions
+ ***********************/
+
+bool thread_ring_pool_init(
+		thread_ring_pool_t* pool,
+		size_t size,
+		void (*init)(thread_ring_t* ring),
+		void (*acquire)(thread_ring_t* ring)
+)
+{
+	pool->size = size;
+	pool->init = init;
+	pool->acquire = acquire;
+	atomic_init( &pool->rings, NULL );
+	pool->free_rings = NULL;
+	int ret = pthread_key_create( &pool->key, thread_ring_release );
+	if( ret != 0 ) {
+		OUTPUT_ERR( "pthread_key_create: %d - %s\n", ret, strerror(ret) );
+		return false;
+	}
+	pthread_mutex_init( &pool->mutex, NULL );
+	return true;
+}
+
+void thread_ring_pool_destroy(thread_ring_pool_t* pool)
+{
+	pthread_key_delete( pool->key );
+	pthread_mutex_destroy( &pool->mutex );
+}
+
+thread_ring_t* thread_ring_get(thread_ring_pool_t* pool)
+{
+	thread_ring_t* ring = pthread_getspecific( pool->key );
+	if( ring != NULL ) {
+		return ring;
+	}
+	// first use by this thread:
+	pthread_mutex_lock( &pool->mutex );
+	ring = pool->free_rings;
+	if( ring != NULL ) {
+		pool->free_rings = ring->next_free;
+	}
+	pthread_mutex_unlock( &pool->mutex );
+	if( ring == NULL ) {
+		ring = aligned_alloc( AESD_CACHE_LINE_SIZE, pool->size );
+		if( ring == NULL ) {
+			perror( "aligned_alloc" );
+			return NULL;
+		}
+		ring->pool = pool;
+		ring->next_free = NULL;
+		pool->init( ring );
+		// make the ring visible to the consumer:
+		ring->next = atomic_load( &pool->rings );
+		while( !atomic_compare_exchange_weak( &pool->rings, &ring->next, ring ) ) {
+		}
+	}
+	if( pool->acquire != NULL ) {
+		pool->acquire( ring );
+	}
+	pthread_setspecific( pool->key, ring );
+	return ring;
+}
+
+thread_ring_t* thread_ring_first(thread_ring_pool_t* pool)
+{
+	return atomic_load( &pool->rings );
+}
+
+// called on thread exit:
+static void thread_ring_release(void* void_arg)
+{
+	thread_ring_t* ring = (thread_ring_t* )void_arg;
+	thread_ring_pool_t* pool = ring->pool;
+	// pending entries stay in the ring until the consumer gets to them:
+	pthread_mutex_lock( &pool->mutex );
+	ring->next_free = pool->free_rings;
+	pool->free_rings = ring;
+	pthread_mutex_unlock( &pool->mutex );
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+/*
+ * Pool of per-thread rings, shared by logger and trace.
+ *
+ * Every thread gets a ring of its own on first use, a single consumer
+ * thread walks the list of all rings. When a thread exits, its ring
+ * (with whatever is still pending in it) is handed to the next thread.
+ * Rings are kept until the process exits.
+ * A ring is any struct starting with a thread_ring_t.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+typedef struct thread_ring {
+	// list of all rings, never shrinks:
+	struct thread_ring* next;
+	// list of rings not owned by any thread, protected by pool->mutex:
+	struct thread_ring* next_free;
+	struct thread_ring_pool* pool;
+} thread_ring_t;
+
+typedef struct thread_ring_pool {
+	// size of the rings:
+	size_t size;
+	// called for a new ring, before it is visible to the consumer:
+	void (*init)(thread_ring_t* ring);
+	// called whenever a thread takes a ring, may be NULL:
+	void (*acquire)(thread_ring_t* ring);
+	_Atomic(thread_ring_t*) rings;
+	thread_ring_t* free_rings;
+	pthread_mutex_t mutex;
+	// the ring owned by the calling thread:
+	pthread_key_t key;
+} thread_ring_pool_t;
+
+// false on error:
+bool thread_ring_pool_init(
+		thread_ring_pool_t* pool,
+		size_t size,
+		void (*init)(thread_ring_t* ring),
+		void (*acquire)(thread_ring_t* ring)
+);
+// only if no thread uses the pool yet:
+void thread_ring_pool_destroy(thread_ring_pool_t* pool);
+
+// the ring of the calling thread, NULL on error:
+thread_ring_t* thread_ring_get(thread_ring_pool_t* pool);
+// first ring of the list, continue with ring->next:
+thread_ring_t* thread_ring_first(thread_ring_pool_t* pool);
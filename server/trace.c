@@ -0,0 +1,315 @@
+#include "trace.h"
+#include "server_impl.h"
+#include "thread_rings.h"
+#include "../aesd-char-driver/aesd-lockfree-ring.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <stdatomic.h>
+
+/***********************
+ * Constants
+ ***********************/
+
+// pending spans per thread: 2^TRACE_RING_SIZE_LOG2
+#define TRACE_RING_SIZE_LOG2 10
+
+// closes the JSON array, overwritten by the next dump:
+static const char* trace_footer = "\n]\n";
+
+/***********************
+ * Types
+ ***********************/
+
+typedef struct {
+	const char* name;
+	uint64_t begin_ns;
+	uint64_t end_ns;
+	// 0 if the span does not belong to a connection:
+	unsigned long connection;
+	uint32_t tid;
+	// names the thread instead of a span:
+	bool thread_name;
+} trace_span_t;
+
+AESD_SPSC_RING_DECLARE(trace_span_ring, trace_span_t, TRACE_RING_SIZE_LOG2)
+
+typedef struct trace_ring {
+	// (first, the rings are handed out by ring_pool)
+	thread_ring_t thread_ring;
+	// producer: the owning thread, consumer: the dump thread
+	struct trace_span_ring spans;
+	// only used by the owning thread:
+	uint32_t tid;
+	unsigned long connection;
+	// spans dropped since the last dump:
+	_Atomic unsigned long dropped;
+} trace_ring_t;
+
+/***********************
+ * Global Data
+ ***********************/
+
+static _Atomic bool running = false;
+
+static pthread_t dump_thread_fd;
+static sem_t dump_sem;
+// only used by the dump thread (and trace_start/trace_stop):
+static FILE* trace_file = NULL;
+static int trace_pid;
+
+static thread_ring_pool_t ring_pool;
+
+/***********************
+ * Function Declarations
+ ***********************/
+
+static uint64_t trace_now(void);
+static void trace_push(const trace_span_t* span);
+static void trace_init_ring(thread_ring_t* thread_ring);
+static void trace_acquire_ring(thread_ring_t* thread_ring);
+static void* trace_dump_thread(void* void_arg);
+static void trace_dump(void);
+static void trace_write_span(const trace_span_t* span);
+
+/***********************
+ * Function Definitions
+ ***********************/
+
+bool trace_start(const char* filename)
+{
+	trace_file = fopen( filename, "w" );
+	if( trace_file == NULL ) {
+		perror( filename );
+		return false;
+	}
+	trace_pid = getpid();
+	fprintf( trace_file,
+			"[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"aesdsocket\"}}%s",
+			trace_pid, trace_footer
+	);
+	fflush( trace_file );
+	if( sem_init( &dump_sem, 0, 0 ) ) {
+		perror( "sem_init" );
+		goto error;
+	}
+	if( !thread_ring_pool_init( &ring_pool, sizeof(trace_ring_t), trace_init_ring, trace_acquire_ring ) ) {
+		sem_destroy( &dump_sem );
+		goto error;
+	}
+	atomic_store( &running, true );
+	{
+		int ret = pthread_create(
+				&dump_thread_fd,
+				0,
+				trace_dump_thread,
+				NULL
+		);
+		if( ret != 0 ) {
+			atomic_store( &running, false );
+			OUTPUT_ERR( "pthread_create: %d - %s\n", ret, strerror(ret) );
+			thread_ring_pool_destroy( &ring_pool );
+			sem_destroy( &dump_sem );
+			goto error;
+		}
+	}
+	return true;
+
+error:
+	fclose( trace_file );
+	trace_file = NULL;
+	return false;
+}
+
+void trace_stop(void)
+{
+	if( !atomic_exchange( &running, false ) ) {
+		return;
+	}
+	sem_post( &dump_sem );
+	if( pthread_join( dump_thread_fd, NULL ) ) {
+		perror( "pthread_join" );
+	}
+	sem_destroy( &dump_sem );
+	if( fclose( trace_file ) ) {
+		perror( "fclose" );
+	}
+	trace_file = NULL;
+}
+
+void trace_request_dump(void)
+{
+	if( atomic_load( &running ) ) {
+		sem_post( &dump_sem );
+	}
+}
+
+uint64_t trace_begin(void)
+{
+	if( !atomic_load_explicit( &running, memory_order_relaxed ) ) {
+		return 0;
+	}
+	return trace_now();
+}
+
+void trace_end(const char* name, uint64_t begin)
+{
+	if( begin == 0 ) {
+		return;
+	}
+	trace_span_t span = {
+		.name = name,
+		.begin_ns = begin,
+		.end_ns = trace_now(),
+		.thread_name = false,
+	};
+	trace_push( &span );
+}
+
+void trace_thread_name(const char* name)
+{
+	if( !atomic_load_explicit( &running, memory_order_relaxed ) ) {
+		return;
+	}
+	trace_span_t span = {
+		.name = name,
+		.thread_name = true,
+	};
+	trace_push( &span );
+}
+
+void trace_connection(unsigned long connection)
+{
+	if( !atomic_load_explicit( &running, memory_order_relaxed ) ) {
+		return;
+	}
+	trace_ring_t* ring = (trace_ring_t* )thread_ring_get( &ring_pool );
+	if( ring != NULL ) {
+		ring->connection = connection;
+	}
+}
+
+static uint64_t trace_now(void)
+{
+	struct timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return (uint64_t )now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static void trace_push(const trace_span_t* span)
+{
+	trace_ring_t* ring = (trace_ring_t* )thread_ring_get( &ring_pool );
+	if( ring == NULL ) {
+		return;
+	}
+	trace_span_t entry = (*span);
+	entry.tid = ring->tid;
+	entry.connection = ring->connection;
+	if( !trace_span_ring_push( &ring->spans, &entry ) ) {
+		atomic_fetch_add_explicit( &ring->dropped, 1, memory_order_relaxed );
+	}
+}
+
+// called for the first span of a thread, unless it inherits a ring:
+static void trace_init_ring(thread_ring_t* thread_ring)
+{
+	trace_ring_t* ring = (trace_ring_t* )thread_ring;
+	trace_span_ring_init( &ring->spans );
+	atomic_init( &ring->dropped, 0 );
+}
+
+// called for the first span of a thread:
+static void trace_acquire_ring(thread_ring_t* thread_ring)
+{
+	trace_ring_t* ring = (trace_ring_t* )thread_ring;
+	ring->tid = syscall( SYS_gettid );
+	ring->connection = 0;
+}
+
+static void* trace_dump_thread(void* void_arg)
+{
+	(void )void_arg;
+	while( true ) {
+		if( sem_wait( &dump_sem ) ) {
+			if( errno == EINTR ) {
+				continue;
+			}
+			perror( "sem_wait" );
+			break;
+		}
+		bool stop = !atomic_load( &running );
+		trace_dump();
+		if( stop ) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+static void trace_dump(void)
+{
+	// continue the JSON array:
+	if( fseek( trace_file, -(long )strlen( trace_footer ), SEEK_END ) ) {
+		perror( "fseek" );
+		return;
+	}
+	unsigned long count = 0;
+	for(
+			thread_ring_t* thread_ring = thread_ring_first( &ring_pool );
+			thread_ring != NULL;
+			thread_ring = thread_ring->next
+	) {
+		trace_ring_t* ring = (trace_ring_t* )thread_ring;
+		trace_span_t span;
+		while( trace_span_ring_pop( &ring->spans, &span ) ) {
+			trace_write_span( &span );
+			count++;
+		}
+		unsigned long dropped = atomic_exchange_explicit( &ring->dropped, 0, memory_order_relaxed );
+		if( dropped != 0 ) {
+			uint64_t now = trace_now();
+			fprintf( trace_file,
+					",\n{\"name\":\"%lu spans dropped\",\"ph\":\"i\",\"s\":\"p\",\"ts\":%llu.%03llu,\"pid\":%d,\"tid\":%d}",
+					dropped,
+					(unsigned long long )(now / 1000), (unsigned long long )(now % 1000),
+					trace_pid, trace_pid
+			);
+		}
+	}
+	fputs( trace_footer, trace_file );
+	if( fflush( trace_file ) ) {
+		perror( "fflush" );
+		return;
+	}
+	OUTPUT_INFO( "trace: %lu spans dumped\n", count );
+}
+
+static void trace_write_span(const trace_span_t* span)
+{
+	if( span->thread_name ) {
+		fprintf( trace_file,
+				",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+				trace_pid, span->tid, span->name
+		);
+		return;
+	}
+	// timestamps in microseconds:
+	uint64_t duration = span->end_ns - span->begin_ns;
+	fprintf( trace_file,
+			",\n{\"name\":\"%s\",\"cat\":\"aesdsocket\",\"ph\":\"X\",\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,\"pid\":%d,\"tid\":%u",
+			span->name,
+			(unsigned long long )(span->begin_ns / 1000), (unsigned long long )(span->begin_ns % 1000),
+			(unsigned long long )(duration / 1000), (unsigned long long )(duration % 1000),
+			trace_pid, span->tid
+	);
+	if( span->connection != 0 ) {
+		fprintf( trace_file, ",\"args\":{\"connection\":%lu}", span->connection );
+	}
+	fputs( "}", trace_file );
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+/*
+ * Opt-in request tracing (--trace).
+ *
+ * Threads record the phases of the requests they serve as spans into a
+ * ring buffer of their own (single producer, single consumer, no locks).
+ * On SIGUSR1 and when the server exits, a background thread drains all
+ * rings into a file in Chrome trace event format (JSON array), which can
+ * be opened with chrome://tracing or ui.perfetto.dev.
+ * Every dump appends the spans recorded since the previous one, the file
+ * is valid JSON after each dump. Spans which don't fit in a full ring
+ * are dropped, the number of dropped spans shows up as an instant event.
+ * While tracing is off, trace_begin is a single atomic load.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// start the dump thread, dumps go to filename, false on error:
+bool trace_start(const char* filename);
+// dump the pending spans and stop the dump thread:
+void trace_stop(void);
+// ask for a dump, async signal safe:
+void trace_request_dump(void);
+
+// start of a span, 0 while tracing is off:
+uint64_t trace_begin(void);
+// record the span [begin, now) of the calling thread,
+// name must be a string literal (it is only dumped later):
+void trace_end(const char* name, uint64_t begin);
+// name of the calling thread in the trace, a string literal:
+void trace_thread_name(const char* name);
+// spans of the calling thread belong to this connection from now on:
+void trace_connection(unsigned long connection);
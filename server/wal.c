@@ -0,0 +1,1095 @@
+// logs may grow beyond 2GB on 32 bit targets:
+#define _FILE_OFFSET_BITS 64
+// fallocate:
+#define _GNU_SOURCE
+
+#include "wal.h"
+#include "socket_io.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/***********************
+ * File Layout
+ ***********************/
+
+// [checkpoint slot 0][checkpoint slot 1] ... [record 0][record 1]...
+//
+// Checkpoints are written alternately to the two slots, so a torn
+// checkpoint write leaves the previous one intact.
+// Records start at WAL_DATA_START.
+// Records dropped by the retention policy are punched out of the file,
+// offsets of the remaining records never change.
+//
+// Record index (filename + WAL_INDEX_SUFFIX):
+// [entry of record 0][entry of record 1]...
+//
+// The entry of a record is written along with the record and flushed
+// before the checkpoint covering it, so a restart finds the offsets of
+// all checkpointed records without reading them. Entries of dropped
+// records are punched out, too.
+
+#define WAL_MAGIC 0x314c415744534541ull // "AESDWAL1"
+#define WAL_VERSION 2
+#define WAL_CHECKPOINT_SLOT_SIZE 512
+#define WAL_DATA_START 4096
+#define WAL_MAX_RECORD_SIZE MAX_PACKET_SIZE
+#define WAL_READ_BUFFER_SIZE (64*1024)
+#define WAL_COMPACT_INTERVAL_MS 1000
+#define WAL_INDEX_SUFFIX ".idx"
+
+typedef struct {
+	uint64_t magic;
+	uint32_t version;
+	// crc32 of the checkpoint with crc set to 0:
+	uint32_t crc;
+	// incremented with every checkpoint, the newest valid slot wins:
+	uint64_t generation;
+	// all records before end_offset are on disk:
+	uint64_t record_count;
+	uint64_t end_offset;
+	// first record not dropped by the retention policy:
+	uint64_t start_record;
+	uint64_t start_offset;
+} wal_checkpoint_t;
+
+typedef struct {
+	uint32_t size;
+	// crc32 of size, time and payload:
+	uint32_t crc;
+	// seconds since the epoch:
+	int64_t time;
+} wal_record_header_t;
+
+typedef struct {
+	uint64_t offset;
+	uint32_t size;
+	// crc32 of offset and size:
+	uint32_t crc;
+} wal_index_entry_t;
+
+typedef struct {
+	const char* payload;
+	uint32_t size;
+	int64_t time;
+} wal_record_t;
+
+/***********************
+ * Types
+ ***********************/
+
+struct wal {
+	int fd;
+	// record index:
+	int index_fd;
+	wal_config_t config;
+	// protects everything below:
+	pthread_mutex_t mutex;
+	// appended:
+	uint64_t record_count;
+	uint64_t end_offset;
+	// on disk:
+	uint64_t synced_record_count;
+	uint64_t synced_offset;
+	uint64_t checkpoint_generation;
+	// retained:
+	uint64_t start_record;
+	uint64_t start_offset;
+	// readers of the current and the previous epoch,
+	// the epoch is advanced whenever start_offset moves:
+	uint64_t epoch;
+	unsigned int epoch_readers[2];
+	// (start_offset of the previous epoch, not punched yet)
+	uint64_t punch_offset;
+	uint64_t punched_offset;
+	uint64_t punch_record;
+	uint64_t punched_record;
+	// WAL_SYNC_INTERVAL:
+	bool sync_thread_initialized;
+	pthread_t sync_thread_fd;
+	// retention:
+	bool compact_thread_initialized;
+	pthread_t compact_thread_fd;
+	// wakes the background threads for stopping:
+	pthread_cond_t sync_cond;
+	// no appends once set:
+	bool stop;
+};
+
+// sequential, buffered reading of records:
+typedef struct {
+	int fd;
+	// file offset of buffer[0]:
+	uint64_t offset;
+	// stop reading here:
+	uint64_t end_offset;
+	char* buffer;
+	size_t buffer_size;
+	// bytes in buffer:
+	size_t fill;
+	// read position in buffer:
+	size_t pos;
+} wal_reader_t;
+
+/***********************
+ * Function Declarations
+ ***********************/
+
+static uint32_t wal_crc32(uint32_t crc, const void* data, size_t size);
+static uint32_t wal_record_crc(const wal_record_header_t* header, const char* payload);
+static uint32_t wal_index_entry_crc(const wal_index_entry_t* entry);
+static bool wal_retention_enabled(const wal_config_t* config);
+
+static ret_t wal_recover(wal_t* wal, uint64_t file_size);
+static ret_t wal_read_checkpoint(wal_t* wal, wal_checkpoint_t* checkpoint);
+static ret_t wal_write_checkpoint(wal_t* wal);
+static ret_t wal_write_index_entry(wal_t* wal, uint64_t record_number, uint64_t record_offset, uint32_t size);
+
+static ret_t wal_reader_init(wal_reader_t* reader, int fd, uint64_t offset, uint64_t end_offset);
+static void wal_reader_exit(wal_reader_t* reader);
+static int wal_reader_next(wal_reader_t* reader, wal_record_t* record);
+static uint64_t wal_reader_offset(wal_reader_t* reader);
+
+static ret_t wal_replay_callback(void* arg, uint64_t record_offset, const char* data, size_t size);
+
+static void* wal_sync_thread(void* void_arg);
+static bool wal_wait(wal_t* wal, unsigned int timeout_ms);
+
+static void wal_read_begin(wal_t* wal, uint64_t* epoch, uint64_t* start_record, uint64_t* start_offset, uint64_t* end_record, uint64_t* end_offset);
+static void wal_read_end(wal_t* wal, uint64_t epoch);
+
+static void* wal_compact_thread(void* void_arg);
+static ret_t wal_compact(wal_t* wal);
+
+/***********************
+ * Function Definitions
+ ***********************/
+
+wal_t* wal_open(
+		const char* filename,
+		const wal_config_t* config
+)
+{
+	wal_t* wal = malloc( sizeof(wal_t) );
+	if( wal == NULL ) {
+		perror( "malloc" );
+		return NULL;
+	}
+	(*wal) = (wal_t ){
+		.fd = -1,
+		.index_fd = -1,
+		.config = (*config),
+	};
+	pthread_mutex_init( &wal->mutex, NULL );
+	{
+		pthread_condattr_t attr;
+		pthread_condattr_init( &attr );
+		pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+		pthread_cond_init( &wal->sync_cond, &attr );
+		pthread_condattr_destroy( &attr );
+	}
+	wal->fd = open( filename, O_RDWR | O_CREAT, 0644 );
+	if( wal->fd == -1 ) {
+		perror( filename );
+		goto error;
+	}
+	{
+		char index_filename[strlen( filename ) + sizeof(WAL_INDEX_SUFFIX)];
+		snprintf( index_filename, sizeof(index_filename), "%s%s", filename, WAL_INDEX_SUFFIX );
+		wal->index_fd = open( index_filename, O_RDWR | O_CREAT, 0644 );
+		if( wal->index_fd == -1 ) {
+			perror( index_filename );
+			goto error;
+		}
+	}
+	struct stat stat_buf;
+	if( fstat( wal->fd, &stat_buf ) ) {
+		perror( filename );
+		goto error;
+	}
+	wal->punched_offset = WAL_DATA_START;
+	if( stat_buf.st_size == 0 ) {
+		OUTPUT_INFO( "%s: new log\n", filename );
+		wal->end_offset = WAL_DATA_START;
+		wal->synced_offset = WAL_DATA_START;
+		wal->start_offset = WAL_DATA_START;
+		if(
+				ftruncate( wal->fd, WAL_DATA_START )
+				|| ftruncate( wal->index_fd, 0 )
+				|| RET_OK != wal_write_checkpoint( wal )
+				|| fsync( wal->fd )
+		) {
+			perror( filename );
+			goto error;
+		}
+	}
+	else if( RET_OK != wal_recover( wal, stat_buf.st_size ) ) {
+		OUTPUT_ERR( "ERROR: %s: recovery failed\n", filename );
+		goto error;
+	}
+	if( wal->config.sync_policy == WAL_SYNC_INTERVAL ) {
+		int ret = pthread_create(
+				&wal->sync_thread_fd,
+				0,
+				wal_sync_thread,
+				wal
+		);
+		if( ret != 0 ) {
+			OUTPUT_ERR( "pthread_create: %d - %s\n", ret, strerror(ret) );
+			goto error;
+		}
+		wal->sync_thread_initialized = true;
+	}
+	if( wal_retention_enabled( &wal->config ) ) {
+		int ret = pthread_create(
+				&wal->compact_thread_fd,
+				0,
+				wal_compact_thread,
+				wal
+		);
+		if( ret != 0 ) {
+			OUTPUT_ERR( "pthread_create: %d - %s\n", ret, strerror(ret) );
+			goto error;
+		}
+		wal->compact_thread_initialized = true;
+	}
+	return wal;
+
+error:
+	if( wal->sync_thread_initialized ) {
+		pthread_mutex_lock( &wal->mutex );
+		wal->stop = true;
+		pthread_cond_broadcast( &wal->sync_cond );
+		pthread_mutex_unlock( &wal->mutex );
+		pthread_join( wal->sync_thread_fd, NULL );
+	}
+	if( wal->fd != -1 ) {
+		close( wal->fd );
+	}
+	if( wal->index_fd != -1 ) {
+		close( wal->index_fd );
+	}
+	pthread_cond_destroy( &wal->sync_cond );
+	pthread_mutex_destroy( &wal->mutex );
+	FREE( wal );
+	return NULL;
+}
+
+ret_t wal_append(
+		wal_t* wal,
+		const char* data,
+		size_t size,
+		uint64_t* record_offset
+)
+{
+	if( size > WAL_MAX_RECORD_SIZE ) {
+		OUTPUT_ERR( "ERROR: packet of %zu bytes exceeds the maximum record size\n", size );
+		return RET_ERR;
+	}
+	wal_record_header_t header = {
+		.size = size,
+		.time = time(NULL),
+	};
+	header.crc = wal_record_crc( &header, data );
+	struct iovec iov[2] = {
+		{ .iov_base = &header, .iov_len = sizeof(header) },
+		{ .iov_base = (void* )data, .iov_len = size },
+	};
+	const ssize_t record_size = sizeof(header) + size;
+	bool sync = false;
+	pthread_mutex_lock( &wal->mutex );
+	if( wal->stop ) {
+		OUTPUT_ERR( "ERROR: the log has been stopped\n" );
+		pthread_mutex_unlock( &wal->mutex );
+		return RET_ERR;
+	}
+	{
+		ssize_t written = pwritev( wal->fd, iov, 2, wal->end_offset );
+		if( written != record_size ) {
+			OUTPUT_ERR( "ERROR: failed appending to log: %d - %s\n", errno, strerror(errno) );
+			// never leave a partial record behind:
+			if( ftruncate( wal->fd, wal->end_offset ) ) {
+				perror( "ftruncate" );
+			}
+			pthread_mutex_unlock( &wal->mutex );
+			return RET_ERR;
+		}
+		// (a record without index entry would be lost to the next restart)
+		if( RET_OK != wal_write_index_entry( wal, wal->record_count, wal->end_offset, size ) ) {
+			if( ftruncate( wal->fd, wal->end_offset ) ) {
+				perror( "ftruncate" );
+			}
+			pthread_mutex_unlock( &wal->mutex );
+			return RET_ERR;
+		}
+		(*record_offset) = wal->end_offset;
+		wal->end_offset += record_size;
+		wal->record_count++;
+		switch( wal->config.sync_policy ) {
+			case WAL_SYNC_PACKET:
+				sync = true;
+			break;
+			case WAL_SYNC_GROUP:
+				sync = (wal->record_count - wal->synced_record_count >= wal->config.group_size);
+			break;
+			case WAL_SYNC_INTERVAL:
+			break;
+		}
+	}
+	pthread_mutex_unlock( &wal->mutex );
+	if( sync ) {
+		return wal_sync( wal );
+	}
+	return RET_OK;
+}
+
+ret_t wal_sync(wal_t* wal)
+{
+	pthread_mutex_lock( &wal->mutex );
+	const uint64_t record_count = wal->record_count;
+	const uint64_t end_offset = wal->end_offset;
+	const bool synced = (end_offset == wal->synced_offset);
+	pthread_mutex_unlock( &wal->mutex );
+	if( synced ) {
+		return RET_OK;
+	}
+	// appends may continue while flushing,
+	// everything up to end_offset (and its index entries) is on disk afterwards:
+	if( fdatasync( wal->fd ) || fdatasync( wal->index_fd ) ) {
+		perror( "fdatasync" );
+		return RET_ERR;
+	}
+	ret_t ret = RET_OK;
+	pthread_mutex_lock( &wal->mutex );
+	if( end_offset > wal->synced_offset ) {
+		wal->synced_offset = end_offset;
+		wal->synced_record_count = record_count;
+		// not flushed itself: losing it only makes the next recovery scan longer:
+		ret = wal_write_checkpoint( wal );
+	}
+	pthread_mutex_unlock( &wal->mutex );
+	return ret;
+}
+
+ret_t wal_read(
+		wal_t* wal,
+		wal_read_callback_t callback,
+		void* arg
+)
+{
+	return wal_read_range( wal, 0, 0, UINT64_MAX, callback, arg );
+}
+
+ret_t wal_read_range(
+		wal_t* wal,
+		uint64_t first_record,
+		uint64_t first_offset,
+		uint64_t end_record,
+		wal_read_callback_t callback,
+		void* arg
+)
+{
+	uint64_t epoch, record_number, start_offset, last_record, end_offset;
+	wal_read_begin( wal, &epoch, &record_number, &start_offset, &last_record, &end_offset );
+	if( first_record != 0 && first_record < record_number ) {
+		OUTPUT_ERR( "ERROR: records dropped by the retention policy\n" );
+		wal_read_end( wal, epoch );
+		return RET_ERR;
+	}
+	// (not dropped, so the record has not been punched)
+	if( first_offset != 0 ) {
+		if( first_offset < start_offset || first_offset > end_offset ) {
+			OUTPUT_ERR( "ERROR: invalid record offset %llu\n", (unsigned long long )first_offset );
+			wal_read_end( wal, epoch );
+			return RET_ERR;
+		}
+		start_offset = first_offset;
+		record_number = first_record;
+	}
+	wal_reader_t reader;
+	if( RET_OK != wal_reader_init( &reader, wal->fd, start_offset, end_offset ) ) {
+		wal_read_end( wal, epoch );
+		return RET_ERR;
+	}
+	ret_t ret = RET_OK;
+	wal_record_t record;
+	int next_ret = 0;
+	for( ; record_number < end_record; record_number++ ) {
+		const uint64_t record_offset = wal_reader_offset( &reader );
+		next_ret = wal_reader_next( &reader, &record );
+		if( next_ret != 1 ) {
+			break;
+		}
+		if( record_number < first_record ) {
+			continue;
+		}
+		if( RET_OK != callback( arg, record_offset, record.payload, record.size ) ) {
+			ret = RET_ERR;
+			break;
+		}
+	}
+	if( next_ret == -1 ) {
+		OUTPUT_ERR( "ERROR: corrupt log record at offset %llu\n",
+				(unsigned long long )wal_reader_offset( &reader )
+		);
+		ret = RET_ERR;
+	}
+	wal_reader_exit( &reader );
+	wal_read_end( wal, epoch );
+	return ret;
+}
+
+ret_t wal_read_index(
+		wal_t* wal,
+		uint64_t end_record,
+		wal_index_callback_t callback,
+		void* arg
+)
+{
+	uint64_t epoch, record_number, record_offset, last_record, end_offset;
+	wal_read_begin( wal, &epoch, &record_number, &record_offset, &last_record, &end_offset );
+	if( end_record > last_record ) {
+		end_record = last_record;
+	}
+	wal_index_entry_t* entries = malloc( WAL_READ_BUFFER_SIZE );
+	if( entries == NULL ) {
+		perror( "malloc" );
+		wal_read_end( wal, epoch );
+		return RET_ERR;
+	}
+	ret_t ret = RET_OK;
+	while( ret == RET_OK && record_number < end_record ) {
+		size_t count = WAL_READ_BUFFER_SIZE / sizeof(wal_index_entry_t);
+		if( count > end_record - record_number ) {
+			count = end_record - record_number;
+		}
+		const size_t size = count * sizeof(wal_index_entry_t);
+		ssize_t read_ret = pread( wal->index_fd, entries, size, record_number * sizeof(wal_index_entry_t) );
+		if( read_ret == -1 && errno == EINTR ) {
+			continue;
+		}
+		if( read_ret != (ssize_t )size ) {
+			OUTPUT_ERR( "ERROR: failed reading the record index\n" );
+			ret = RET_ERR;
+			break;
+		}
+		// entries must describe the records back to back:
+		for( size_t i=0; i<count; i++, record_number++ ) {
+			const wal_index_entry_t* entry = &entries[i];
+			if(
+					entry->crc != wal_index_entry_crc( entry )
+					|| entry->offset != record_offset
+					|| entry->size > WAL_MAX_RECORD_SIZE
+			) {
+				OUTPUT_ERR( "ERROR: corrupt record index entry %llu\n", (unsigned long long )record_number );
+				ret = RET_ERR;
+				break;
+			}
+			if( RET_OK != callback( arg, record_number, entry->offset, entry->size ) ) {
+				ret = RET_ERR;
+				break;
+			}
+			record_offset += sizeof(wal_record_header_t) + entry->size;
+		}
+	}
+	if( ret == RET_OK && end_record == last_record && record_offset != end_offset ) {
+		OUTPUT_ERR( "ERROR: the record index does not end with the log\n" );
+		ret = RET_ERR;
+	}
+	FREE( entries );
+	wal_read_end( wal, epoch );
+	return ret;
+}
+
+static ret_t wal_replay_callback(void* arg, uint64_t record_offset, const char* data, size_t size)
+{
+	(void )record_offset;
+	return socket_output_write( (socket_output_t* )arg, data, size );
+}
+
+ret_t wal_replay(
+		wal_t* wal,
+		socket_output_t* output
+)
+{
+	return wal_read( wal, wal_replay_callback, output );
+}
+
+/**
+ * @return the number of retained records
+ */
+uint64_t wal_record_count(wal_t* wal)
+{
+	pthread_mutex_lock( &wal->mutex );
+	uint64_t record_count = wal->record_count - wal->start_record;
+	pthread_mutex_unlock( &wal->mutex );
+	return record_count;
+}
+
+uint64_t wal_end_record(wal_t* wal)
+{
+	pthread_mutex_lock( &wal->mutex );
+	uint64_t end_record = wal->record_count;
+	pthread_mutex_unlock( &wal->mutex );
+	return end_record;
+}
+
+bool wal_has_retention(wal_t* wal)
+{
+	return wal_retention_enabled( &wal->config );
+}
+
+uint64_t wal_start_record(wal_t* wal)
+{
+	pthread_mutex_lock( &wal->mutex );
+	uint64_t start_record = wal->start_record;
+	pthread_mutex_unlock( &wal->mutex );
+	return start_record;
+}
+
+ret_t wal_stop(wal_t* wal)
+{
+	pthread_mutex_lock( &wal->mutex );
+	const bool stopped = wal->stop;
+	wal->stop = true;
+	pthread_cond_broadcast( &wal->sync_cond );
+	pthread_mutex_unlock( &wal->mutex );
+	if( stopped ) {
+		return RET_OK;
+	}
+	if( wal->sync_thread_initialized ) {
+		if( pthread_join( wal->sync_thread_fd, NULL ) ) {
+			perror( "pthread_join" );
+		}
+		wal->sync_thread_initialized = false;
+	}
+	if( wal->compact_thread_initialized ) {
+		if( pthread_join( wal->compact_thread_fd, NULL ) ) {
+			perror( "pthread_join" );
+		}
+		wal->compact_thread_initialized = false;
+	}
+	ret_t ret = RET_OK;
+	if( RET_OK != wal_sync( wal ) ) {
+		ret = RET_ERR;
+	}
+	// make the final checkpoint durable, the next start does not need to scan:
+	if( fsync( wal->fd ) ) {
+		perror( "fsync" );
+		ret = RET_ERR;
+	}
+	return ret;
+}
+
+ret_t wal_close(wal_t* wal)
+{
+	ret_t ret = wal_stop( wal );
+	if( close( wal->fd ) || close( wal->index_fd ) ) {
+		perror( "close" );
+		ret = RET_ERR;
+	}
+	pthread_cond_destroy( &wal->sync_cond );
+	pthread_mutex_destroy( &wal->mutex );
+	FREE( wal );
+	return ret;
+}
+
+/***********************
+ * Recovery
+ ***********************/
+
+/**
+ * Start from the newest checkpoint and verify the records after it.
+ * A torn or corrupt record ends the log, it is truncated there.
+ * The index entries of the verified records are written again.
+ */
+static ret_t wal_recover(wal_t* wal, uint64_t file_size)
+{
+	wal_checkpoint_t checkpoint;
+	if( RET_OK != wal_read_checkpoint( wal, &checkpoint ) ) {
+		OUTPUT_ERR( "ERROR: not a log file or no valid checkpoint\n" );
+		return RET_ERR;
+	}
+	wal->checkpoint_generation = checkpoint.generation;
+	if(
+			checkpoint.start_offset < WAL_DATA_START
+			|| checkpoint.start_offset > checkpoint.end_offset
+			|| checkpoint.start_record > checkpoint.record_count
+	) {
+		OUTPUT_ERR( "ERROR: invalid checkpoint\n" );
+		return RET_ERR;
+	}
+	if( checkpoint.end_offset > file_size ) {
+		OUTPUT_INFO( "checkpoint beyond end of log, scanning all retained records\n" );
+		checkpoint.record_count = checkpoint.start_record;
+		checkpoint.end_offset = checkpoint.start_offset;
+	}
+	struct stat stat_buf;
+	if( fstat( wal->index_fd, &stat_buf ) ) {
+		perror( "fstat" );
+		return RET_ERR;
+	}
+	if( (uint64_t )stat_buf.st_size < checkpoint.record_count * sizeof(wal_index_entry_t) ) {
+		OUTPUT_INFO( "record index incomplete, scanning all retained records\n" );
+		checkpoint.record_count = checkpoint.start_record;
+		checkpoint.end_offset = checkpoint.start_offset;
+	}
+	wal->start_record = checkpoint.start_record;
+	wal->start_offset = checkpoint.start_offset;
+	// finish punching the records dropped before a crash:
+	wal->punch_offset = checkpoint.start_offset;
+	wal->punch_record = checkpoint.start_record;
+	wal_reader_t reader;
+	if( RET_OK != wal_reader_init( &reader, wal->fd, checkpoint.end_offset, file_size ) ) {
+		return RET_ERR;
+	}
+	uint64_t record_count = checkpoint.record_count;
+	wal_record_t record;
+	while( true ) {
+		const uint64_t record_offset = wal_reader_offset( &reader );
+		if( 1 != wal_reader_next( &reader, &record ) ) {
+			break;
+		}
+		if( RET_OK != wal_write_index_entry( wal, record_count, record_offset, record.size ) ) {
+			wal_reader_exit( &reader );
+			return RET_ERR;
+		}
+		record_count++;
+	}
+	const uint64_t end_offset = wal_reader_offset( &reader );
+	wal_reader_exit( &reader );
+	OUTPUT_INFO( "log recovered: %llu records, %llu verified after checkpoint\n",
+			(unsigned long long )(record_count - wal->start_record),
+			(unsigned long long )(record_count - checkpoint.record_count)
+	);
+	if( end_offset < file_size ) {
+		OUTPUT_INFO( "dropping %llu bytes of incomplete records\n",
+				(unsigned long long )(file_size - end_offset)
+		);
+		if( ftruncate( wal->fd, end_offset ) ) {
+			perror( "ftruncate" );
+			return RET_ERR;
+		}
+	}
+	wal->record_count = record_count;
+	wal->end_offset = end_offset;
+	// (entries of truncated records are never read)
+	if( fdatasync( wal->fd ) || fdatasync( wal->index_fd ) ) {
+		perror( "fdatasync" );
+		return RET_ERR;
+	}
+	wal->synced_record_count = record_count;
+	wal->synced_offset = end_offset;
+	return wal_write_checkpoint( wal );
+}
+
+/**
+ * @return the valid checkpoint with the highest generation
+ */
+static ret_t wal_read_checkpoint(wal_t* wal, wal_checkpoint_t* checkpoint)
+{
+	bool found = false;
+	for( int slot=0; slot<2; slot++ ) {
+		wal_checkpoint_t current;
+		if( sizeof(current) != pread( wal->fd, &current, sizeof(current), slot * WAL_CHECKPOINT_SLOT_SIZE ) ) {
+			continue;
+		}
+		uint32_t crc = current.crc;
+		current.crc = 0;
+		if(
+				current.magic != WAL_MAGIC
+				|| current.version != WAL_VERSION
+				|| crc != wal_crc32( 0, &current, sizeof(current) )
+		) {
+			continue;
+		}
+		if( !found || current.generation > checkpoint->generation ) {
+			(*checkpoint) = current;
+			found = true;
+		}
+	}
+	return found ? RET_OK : RET_ERR;
+}
+
+// must be called with wal->mutex held:
+static ret_t wal_write_checkpoint(wal_t* wal)
+{
+	wal->checkpoint_generation++;
+	wal_checkpoint_t checkpoint = {
+		.magic = WAL_MAGIC,
+		.version = WAL_VERSION,
+		.crc = 0,
+		.generation = wal->checkpoint_generation,
+		.record_count = wal->synced_record_count,
+		.end_offset = wal->synced_offset,
+		.start_record = wal->start_record,
+		.start_offset = wal->start_offset,
+	};
+	checkpoint.crc = wal_crc32( 0, &checkpoint, sizeof(checkpoint) );
+	const off_t slot_offset = (checkpoint.generation % 2) * WAL_CHECKPOINT_SLOT_SIZE;
+	if( sizeof(checkpoint) != pwrite( wal->fd, &checkpoint, sizeof(checkpoint), slot_offset ) ) {
+		OUTPUT_ERR( "ERROR: failed writing checkpoint: %d - %s\n", errno, strerror(errno) );
+		return RET_ERR;
+	}
+	return RET_OK;
+}
+
+// must be called with wal->mutex held, or before any other thread uses wal:
+static ret_t wal_write_index_entry(wal_t* wal, uint64_t record_number, uint64_t record_offset, uint32_t size)
+{
+	wal_index_entry_t entry = {
+		.offset = record_offset,
+		.size = size,
+	};
+	entry.crc = wal_index_entry_crc( &entry );
+	if( sizeof(entry) != pwrite( wal->index_fd, &entry, sizeof(entry), record_number * sizeof(entry) ) ) {
+		OUTPUT_ERR( "ERROR: failed writing the record index: %d - %s\n", errno, strerror(errno) );
+		return RET_ERR;
+	}
+	return RET_OK;
+}
+
+/***********************
+ * Reader
+ ***********************/
+
+static ret_t wal_reader_init(wal_reader_t* reader, int fd, uint64_t offset, uint64_t end_offset)
+{
+	(*reader) = (wal_reader_t ){
+		.fd = fd,
+		.offset = offset,
+		.end_offset = end_offset,
+		.buffer = malloc( WAL_READ_BUFFER_SIZE ),
+		.buffer_size = WAL_READ_BUFFER_SIZE,
+	};
+	if( reader->buffer == NULL ) {
+		perror( "malloc" );
+		return RET_ERR;
+	}
+	return RET_OK;
+}
+
+static void wal_reader_exit(wal_reader_t* reader)
+{
+	FREE( reader->buffer );
+}
+
+/**
+ * Make sure @param size bytes starting at reader->pos are in the buffer.
+ * @return false if the log ends before
+ */
+static bool wal_reader_fill(wal_reader_t* reader, size_t size)
+{
+	if( reader->fill - reader->pos >= size ) {
+		return true;
+	}
+	// move the unread rest to the front:
+	memmove( reader->buffer, &reader->buffer[reader->pos], reader->fill - reader->pos );
+	reader->offset += reader->pos;
+	reader->fill -= reader->pos;
+	reader->pos = 0;
+	if( size > reader->buffer_size ) {
+		char* buffer = realloc( reader->buffer, size );
+		if( buffer == NULL ) {
+			perror( "realloc" );
+			return false;
+		}
+		reader->buffer = buffer;
+		reader->buffer_size = size;
+	}
+	while( reader->fill < size ) {
+		const uint64_t file_offset = reader->offset + reader->fill;
+		if( file_offset >= reader->end_offset ) {
+			return false;
+		}
+		size_t to_read = reader->buffer_size - reader->fill;
+		if( to_read > reader->end_offset - file_offset ) {
+			to_read = reader->end_offset - file_offset;
+		}
+		ssize_t read_ret = pread( reader->fd, &reader->buffer[reader->fill], to_read, file_offset );
+		if( read_ret == -1 && errno == EINTR ) {
+			continue;
+		}
+		if( read_ret <= 0 ) {
+			return false;
+		}
+		reader->fill += read_ret;
+	}
+	return true;
+}
+
+/**
+ * Read the next record.
+ * @param record is set to the next record, its payload is valid until the next call
+ * @return 1 on success, 0 at the end of the log, -1 if the record is incomplete or corrupt
+ */
+static int wal_reader_next(wal_reader_t* reader, wal_record_t* record)
+{
+	if( wal_reader_offset( reader ) >= reader->end_offset ) {
+		return 0;
+	}
+	if( !wal_reader_fill( reader, sizeof(wal_record_header_t) ) ) {
+		return -1;
+	}
+	wal_record_header_t header;
+	memcpy( &header, &reader->buffer[reader->pos], sizeof(header) );
+	if( header.size > WAL_MAX_RECORD_SIZE ) {
+		return -1;
+	}
+	if( !wal_reader_fill( reader, sizeof(header) + header.size ) ) {
+		return -1;
+	}
+	const char* record_payload = &reader->buffer[reader->pos + sizeof(header)];
+	if( header.crc != wal_record_crc( &header, record_payload ) ) {
+		return -1;
+	}
+	reader->pos += sizeof(header) + header.size;
+	(*record) = (wal_record_t ){
+		.payload = record_payload,
+		.size = header.size,
+		.time = header.time,
+	};
+	return 1;
+}
+
+/**
+ * @return the file offset of the next record
+ */
+static uint64_t wal_reader_offset(wal_reader_t* reader)
+{
+	return reader->offset + reader->pos;
+}
+
+/***********************
+ * Interval Sync
+ ***********************/
+
+static void* wal_sync_thread(void* void_arg)
+{
+	wal_t* wal = (wal_t* )void_arg;
+	OUTPUT_DEBUG( "wal_sync_thread: START\n" );
+	while( wal_wait( wal, wal->config.interval_ms ) ) {
+		wal_sync( wal );
+	}
+	OUTPUT_DEBUG( "wal_sync_thread: STOP\n" );
+	return NULL;
+}
+
+/**
+ * Sleep for @param timeout_ms
+ * @return false if the log is being closed
+ */
+static bool wal_wait(wal_t* wal, unsigned int timeout_ms)
+{
+	struct timespec deadline;
+	clock_gettime( CLOCK_MONOTONIC, &deadline );
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (long )(timeout_ms % 1000) * 1000000;
+	if( deadline.tv_nsec >= 1000000000 ) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	pthread_mutex_lock( &wal->mutex );
+	while( !wal->stop ) {
+		if( ETIMEDOUT == pthread_cond_timedwait( &wal->sync_cond, &wal->mutex, &deadline ) ) {
+			break;
+		}
+	}
+	const bool stop = wal->stop;
+	pthread_mutex_unlock( &wal->mutex );
+	return !stop;
+}
+
+/***********************
+ * Retention
+ ***********************/
+
+// Dropping records only moves start_offset (and writes a checkpoint),
+// readers never wait for compaction.
+// Every reader registers in the current epoch. The space of dropped
+// records is released once all readers of the epoch in which they were
+// dropped are done, so no reader ever reads a punched range.
+
+static bool wal_retention_enabled(const wal_config_t* config)
+{
+	return config->retain_bytes != 0
+		|| config->retain_packets != 0
+		|| config->retain_seconds != 0;
+}
+
+static void wal_read_begin(wal_t* wal, uint64_t* epoch, uint64_t* start_record, uint64_t* start_offset, uint64_t* end_record, uint64_t* end_offset)
+{
+	pthread_mutex_lock( &wal->mutex );
+	(*epoch) = wal->epoch;
+	wal->epoch_readers[wal->epoch % 2]++;
+	(*start_record) = wal->start_record;
+	(*start_offset) = wal->start_offset;
+	(*end_record) = wal->record_count;
+	(*end_offset) = wal->end_offset;
+	pthread_mutex_unlock( &wal->mutex );
+}
+
+static void wal_read_end(wal_t* wal, uint64_t epoch)
+{
+	pthread_mutex_lock( &wal->mutex );
+	wal->epoch_readers[epoch % 2]--;
+	pthread_mutex_unlock( &wal->mutex );
+}
+
+static void* wal_compact_thread(void* void_arg)
+{
+	wal_t* wal = (wal_t* )void_arg;
+	OUTPUT_DEBUG( "wal_compact_thread: START\n" );
+	while( wal_wait( wal, WAL_COMPACT_INTERVAL_MS ) ) {
+		wal_compact( wal );
+	}
+	OUTPUT_DEBUG( "wal_compact_thread: STOP\n" );
+	return NULL;
+}
+
+/**
+ * Release the space of records dropped in the previous epoch
+ * once its readers are done, otherwise apply the retention policy.
+ */
+static ret_t wal_compact(wal_t* wal)
+{
+	pthread_mutex_lock( &wal->mutex );
+	// records dropped, but not punched yet:
+	const bool punch_pending = (wal->punch_offset > wal->punched_offset);
+	const bool punch = punch_pending && (wal->epoch_readers[(wal->epoch - 1) % 2] == 0);
+	const uint64_t punch_offset = wal->punch_offset;
+	const uint64_t punch_record = wal->punch_record;
+	uint64_t start_record = wal->start_record;
+	uint64_t start_offset = wal->start_offset;
+	// only records on disk are dropped:
+	const uint64_t record_count = wal->synced_record_count;
+	const uint64_t end_offset = wal->synced_offset;
+	pthread_mutex_unlock( &wal->mutex );
+	// 1. punch.
+	// Nothing is dropped meanwhile, so each epoch slot is free again
+	// before it is reused:
+	if( punch_pending ) {
+		if( !punch ) {
+			return RET_OK;
+		}
+		// the checkpoint which no longer references the range must be on disk first:
+		if( fdatasync( wal->fd ) ) {
+			perror( "fdatasync" );
+			return RET_ERR;
+		}
+		if( fallocate(
+				wal->fd,
+				FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				wal->punched_offset,
+				punch_offset - wal->punched_offset
+		) ) {
+			OUTPUT_ERR( "ERROR: fallocate: %d - %s\n", errno, strerror(errno) );
+		}
+		if( punch_record > wal->punched_record && fallocate(
+				wal->index_fd,
+				FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				wal->punched_record * sizeof(wal_index_entry_t),
+				(punch_record - wal->punched_record) * sizeof(wal_index_entry_t)
+		) ) {
+			OUTPUT_ERR( "ERROR: fallocate: %d - %s\n", errno, strerror(errno) );
+		}
+		pthread_mutex_lock( &wal->mutex );
+		wal->punched_offset = punch_offset;
+		wal->punched_record = punch_record;
+		pthread_mutex_unlock( &wal->mutex );
+		return RET_OK;
+	}
+	// 2. find the first record to keep:
+	wal_reader_t reader;
+	if( RET_OK != wal_reader_init( &reader, wal->fd, start_offset, end_offset ) ) {
+		return RET_ERR;
+	}
+	const int64_t now = time(NULL);
+	wal_record_t record;
+	while( true ) {
+		const uint64_t record_offset = wal_reader_offset( &reader );
+		bool drop =
+			(wal->config.retain_packets != 0 && record_count - start_record > wal->config.retain_packets)
+			|| (wal->config.retain_bytes != 0 && end_offset - record_offset > wal->config.retain_bytes);
+		if( 1 != wal_reader_next( &reader, &record ) ) {
+			break;
+		}
+		drop = drop
+			|| (wal->config.retain_seconds != 0 && now - record.time > (int64_t )wal->config.retain_seconds);
+		if( !drop ) {
+			break;
+		}
+		start_record++;
+		start_offset = wal_reader_offset( &reader );
+	}
+	wal_reader_exit( &reader );
+	// 3. drop:
+	ret_t ret = RET_OK;
+	pthread_mutex_lock( &wal->mutex );
+	if( start_offset > wal->start_offset ) {
+		OUTPUT_DEBUG( "wal_compact: dropping %llu records\n",
+				(unsigned long long )(start_record - wal->start_record)
+		);
+		wal->start_record = start_record;
+		wal->start_offset = start_offset;
+		ret = wal_write_checkpoint( wal );
+		// readers starting from now on never touch the dropped records:
+		wal->epoch++;
+		wal->punch_offset = start_offset;
+		wal->punch_record = start_record;
+	}
+	pthread_mutex_unlock( &wal->mutex );
+	return ret;
+}
+
+/***********************
+ * CRC
+ ***********************/
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void wal_crc32_init_table(void)
+{
+	for( uint32_t i=0; i<256; i++ ) {
+		uint32_t value = i;
+		for( int bit=0; bit<8; bit++ ) {
+			value = (value & 1) ? (0xEDB88320u ^ (value >> 1)) : (value >> 1);
+		}
+		crc_table[i] = value;
+	}
+}
+
+/**
+ * crc32 (IEEE 802.3), continue a previous checksum by passing it as @param crc,
+ * start with 0
+ */
+static uint32_t wal_crc32(uint32_t crc, const void* data, size_t size)
+{
+	pthread_once( &crc_table_once, wal_crc32_init_table );
+	const uint8_t* bytes = data;
+	crc = ~crc;
+	for( size_t i=0; i<size; i++ ) {
+		crc = crc_table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+static uint32_t wal_index_entry_crc(const wal_index_entry_t* entry)
+{
+	uint32_t crc = wal_crc32( 0, &entry->offset, sizeof(entry->offset) );
+	return wal_crc32( crc, &entry->size, sizeof(entry->size) );
+}
+
+static uint32_t wal_record_crc(const wal_record_header_t* header, const char* payload)
+{
+	uint32_t crc = wal_crc32( 0, &header->size, sizeof(header->size) );
+	crc = wal_crc32( crc, &header->time, sizeof(header->time) );
+	return wal_crc32( crc, payload, header->size );
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+/*
+ * Write ahead log for the durable mode of the file backend.
+ *
+ * Every packet is appended as one record (length, crc32, payload).
+ * A checkpoint (number of records and end offset known to be on disk)
+ * is kept in the file header, so that recovery after a restart or crash
+ * only has to verify the records written after the last checkpoint.
+ * A record index file next to the log keeps the offset and size of every
+ * record, the history is indexed at startup without reading the records.
+ * With a retention policy, a background thread drops the oldest records
+ * and releases their disk space.
+ */
+
+#include "server_impl.h"
+
+#include <stdint.h>
+
+typedef struct wal wal_t;
+
+// open or create the log, recover after a crash:
+wal_t* wal_open(
+		const char* filename,
+		const wal_config_t* config
+);
+// *record_offset is set to the file offset of the new record:
+ret_t wal_append(
+		wal_t* wal,
+		const char* data,
+		size_t size,
+		uint64_t* record_offset
+);
+// flush appended records to disk:
+ret_t wal_sync(wal_t* wal);
+// pass the file offsets and payloads of all records to callback:
+typedef ret_t (*wal_read_callback_t)(void* arg, uint64_t record_offset, const char* data, size_t size);
+ret_t wal_read(
+		wal_t* wal,
+		wal_read_callback_t callback,
+		void* arg
+);
+// records [first_record, end_record) only (numbers as in wal_start_record, 0: the first retained),
+// fails if first_record has been dropped already.
+// Reading starts at first_offset, the file offset of first_record as passed to callback
+// or set by wal_append, 0 to find it by scanning from the first retained record:
+ret_t wal_read_range(
+		wal_t* wal,
+		uint64_t first_record,
+		uint64_t first_offset,
+		uint64_t end_record,
+		wal_read_callback_t callback,
+		void* arg
+);
+// pass the file offsets and payload sizes of the records before end_record to callback,
+// from the record index, without reading the records:
+typedef ret_t (*wal_index_callback_t)(void* arg, uint64_t record_number, uint64_t record_offset, size_t size);
+ret_t wal_read_index(
+		wal_t* wal,
+		uint64_t end_record,
+		wal_index_callback_t callback,
+		void* arg
+);
+// write the payloads of all records to output:
+ret_t wal_replay(
+		wal_t* wal,
+		socket_output_t* output
+);
+uint64_t wal_record_count(wal_t* wal);
+// true if a retention policy drops old records:
+bool wal_has_retention(wal_t* wal);
+// number of records dropped by the retention policy so far:
+uint64_t wal_start_record(wal_t* wal);
+// number of the next record appended:
+uint64_t wal_end_record(wal_t* wal);
+// sync and stop appending, before another process opens the log,
+// the records stay readable until wal_close:
+ret_t wal_stop(wal_t* wal);
+// stop and close:
+ret_t wal_close(wal_t* wal);
@@ -0,0 +1,102 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include "../../aesd-char-driver/aesd-lockfree-ring.h"
+
+AESD_SPSC_RING_DECLARE(test_spsc_ring, uint32_t, 4)
+AESD_MPSC_RING_DECLARE(test_mpsc_ring, uint32_t, 4)
+
+#define TRANSFER_COUNT 200000
+#define PRODUCER_COUNT 4
+
+static struct test_spsc_ring spsc_ring;
+static struct test_mpsc_ring mpsc_ring;
+
+static void* spsc_producer(void* arg)
+{
+	for( uint32_t i=0; i<TRANSFER_COUNT; ) {
+		if( test_spsc_ring_push( &spsc_ring, &i ) ) {
+			i++;
+		}
+		else {
+			sched_yield();
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Verify that all elements pushed by one thread arrive in order at another thread
+ */
+void test_spsc_ring_threads()
+{
+	test_spsc_ring_init( &spsc_ring );
+	pthread_t producer;
+	TEST_ASSERT_EQUAL_INT_MESSAGE( 0, pthread_create( &producer, NULL, spsc_producer, NULL ), "pthread_create failed" );
+	bool in_order = true;
+	for( uint32_t expected=0; expected<TRANSFER_COUNT; ) {
+		uint32_t value;
+		if( test_spsc_ring_pop( &spsc_ring, &value ) ) {
+			in_order = in_order && (value == expected);
+			expected++;
+		}
+		else {
+			sched_yield();
+		}
+	}
+	pthread_join( producer, NULL );
+	TEST_ASSERT_TRUE_MESSAGE( in_order, "elements should arrive in the order they were pushed" );
+	TEST_ASSERT_EQUAL_UINT32_MESSAGE( 0, test_spsc_ring_count( &spsc_ring ), "ring should be empty" );
+}
+
+static void* mpsc_producer(void* arg)
+{
+	uint32_t producer = (uint32_t )(uintptr_t )arg;
+	for( uint32_t i=0; i<TRANSFER_COUNT; ) {
+		// producer index in the upper bits, sequence in the lower bits:
+		uint32_t value = (producer << 24) | i;
+		if( test_mpsc_ring_push( &mpsc_ring, &value ) ) {
+			i++;
+		}
+		else {
+			sched_yield();
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Verify that the elements of every producer arrive completely and in order
+ */
+void test_mpsc_ring_threads()
+{
+	test_mpsc_ring_init( &mpsc_ring );
+	pthread_t producers[PRODUCER_COUNT];
+	for( uint32_t i=0; i<PRODUCER_COUNT; i++ ) {
+		TEST_ASSERT_EQUAL_INT_MESSAGE( 0, pthread_create( &producers[i], NULL, mpsc_producer, (void* )(uintptr_t )i ), "pthread_create failed" );
+	}
+	uint32_t expected[PRODUCER_COUNT] = { 0 };
+	bool in_order = true;
+	for( uint32_t received=0; received<PRODUCER_COUNT * TRANSFER_COUNT; ) {
+		uint32_t value;
+		if( test_mpsc_ring_pop( &mpsc_ring, &value ) ) {
+			uint32_t producer = value >> 24;
+			in_order = in_order && (producer < PRODUCER_COUNT) && ((value & 0xffffff) == expected[producer]);
+			if( producer < PRODUCER_COUNT ) {
+				expected[producer]++;
+			}
+			received++;
+		}
+		else {
+			sched_yield();
+		}
+	}
+	for( uint32_t i=0; i<PRODUCER_COUNT; i++ ) {
+		pthread_join( producers[i], NULL );
+	}
+	TEST_ASSERT_TRUE_MESSAGE( in_order, "elements of each producer should arrive in the order they were pushed" );
+	uint32_t value;
+	TEST_ASSERT_FALSE_MESSAGE( test_mpsc_ring_pop( &mpsc_ring, &value ), "ring should be empty" );
+}
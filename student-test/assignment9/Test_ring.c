@@ -0,0 +1,103 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include "../../aesd-char-driver/aesd-ring.h"
+
+AESD_RING_DECLARE(test_ring, uint32_t, 3)
+
+/**
+ * Verify push/pop order, wrap around of the head/tail counters
+ * and bulk operations of the single threaded ring
+ */
+void test_ring_fifo()
+{
+	struct test_ring ring;
+	test_ring_init( &ring );
+	// start close to the wrap around of the counters:
+	ring.head = ring.tail = UINT32_MAX - 3;
+	uint32_t values[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+	TEST_ASSERT_EQUAL_UINT32_MESSAGE( 8, test_ring_push_bulk( &ring, values, 8 ), "bulk push should fill the ring" );
+	TEST_ASSERT_TRUE_MESSAGE( test_ring_full( &ring ), "ring should be full" );
+	uint32_t value = 8;
+	TEST_ASSERT_FALSE_MESSAGE( test_ring_push( &ring, &value ), "push into a full ring should fail" );
+	uint32_t dropped;
+	TEST_ASSERT_TRUE_MESSAGE( test_ring_push_overwrite( &ring, &value, &dropped ), "push_overwrite should drop an element" );
+	TEST_ASSERT_EQUAL_UINT32_MESSAGE( 0, dropped, "the oldest element should be dropped" );
+	uint32_t index;
+	uint32_t* entry;
+	uint32_t expected = 1;
+	AESD_RING_FOREACH(entry,&ring,index) {
+		TEST_ASSERT_EQUAL_UINT32_MESSAGE( expected, *entry, "iteration should start with the oldest element" );
+		expected++;
+	}
+	uint32_t popped[8];
+	TEST_ASSERT_EQUAL_UINT32_MESSAGE( 8, test_ring_pop_bulk( &ring, popped, 10 ), "bulk pop should empty the ring" );
+	for( uint32_t i=0; i<8; i++ ) {
+		TEST_ASSERT_EQUAL_UINT32_MESSAGE( i+1, popped[i], "elements should be popped in order" );
+	}
+	TEST_ASSERT_FALSE_MESSAGE( test_ring_pop( &ring, &value ), "pop from an empty ring should fail" );
+}
+
+/**
+ * Verify that single and bulk operations agree while the elements
+ * wrap around the end of the entry array
+ */
+void test_ring_wraparound()
+{
+	struct test_ring ring;
+	test_ring_init( &ring );
+	uint32_t next_push = 0;
+	uint32_t next_pop = 0;
+	// every round starts at another entry index:
+	for( uint32_t round=0; round<20; round++ ) {
+		uint32_t values[5];
+		for( uint32_t i=0; i<5; i++ ) {
+			values[i] = next_push + i;
+		}
+		TEST_ASSERT_EQUAL_UINT32_MESSAGE( 5, test_ring_push_bulk( &ring, values, 5 ), "bulk push should fit" );
+		next_push += 5;
+		TEST_ASSERT_TRUE_MESSAGE( test_ring_push( &ring, &next_push ), "push should fit" );
+		next_push++;
+		for( uint32_t i=0; i<5; i++ ) {
+			values[i] = next_push + i;
+		}
+		TEST_ASSERT_EQUAL_UINT32_MESSAGE( 2, test_ring_push_bulk( &ring, values, 5 ), "bulk push should stop at the capacity" );
+		next_push += 2;
+		TEST_ASSERT_TRUE_MESSAGE( test_ring_full( &ring ), "ring should be full" );
+		TEST_ASSERT_EQUAL_UINT32_MESSAGE( next_pop + 1, *test_ring_peek( &ring, 1 ), "peek should count from the oldest element" );
+		TEST_ASSERT_TRUE_MESSAGE( test_ring_peek( &ring, 8 ) == NULL, "peek behind the newest element should fail" );
+		uint32_t index;
+		uint32_t* entry;
+		uint32_t expected = next_pop;
+		AESD_RING_FOREACH(entry,&ring,index) {
+			TEST_ASSERT_EQUAL_UINT32_MESSAGE( expected, *entry, "iteration should follow the wrap around" );
+			expected++;
+		}
+		TEST_ASSERT_EQUAL_UINT32_MESSAGE( next_push, expected, "iteration should visit every element" );
+		uint32_t popped[5];
+		TEST_ASSERT_EQUAL_UINT32_MESSAGE( 4, test_ring_pop_bulk( &ring, popped, 4 ), "bulk pop should take 4 elements" );
+		for( uint32_t i=0; i<4; i++ ) {
+			TEST_ASSERT_EQUAL_UINT32_MESSAGE( next_pop + i, popped[i], "bulk pop should keep the order" );
+		}
+		next_pop += 4;
+		uint32_t value;
+		TEST_ASSERT_TRUE_MESSAGE( test_ring_pop( &ring, &value ), "pop should succeed" );
+		TEST_ASSERT_EQUAL_UINT32_MESSAGE( next_pop, value, "pop should keep the order" );
+		next_pop++;
+		TEST_ASSERT_EQUAL_UINT32_MESSAGE( 3, test_ring_pop_bulk( &ring, popped, 5 ), "bulk pop should stop at the count" );
+		for( uint32_t i=0; i<3; i++ ) {
+			TEST_ASSERT_EQUAL_UINT32_MESSAGE( next_pop + i, popped[i], "bulk pop should keep the order" );
+		}
+		next_pop += 3;
+		TEST_ASSERT_TRUE_MESSAGE( test_ring_empty( &ring ), "ring should be empty" );
+		// shift the start index for the next round:
+		for( uint32_t i=0; i<=round % 3; i++ ) {
+			uint32_t dropped = UINT32_MAX;
+			TEST_ASSERT_FALSE_MESSAGE( test_ring_push_overwrite( &ring, &next_push, &dropped ), "push_overwrite into a ring with space should not drop" );
+			TEST_ASSERT_EQUAL_UINT32_MESSAGE( UINT32_MAX, dropped, "nothing should be dropped" );
+			TEST_ASSERT_TRUE_MESSAGE( test_ring_pop( &ring, &value ), "pop should succeed" );
+			next_push++;
+			next_pop++;
+		}
+	}
+}